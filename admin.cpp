@@ -0,0 +1,277 @@
+#include "admin.h"
+#include "topic_set.h"
+#include "compress.h"
+
+#include <sstream>
+
+int admin_listen(const char *path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    DIE(fd < 0, "admin socket() failed");
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    DIE(strlen(path) >= sizeof(addr.sun_path), "admin socket path too long");
+    strcpy(addr.sun_path, path);
+
+    // Remove a socket file left behind by a previous run
+    unlink(path);
+
+    int rc = bind(fd, (sockaddr*)&addr, sizeof(addr));
+    DIE(rc < 0, "admin bind() failed");
+    rc = listen(fd, SOMAXCONN);
+    DIE(rc < 0, "admin listen() failed");
+
+    return fd;
+}
+
+void admin_accept(int admin_fd, ServerState& state, std::vector<struct pollfd>& poll_fds) {
+    while (true) {
+        int fd = accept4(admin_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            DIE(errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED,
+                "admin accept() failed");
+            return;
+        }
+
+        admin_conn_t *conn = new admin_conn_t{};
+        conn->query = ADMIN_IDLE;
+        state.admin_conns[fd] = conn;
+        poll_fds.push_back({fd, POLLIN, 0});
+    }
+}
+
+void admin_close(int fd, ServerState& state, std::vector<struct pollfd>& poll_fds, uint64_t index) {
+    delete state.admin_conns[fd];
+    state.admin_conns.erase(fd);
+    close(fd);
+    poll_fds.erase(poll_fds.begin() + index);
+}
+
+// Force a client off the server; the poll loop then sees the hangup and
+// closes the socket
+static void admin_kick(admin_conn_t *conn, ServerState& state, const std::string& id) {
+    auto it = state.clients.find(id);
+    if (it == state.clients.end()) {
+        conn->out += "ERR unknown client\n";
+        return;
+    }
+
+    tcp_client_t *client = it->second;
+    if (!client->connected) {
+        conn->out += "ERR client not connected\n";
+        return;
+    }
+
+    // The fd stops naming the client now: a reconnect may come in before
+    // the hangup of the old fd is seen
+    shutdown(client->fd, SHUT_RDWR);
+    state.fd_clients.erase(client->fd);
+    client->connected = false;
+    shm_writer_detach(client->ring);
+    client->ring = nullptr;
+    compress_leave(state, client);
+    std::cout << "Client " << id << " disconnected.\n";
+    conn->out += "END\n";
+}
+
+static void admin_start(admin_conn_t *conn, ServerState& state, char *line) {
+    char *argv[MESSAGES_SIZE];
+    int argc = string_to_argv(line, argv, MESSAGES_SIZE);
+    if (argc == 0)
+        return;
+
+    conn->filter.clear();
+    conn->cursor.clear();
+    conn->position = 0;
+    conn->started = false;
+    conn->total = 0;
+
+    if (argc == 1 && strcmp(argv[0], "clients") == 0) {
+        conn->query = ADMIN_CLIENTS;
+    } else if ((argc == 1 || argc == 2) && strcmp(argv[0], "subs") == 0) {
+        conn->query = ADMIN_SUBS;
+        if (argc == 2)
+            conn->filter = argv[1];
+    } else if (argc == 1 && strcmp(argv[0], "sf") == 0) {
+        conn->query = ADMIN_SF;
+    } else if (argc == 1 && strcmp(argv[0], "topics") == 0) {
+        conn->query = ADMIN_TOPICS;
+    } else if (argc == 1 && strcmp(argv[0], "stats") == 0) {
+        metrics_snapshot_t snap;
+        metrics_collect(snap);
+        std::ostringstream line_out;
+        metrics_print_line(snap, line_out);
+        conn->out += line_out.str() + "END\n";
+    } else if (argc == 2 && strcmp(argv[0], "kick") == 0) {
+        admin_kick(conn, state, argv[1]);
+    } else {
+        conn->out += "ERR usage: clients | subs [ID] | sf | topics | stats | kick ID\n";
+    }
+}
+
+static void append_address(std::string& out, ServerState& state, int fd) {
+    auto it = state.client_addresses.find(fd);
+    if (it == state.client_addresses.end())
+        return;
+    out += ' ';
+    out += inet_ntoa(it->second.first);
+    out += ':';
+    out += std::to_string(ntohs(it->second.second));
+}
+
+static void append_subscriptions(std::string& out, const tcp_client_t *client) {
+    for (size_t i = 0; i < topic_set_size(client->topics); ++i) {
+        out += client->id;
+        out += ' ';
+        out += client->topics->patterns[i]->pattern;
+        out += topic_set_sf(client->topics, i) ? " 1\n" : " 0\n";
+    }
+}
+
+// Emit the next batch of a client-table query. The client list only ever
+// grows, so an index stays valid between batches.
+static void admin_generate_clients(admin_conn_t *conn, ServerState& state) {
+    if (!conn->filter.empty()) {
+        auto it = state.clients.find(conn->filter);
+        if (it == state.clients.end()) {
+            conn->out += "ERR unknown client\n";
+        } else {
+            append_subscriptions(conn->out, it->second);
+            conn->out += "END\n";
+        }
+        conn->query = ADMIN_IDLE;
+        return;
+    }
+
+    const auto& list = state.client_list;
+    for (int n = 0; n < ADMIN_BATCH && conn->position < list.size(); conn->position++) {
+        const tcp_client_t *client = &list[conn->position];
+
+        switch (conn->query) {
+            case ADMIN_CLIENTS:
+                conn->out += client->id;
+                conn->out += client->connected ? " connected" : " offline";
+                if (client->connected)
+                    append_address(conn->out, state, client->fd);
+                conn->out += '\n';
+                break;
+            case ADMIN_SUBS:
+                append_subscriptions(conn->out, client);
+                n += topic_set_size(client->topics);
+                break;
+            case ADMIN_SF:
+                if (!client->lost_messages.empty())
+                    conn->out += std::string(client->id) + " " + std::to_string(client->lost_messages.size()) + "\n";
+                break;
+            default:
+                break;
+        }
+
+        n++;
+        conn->total++;
+    }
+
+    if (conn->position == list.size()) {
+        conn->out += "END " + std::to_string(conn->total) + "\n";
+        conn->query = ADMIN_IDLE;
+    }
+}
+
+static void admin_generate_topics(admin_conn_t *conn, ServerState& state) {
+    auto it = conn->started ? state.subscriptions.upper_bound(conn->cursor)
+                            : state.subscriptions.begin();
+
+    for (int n = 0; n < ADMIN_BATCH && it != state.subscriptions.end(); ++it, ++n) {
+        conn->out += it->first + " " + std::to_string(it->second.subscribers.size()) + "\n";
+        conn->total++;
+        conn->cursor = it->first;
+        conn->started = true;
+    }
+
+    if (it == state.subscriptions.end()) {
+        conn->out += "END " + std::to_string(conn->total) + "\n";
+        conn->query = ADMIN_IDLE;
+    }
+}
+
+// Write as much pending output as the socket takes without blocking
+static bool admin_flush(int fd, admin_conn_t *conn) {
+    while (conn->out_off < conn->out.size()) {
+        ssize_t rc = send(fd, conn->out.data() + conn->out_off,
+                          conn->out.size() - conn->out_off, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (rc < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return false;
+        }
+        conn->out_off += rc;
+    }
+
+    if (conn->out_off == conn->out.size()) {
+        conn->out.clear();
+        conn->out_off = 0;
+    }
+    return true;
+}
+
+bool admin_handle(int fd, ServerState& state, std::vector<struct pollfd>& poll_fds, uint64_t index) {
+    admin_conn_t *conn = state.admin_conns[fd];
+    struct pollfd& pfd = poll_fds[index];
+
+    if (pfd.revents & POLLIN) {
+        char buff[MESSAGES_SIZE];
+        ssize_t rc = recv(fd, buff, sizeof(buff), MSG_DONTWAIT);
+        if (rc == 0 || (rc < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            admin_close(fd, state, poll_fds, index);
+            return true;
+        }
+        if (rc > 0)
+            conn->in.append(buff, rc);
+        if (conn->in.size() > ADMIN_IN_LIMIT) {
+            admin_close(fd, state, poll_fds, index);
+            return true;
+        }
+    } else if (pfd.revents & (POLLERR | POLLHUP)) {
+        admin_close(fd, state, poll_fds, index);
+        return true;
+    }
+
+    // Start queued commands one at a time, generating a bounded batch each
+    while (conn->out.size() < ADMIN_OUT_LIMIT) {
+        if (conn->query == ADMIN_IDLE) {
+            // No command is anywhere near MESSAGES_SIZE; a longer line is garbage
+            size_t eol = conn->in.find('\n');
+            if (std::min(eol, conn->in.size()) > MESSAGES_SIZE) {
+                admin_close(fd, state, poll_fds, index);
+                return true;
+            }
+            if (eol == std::string::npos)
+                break;
+
+            std::string line = conn->in.substr(0, eol);
+            conn->in.erase(0, eol + 1);
+            admin_start(conn, state, &line[0]);
+            continue;
+        }
+
+        if (conn->query == ADMIN_TOPICS)
+            admin_generate_topics(conn, state);
+        else
+            admin_generate_clients(conn, state);
+
+        // An unfinished query yields to the rest of the event loop
+        if (conn->query != ADMIN_IDLE)
+            break;
+    }
+
+    if (!admin_flush(fd, conn)) {
+        admin_close(fd, state, poll_fds, index);
+        return true;
+    }
+
+    // Ask for POLLOUT while there is output or an unfinished query
+    bool busy = !conn->out.empty() || conn->query != ADMIN_IDLE ||
+                conn->in.find('\n') != std::string::npos;
+    pfd.events = POLLIN | (busy ? POLLOUT : 0);
+    return false;
+}
@@ -0,0 +1,92 @@
+#ifndef ADMIN_H
+#define ADMIN_H
+
+#include "server.h"
+
+#include <sys/un.h>
+
+/**
+ * @brief Entries produced per admin connection and event loop iteration
+ *
+ * Keeps a dump of a huge client table from starving message delivery.
+ */
+#define ADMIN_BATCH 256
+
+/**
+ * @brief Pending output above which no new entries are generated
+ */
+#define ADMIN_OUT_LIMIT (64 * 1024)
+
+/**
+ * @brief Unprocessed input above which a connection is closed
+ *
+ * Commands are short; this much input is a line that never ends or a
+ * flood of queued commands.
+ */
+#define ADMIN_IN_LIMIT (64 * 1024)
+
+/**
+ * @brief Queries that are answered over several loop iterations
+ */
+enum admin_query_t {
+    ADMIN_IDLE,         ///< No response in progress
+    ADMIN_CLIENTS,      ///< Connected and offline clients
+    ADMIN_SUBS,         ///< Subscriptions (and SF flags) per client
+    ADMIN_SF,           ///< SF backlog per client
+    ADMIN_TOPICS        ///< Subscribers per subscription pattern
+};
+
+/**
+ * @brief State of one connection on the admin socket
+ */
+struct admin_conn_t {
+    std::string in;             ///< Bytes of an incomplete command line
+    std::string out;            ///< Response bytes not yet written
+    size_t out_off;             ///< Bytes of `out` already written
+    admin_query_t query;        ///< Query being generated
+    std::string filter;         ///< Client ID the query is restricted to (may be empty)
+    std::string cursor;         ///< Last pattern emitted by a topics query
+    size_t position;            ///< Next index into the client list
+    bool started;               ///< Whether any key was emitted yet
+    uint64_t total;             ///< Entries emitted so far
+};
+
+/**
+ * @brief Create the listening admin socket
+ *
+ * @param path Filesystem path of the UNIX socket
+ * @return int Listening socket file descriptor
+ */
+int admin_listen(const char *path);
+
+/**
+ * @brief Accept pending admin connections
+ *
+ * @param admin_fd Listening admin socket
+ * @param state Server state
+ * @param poll_fds List of poll file descriptors
+ */
+void admin_accept(int admin_fd, ServerState& state, std::vector<struct pollfd>& poll_fds);
+
+/**
+ * @brief Serve an admin connection that became readable or writable
+ *
+ * @param fd Admin connection file descriptor
+ * @param state Server state
+ * @param poll_fds List of poll file descriptors
+ * @param index Index of the connection in the poll_fds array
+ * @return true if the connection was closed and removed from poll_fds
+ */
+bool admin_handle(int fd, ServerState& state, std::vector<struct pollfd>& poll_fds, uint64_t index);
+
+/**
+ * @brief Close an admin connection and forget its state
+ *
+ * @param fd Admin connection file descriptor
+ * @param state Server state
+ * @param poll_fds List of poll file descriptors
+ * @param index Index of the connection in the poll_fds array
+ */
+void admin_close(int fd, ServerState& state, std::vector<struct pollfd>& poll_fds, uint64_t index);
+
+#endif // ADMIN_H
@@ -0,0 +1,179 @@
+#include "aggregate.h"
+
+#include <limits>
+
+void aggregate_subscribe(ServerState& state, tcp_client_t* client, const std::string& pattern,
+                         uint32_t window_ms) {
+    if (!state.aggregates) {
+        state.aggregates = new aggregator_t;
+    }
+
+    auto [it, inserted] = state.aggregates->subscriptions.try_emplace({pattern, window_ms});
+    aggregate_subscription_t& subscription = it->second;
+    if (inserted) {
+        subscription.pattern = pattern;
+        subscription.matcher = topic_compile(pattern);
+        subscription.window_ms = window_ms;
+    }
+
+    auto& subs = subscription.subscribers;
+    if (std::find(subs.begin(), subs.end(), client) == subs.end()) {
+        subs.push_back(client);
+    }
+}
+
+void aggregate_unsubscribe(ServerState& state, tcp_client_t* client, const std::string& pattern) {
+    if (!state.aggregates) {
+        return;
+    }
+
+    // Patterns nobody asks for any more stop being evaluated
+    auto& subscriptions = state.aggregates->subscriptions;
+    for (auto it = subscriptions.lower_bound({pattern, 0});
+         it != subscriptions.end() && it->first.first == pattern;) {
+        auto& subs = it->second.subscribers;
+        subs.erase(std::remove(subs.begin(), subs.end(), client), subs.end());
+        it = subs.empty() ? subscriptions.erase(it) : std::next(it);
+    }
+}
+
+void aggregate_message(ServerState& state, const stored_message_t* message, const topic_view_t& topic) {
+    aggregator_t& aggregator = *state.aggregates;
+    decoded_message_t value;
+    bool decoded = false;
+
+    for (const auto& [key, subscription] : aggregator.subscriptions) {
+        if (!topic_matches(subscription.matcher, topic)) {
+            continue;
+        }
+
+        // Decode once, and only numbers
+        if (!decoded) {
+            if (!message_decode(message->buff, message->len, value) ||
+                (value.type != INT && value.type != SHORT_REAL && value.type != FLOAT)) {
+                return;
+            }
+            if (value.type == INT) {
+                value.real = value.integer;
+                value.precision = 0;
+            }
+            decoded = true;
+        }
+
+        // The topic is only copied when a window opens for it
+        uint32_t window_ms = subscription.window_ms;
+        std::string_view name(topic.text, topic.len);
+        auto it = aggregator.windows.find(std::make_pair(name, window_ms));
+        bool opened = it == aggregator.windows.end();
+        if (opened) {
+            it = aggregator.windows.try_emplace({std::string(name), window_ms}).first;
+        }
+        aggregate_window_t& window = it->second;
+        if (opened) {
+            window.minimum = std::numeric_limits<double>::infinity();
+            window.maximum = -std::numeric_limits<double>::infinity();
+            window.sum = 0;
+            window.count = 0;
+            window.precision = 0;
+            window.due_ns = monotonic_ns() + window_ms * 1000000ull;
+            aggregator.next_due_ns = std::min(aggregator.next_due_ns, window.due_ns);
+        } else if (window.last_seq == message->seq) {
+            continue;  // Another pattern of the same window length matched first
+        }
+        window.last_seq = message->seq;
+        memcpy(window.source, message->buff, SOURCE_HEADER_SIZE);
+        window.minimum = std::min(window.minimum, value.real);
+        window.maximum = std::max(window.maximum, value.real);
+        window.sum += value.real;
+        window.count++;
+        window.precision = std::max(window.precision, value.precision);
+    }
+}
+
+// Frame a closed window as an AGGREGATE_VALUE message
+static stored_message_t* aggregate_frame(ServerState& state, const std::string& topic, uint32_t window_ms,
+                                         const aggregate_window_t& window) {
+    stored_message_t* message = message_alloc(SOURCE_HEADER_SIZE + TOPIC_MAX_LEN + 1 + AGGREGATE_PAYLOAD_SIZE);
+    message->seq = ++state.last_seq;
+    message->len = SOURCE_HEADER_SIZE + TOPIC_MAX_LEN + 1 + AGGREGATE_PAYLOAD_SIZE;
+
+    char* pos = message->buff;
+    memcpy(pos, window.source, SOURCE_HEADER_SIZE);
+    pos += SOURCE_HEADER_SIZE;
+    memset(pos, 0, TOPIC_MAX_LEN);
+    memcpy(pos, topic.data(), topic.size());
+    pos += TOPIC_MAX_LEN;
+    *pos++ = AGGREGATE_VALUE;
+
+    uint32_t net_value = htonl(window_ms);
+    memcpy(pos, &net_value, sizeof(net_value));
+    net_value = htonl(window.count);
+    memcpy(pos + 4, &net_value, sizeof(net_value));
+    pos[8] = window.precision;
+
+    double values[3] = {window.minimum, window.maximum, window.sum / window.count};
+    for (int i = 0; i < 3; ++i) {
+        uint64_t bits;
+        memcpy(&bits, &values[i], sizeof(bits));
+        bits = htobe64(bits);
+        memcpy(pos + 9 + i * sizeof(bits), &bits, sizeof(bits));
+    }
+    return message;
+}
+
+int aggregate_poll(ServerState& state) {
+    if (!state.aggregates || state.aggregates->windows.empty()) {
+        return -1;
+    }
+
+    aggregator_t& aggregator = *state.aggregates;
+    uint64_t now = monotonic_ns();
+    if (now < aggregator.next_due_ns) {
+        return (aggregator.next_due_ns - now + 999999) / 1000000;
+    }
+
+    metrics_t& metrics = local_metrics();
+    aggregator.next_due_ns = UINT64_MAX;
+    for (auto it = aggregator.windows.begin(); it != aggregator.windows.end();) {
+        const auto& [topic, window_ms] = it->first;
+        if (it->second.due_ns > now) {
+            aggregator.next_due_ns = std::min(aggregator.next_due_ns, it->second.due_ns);
+            ++it;
+            continue;
+        }
+
+        topic_view_t view;
+        topic_view_init(view, topic.data(), topic.size());
+
+        // Recipients: subscribers of every pattern of this window length that
+        // matches, each listed once, marked as route_message marks them
+        auto& recipients = state.recipients;
+        recipients.clear();
+        for (const auto& [key, subscription] : aggregator.subscriptions) {
+            if (subscription.window_ms == window_ms && topic_matches(subscription.matcher, view)) {
+                for (auto* client : subscription.subscribers) {
+                    if (client->connected && !client->routed) {
+                        client->routed = true;
+                        recipients.push_back(client);
+                    }
+                }
+            }
+        }
+
+        if (!recipients.empty()) {
+            stored_message_t* message = aggregate_frame(state, topic, window_ms, it->second);
+            for (auto* client : recipients) {
+                client->routed = false;
+                metrics.bytes_sent.add(client_send(client, message, nullptr, 0));
+                metrics.sends.add(1);
+            }
+            free(message);
+        }
+        it = aggregator.windows.erase(it);
+    }
+
+    if (aggregator.windows.empty()) {
+        return -1;
+    }
+    return (aggregator.next_due_ns - now + 999999) / 1000000;
+}
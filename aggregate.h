@@ -0,0 +1,107 @@
+#ifndef AGGREGATE_H
+#define AGGREGATE_H
+
+#include "server.h"
+
+/**
+ * @brief Shortest aggregation window accepted (milliseconds)
+ */
+#define AGGREGATE_WINDOW_MIN_MS 10
+
+/**
+ * @brief Longest aggregation window accepted (milliseconds)
+ */
+#define AGGREGATE_WINDOW_MAX_MS 3600000
+
+/**
+ * @brief An aggregate subscription: a pattern, a window and its subscribers
+ */
+struct aggregate_subscription_t {
+    std::string pattern;                    ///< Pattern as sent by the clients
+    topic_matcher_t matcher;                ///< Compiled pattern
+    uint32_t window_ms;                     ///< Window length
+    std::vector<tcp_client_t*> subscribers; ///< Clients that asked for it
+};
+
+/**
+ * @brief Running aggregate of one topic over one window
+ *
+ * Kept once per topic and window length, however many subscriptions and
+ * subscribers it serves.
+ */
+struct aggregate_window_t {
+    char source[SOURCE_HEADER_SIZE];    ///< Source header of the last value
+    double minimum;
+    double maximum;
+    double sum;
+    uint32_t count;
+    int precision;                      ///< Decimals of the most precise value
+    uint64_t due_ns;                    ///< Monotonic time the window closes
+    uint64_t last_seq;                  ///< Last message counted, so none counts twice
+};
+
+/**
+ * @brief Orders window keys by topic, then window length
+ *
+ * Transparent, so a window is found by a (string_view, length) key
+ * without building a string for the topic.
+ */
+struct aggregate_key_less_t {
+    using is_transparent = void;
+
+    template <typename A, typename B>
+    bool operator()(const A& a, const B& b) const {
+        int order = std::string_view(a.first).compare(std::string_view(b.first));
+        return order < 0 || (order == 0 && a.second < b.second);
+    }
+};
+
+/**
+ * @brief Aggregate subscriptions and the windows open for them
+ */
+struct aggregator_t {
+    std::map<std::pair<std::string, uint32_t>, aggregate_subscription_t> subscriptions;  ///< By pattern and window
+    std::map<std::pair<std::string, uint32_t>, aggregate_window_t, aggregate_key_less_t> windows;  ///< By topic and window
+    uint64_t next_due_ns = UINT64_MAX;  ///< Earliest due_ns of the open windows
+};
+
+/**
+ * @brief Subscribe a client to the aggregates of a pattern
+ *
+ * @param state Server state
+ * @param client Subscriber
+ * @param pattern Topic pattern
+ * @param window_ms Window length, AGGREGATE_WINDOW_MIN_MS to AGGREGATE_WINDOW_MAX_MS
+ */
+void aggregate_subscribe(ServerState& state, tcp_client_t* client, const std::string& pattern,
+                         uint32_t window_ms);
+
+/**
+ * @brief Remove a client from the aggregates of a pattern, for every window
+ */
+void aggregate_unsubscribe(ServerState& state, tcp_client_t* client, const std::string& pattern);
+
+/**
+ * @brief Add a routed message to the windows of the aggregate subscriptions it matches
+ *
+ * Only INT, SHORT_REAL and FLOAT messages are aggregated. A message counts
+ * once per window length, even if several patterns of that length match.
+ *
+ * @param state Server state
+ * @param message Frame being routed, already numbered
+ * @param topic Split topic of the message
+ */
+void aggregate_message(ServerState& state, const stored_message_t* message, const topic_view_t& topic);
+
+/**
+ * @brief Emit the windows that are due
+ *
+ * Each closed window becomes one AGGREGATE_VALUE message for the connected
+ * subscribers of the matching aggregate subscriptions.
+ *
+ * @param state Server state
+ * @return int Milliseconds until the next window closes (-1 if none is open)
+ */
+int aggregate_poll(ServerState& state);
+
+#endif // AGGREGATE_H
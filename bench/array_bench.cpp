@@ -0,0 +1,174 @@
+// Array payload decode benchmark: compares the cost per reading of sending
+// readings as one INT or FLOAT datagram each, decoded by message_decode
+// (ntohl and pow per reading), with packing them into one INT32_ARRAY or
+// FIXED_ARRAY datagram converted by the scalar and the vector kernels.
+// Before timing, it checks that the vector kernels agree with the scalar
+// ones bit for bit, for every length up to the array size.
+//
+// Usage: array_bench [ELEMENTS] [ITERATIONS]
+
+#include "../common.h"
+
+#include <algorithm>
+
+// Decimals of the fixed-point readings
+#define BENCH_DECIMALS 3
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Frame body as the subscriber receives it: source header, topic, type
+static size_t frame_header(char *body, data_t type) {
+    memset(body, 0, 6 + 50);
+    strcpy(body + 6, "bench/sensor/array");
+    body[56] = type;
+    return 57;
+}
+
+static void report(const char *name, double elapsed, uint64_t readings, double baseline) {
+    double ns = elapsed * 1e9 / readings;
+    std::cout << std::left << std::setw(28) << name << std::right << std::fixed << std::setprecision(2)
+              << std::setw(8) << ns << " ns/reading";
+    if (baseline > 0)
+        std::cout << std::setw(8) << baseline / ns << "x";
+    std::cout << "\n";
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t elements = (argc > 1) ? atoi(argv[1]) : 256;
+    uint64_t iterations = (argc > 2) ? strtoull(argv[2], nullptr, 10) : 20000;
+    DIE(elements == 0 || elements > 0xffff, "ELEMENTS must be 1 to 65535");
+
+    // Readings with both signs, as raw fixed-point integers
+    std::vector<int32_t> readings(elements);
+    for (uint32_t i = 0; i < elements; ++i)
+        readings[i] = (int32_t)(i * 2654435761u) / 1000;
+
+    // One datagram per reading
+    std::vector<std::vector<char>> int_frames(elements), float_frames(elements);
+    for (uint32_t i = 0; i < elements; ++i) {
+        uint32_t magnitude = htonl(std::abs(readings[i]));
+        int_frames[i].resize(57 + 5);
+        frame_header(int_frames[i].data(), INT);
+        int_frames[i][57] = readings[i] < 0;
+        memcpy(&int_frames[i][58], &magnitude, sizeof(magnitude));
+
+        float_frames[i].resize(57 + 6);
+        frame_header(float_frames[i].data(), FLOAT);
+        float_frames[i][57] = readings[i] < 0;
+        memcpy(&float_frames[i][58], &magnitude, sizeof(magnitude));
+        float_frames[i][62] = BENCH_DECIMALS;
+    }
+
+    // All readings in one datagram
+    std::vector<char> int_array(57 + INT32_ARRAY_HEADER_SIZE + elements * 4);
+    std::vector<char> fixed_array(57 + FIXED_ARRAY_HEADER_SIZE + elements * 4);
+    uint16_t net_count = htons(elements);
+    size_t pos = frame_header(int_array.data(), INT32_ARRAY);
+    memcpy(&int_array[pos], &net_count, sizeof(net_count));
+    pos += INT32_ARRAY_HEADER_SIZE;
+    for (uint32_t i = 0; i < elements; ++i) {
+        uint32_t net_value = htonl(readings[i]);
+        memcpy(&int_array[pos + i * 4], &net_value, sizeof(net_value));
+    }
+    pos = frame_header(fixed_array.data(), FIXED_ARRAY);
+    memcpy(&fixed_array[pos], &net_count, sizeof(net_count));
+    fixed_array[pos + 2] = BENCH_DECIMALS;
+    memcpy(&fixed_array[pos + FIXED_ARRAY_HEADER_SIZE], &int_array[57 + INT32_ARRAY_HEADER_SIZE], elements * 4);
+
+    decoded_message_t int_message, fixed_message;
+    DIE(!message_decode(int_array.data(), int_array.size(), int_message) ||
+        int_message.count != elements, "INT32_ARRAY does not decode");
+    DIE(!message_decode(fixed_array.data(), fixed_array.size(), fixed_message) ||
+        fixed_message.count != elements || fixed_message.precision != BENCH_DECIMALS,
+        "FIXED_ARRAY does not decode");
+
+    // The vector kernels must match the scalar ones, tails included
+    std::vector<int32_t> ints(elements), ints_ref(elements);
+    std::vector<double> reals(elements), reals_ref(elements);
+    for (uint32_t n = 0; n <= elements; ++n) {
+        array_to_int32_scalar(int_message.array, n, ints_ref.data());
+        array_to_int32(int_message.array, n, ints.data());
+        DIE(!std::equal(ints.begin(), ints.begin() + n, ints_ref.begin()), "int32 kernels disagree");
+        array_to_double_scalar(fixed_message.array, n, BENCH_DECIMALS, reals_ref.data());
+        array_to_double(fixed_message.array, n, BENCH_DECIMALS, reals.data());
+        DIE(memcmp(reals.data(), reals_ref.data(), n * sizeof(double)) != 0, "fixed-point kernels disagree");
+    }
+    DIE(!std::equal(ints.begin(), ints.end(), readings.begin()), "int32 values are wrong");
+
+    std::cout << "elements:       " << elements << " per array, " << iterations << " iterations\n"
+              << "kernel:         " << array_kernel() << "\n";
+
+    uint64_t total = elements * iterations;
+    volatile double sink = 0;
+    double start, scalar_ns;
+
+    // INT: one decode per reading
+    start = now_s();
+    for (uint64_t it = 0; it < iterations; ++it) {
+        int64_t sum = 0;
+        for (const auto& frame : int_frames) {
+            decoded_message_t message;
+            message_decode(frame.data(), frame.size(), message);
+            sum += message.integer;
+        }
+        sink = sink + sum;
+    }
+    scalar_ns = (now_s() - start) * 1e9 / total;
+    report("INT datagrams", scalar_ns * total / 1e9, total, 0);
+
+    start = now_s();
+    for (uint64_t it = 0; it < iterations; ++it) {
+        decoded_message_t message;
+        message_decode(int_array.data(), int_array.size(), message);
+        array_to_int32_scalar(message.array, message.count, ints.data());
+        sink = sink + ints[it % elements];
+    }
+    report("INT32_ARRAY, scalar", now_s() - start, total, scalar_ns);
+
+    start = now_s();
+    for (uint64_t it = 0; it < iterations; ++it) {
+        decoded_message_t message;
+        message_decode(int_array.data(), int_array.size(), message);
+        array_to_int32(message.array, message.count, ints.data());
+        sink = sink + ints[it % elements];
+    }
+    report("INT32_ARRAY, vector", now_s() - start, total, scalar_ns);
+
+    // FLOAT: one decode and one pow per reading
+    start = now_s();
+    for (uint64_t it = 0; it < iterations; ++it) {
+        double sum = 0;
+        for (const auto& frame : float_frames) {
+            decoded_message_t message;
+            message_decode(frame.data(), frame.size(), message);
+            sum += message.real;
+        }
+        sink = sink + sum;
+    }
+    scalar_ns = (now_s() - start) * 1e9 / total;
+    report("FLOAT datagrams", scalar_ns * total / 1e9, total, 0);
+
+    start = now_s();
+    for (uint64_t it = 0; it < iterations; ++it) {
+        decoded_message_t message;
+        message_decode(fixed_array.data(), fixed_array.size(), message);
+        array_to_double_scalar(message.array, message.count, message.precision, reals.data());
+        sink = sink + reals[it % elements];
+    }
+    report("FIXED_ARRAY, scalar", now_s() - start, total, scalar_ns);
+
+    start = now_s();
+    for (uint64_t it = 0; it < iterations; ++it) {
+        decoded_message_t message;
+        message_decode(fixed_array.data(), fixed_array.size(), message);
+        array_to_double(message.array, message.count, message.precision, reals.data());
+        sink = sink + reals[it % elements];
+    }
+    report("FIXED_ARRAY, vector", now_s() - start, total, scalar_ns);
+
+    return sink == 0.5 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,125 @@
+// Client table memory benchmark: registers CLIENTS subscribers that each
+// subscribe to one of GROUPS pattern sets (PATTERNS patterns, every other
+// one store-and-forward) and then go offline, and reports how much the
+// server's resident memory grew per registered client. It fails when that
+// is over MAX_BYTES, which defaults to what the default run measured once
+// the client table was compacted, plus some allocator noise. The server must run with --admin-socket,
+// which is where its memory is read from.
+//
+// Usage: client_memory <SERVER_IP> <SERVER_PORT> <ADMIN_SOCKET> [CLIENTS] [PATTERNS] [GROUPS] [MAX_BYTES]
+
+#include "../common.h"
+
+#include <sys/un.h>
+#include <algorithm>
+
+// Connections per source address, below the ephemeral port range, since
+// every closed connection leaves its port in TIME_WAIT
+#define CLIENTS_PER_ADDRESS 20000
+
+// Bytes per client of the default run with interned pattern sets (191),
+// with room for a few bytes of run-to-run noise
+#define DEFAULT_MAX_BYTES 196
+
+// Send a request to the admin socket and return the whole reply
+static std::string admin_query(const char *path, const char *request) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    DIE(fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0, "admin socket");
+
+    send_all(fd, (void*)request, strlen(request));
+    std::string reply;
+    char buf[4096];
+    int rc;
+    while ((reply.find("END") == std::string::npos && reply.find("ERR") == std::string::npos) &&
+           (rc = recv(fd, buf, sizeof(buf), 0)) > 0)
+        reply.append(buf, rc);
+    close(fd);
+    return reply;
+}
+
+static uint64_t resident_kb(const char *admin) {
+    std::string reply = admin_query(admin, "stats\n");
+    size_t pos = reply.find("\"rss_kb\":");
+    DIE(pos == std::string::npos, "no rss_kb in the stats");
+    return strtoull(reply.c_str() + pos + 9, nullptr, 10);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 4 || argc > 8) {
+        std::cerr << "Usage: " << argv[0]
+                  << " <SERVER_IP> <SERVER_PORT> <ADMIN_SOCKET> [CLIENTS] [PATTERNS] [GROUPS] [MAX_BYTES]\n";
+        return EXIT_FAILURE;
+    }
+    const char *admin = argv[3];
+    int clients = argc > 4 ? atoi(argv[4]) : 100000;
+    int patterns = argc > 5 ? atoi(argv[5]) : 4;
+    int groups = argc > 6 ? atoi(argv[6]) : 100;
+    int max_bytes = argc > 7 ? atoi(argv[7]) : DEFAULT_MAX_BYTES;
+    DIE(clients <= 0 || patterns <= 0 || groups <= 0 || max_bytes <= 0, "invalid counts");
+
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(atoi(argv[2]));
+    DIE(inet_pton(AF_INET, argv[1], &server_addr.sin_addr) <= 0, "inet_pton");
+
+    uint64_t before_kb = resident_kb(admin);
+    unsigned run = getpid() & 0xffff;
+    std::vector<tcp_request_t> requests(patterns + 2);
+    char last_id[11] = {};
+
+    for (int i = 0; i < clients; ++i) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        DIE(fd < 0, "socket");
+
+        // Loopback accepts any 127.x.y.z source
+        sockaddr_in local{};
+        local.sin_family = AF_INET;
+        local.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + i / CLIENTS_PER_ADDRESS);
+        DIE(bind(fd, (sockaddr*)&local, sizeof(local)) < 0, "bind");
+        DIE(connect(fd, (sockaddr*)&server_addr, sizeof(server_addr)) < 0, "connect");
+
+        // Register, subscribe to the group's patterns and leave
+        for (auto& request : requests)
+            request = {};
+        snprintf(last_id, sizeof(last_id), "%04x%06d", run, i % 1000000);
+        requests[0].type = MESSAGE;
+        requests[0].message = CONNECT;
+        for (int p = 0; p < patterns; ++p) {
+            tcp_request_t& sub = requests[1 + p];
+            sub.type = SUBSCRIBE;
+            snprintf(sub.subscribe.topic, sizeof(sub.subscribe.topic), "bench/g%d/p%d/+", i % groups, p);
+            sub.subscribe.sf = p & 1;
+        }
+        requests.back().type = EXIT;
+        for (auto& request : requests)
+            strcpy(request.id, last_id);
+        send_all(fd, requests.data(), requests.size() * sizeof(tcp_request_t));
+        close(fd);
+    }
+
+    // The last client is known with all its patterns once everything is in
+    std::string query = std::string("subs ") + last_id + "\n";
+    time_t deadline = time(nullptr) + 60;
+    while (true) {
+        std::string reply = admin_query(admin, query.c_str());
+        if ((int)std::count(reply.begin(), reply.end(), '\n') == patterns + 1)
+            break;
+        DIE(time(nullptr) > deadline, "the server did not register every client");
+        usleep(10000);
+    }
+
+    uint64_t after_kb = resident_kb(admin);
+    uint64_t per_client = (after_kb - before_kb) * 1024 / clients;
+    std::cout << "clients:        " << clients << " (" << patterns << " patterns, "
+              << groups << " distinct sets)\n"
+              << "resident:       " << before_kb << " KB -> " << after_kb << " KB\n"
+              << "per client:     " << per_client << " bytes (at most " << max_bytes << ")\n";
+    if (per_client > (uint64_t)max_bytes) {
+        std::cerr << "Client memory regressed: " << per_client << " bytes per client, over " << max_bytes << "\n";
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
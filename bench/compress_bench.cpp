@@ -0,0 +1,108 @@
+// Stream compression benchmark: builds STRING frames that look like log
+// lines (a fixed topic, a timestamp, a level, a few recurring messages with
+// changing numbers) and runs them through the encoder and the decoder the
+// way the server and the subscriber do, one block per batch of frames.
+// Small batches are what a lightly loaded server flushes every loop turn;
+// matches into earlier blocks keep even single-frame blocks small. Every
+// block is checked against the frames it was made from.
+//
+// Usage: compress_bench [FRAMES] [PAYLOAD_BYTES]
+
+#include "../common.h"
+#include "../lz.h"
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// One frame as the server sends it: length word, source, topic, type, payload
+static std::string log_frame(uint32_t i, size_t payload_bytes) {
+    static const char *levels[] = {"INFO", "INFO", "INFO", "WARN", "DEBUG"};
+    static const char *events[] = {
+        "request served path=/api/v1/sensors/%u status=200 bytes=%u",
+        "cache miss key=sensor:%u:latest refill_ms=%u",
+        "connection from 10.0.%u.%u accepted",
+        "slow query table=readings rows=%u elapsed_ms=%u",
+    };
+
+    char line[256];
+    std::string payload;
+    while (payload.size() < payload_bytes) {
+        int n = snprintf(line, sizeof(line), "2024-05-%02u 12:%02u:%02u.%03u [%s] worker-%u: ", 1 + i % 28,
+                         i / 60 % 60, i % 60, i * 7 % 1000, levels[i % 5], i % 8);
+        n += snprintf(line + n, sizeof(line) - n, events[i % 4], i * 31 % 1000, i * 17 % 5000);
+        line[n++] = '\n';
+        payload.append(line, n);
+        i = i * 1103515245u + 12345u;
+    }
+    payload.resize(payload_bytes);
+
+    std::string frame(4 + 6 + 50 + 1, '\0');
+    int header = frame.size() - 4 + payload.size();
+    memcpy(&frame[0], &header, sizeof(header));
+    strcpy(&frame[10], "logs/app/server-3");
+    frame[60] = 3;  // STRING
+    return frame + payload;
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t frames = (argc > 1) ? atoi(argv[1]) : 20000;
+    size_t payload_bytes = (argc > 2) ? atoi(argv[2]) : 1400;
+    DIE(frames == 0, "FRAMES must be positive");
+    DIE(payload_bytes == 0 || payload_bytes > 1500, "PAYLOAD_BYTES must be 1 to 1500");
+
+    std::vector<std::string> input(frames);
+    for (uint32_t i = 0; i < frames; ++i)
+        input[i] = log_frame(i, payload_bytes);
+
+    std::cout << "frames:         " << frames << " STRING frames of " << input[0].size() << " bytes\n";
+    std::cout << std::left << std::setw(10) << "batch" << std::right << std::setw(10) << "ratio" << std::setw(12)
+              << "saved" << std::setw(16) << "compress" << std::setw(16) << "decompress" << "\n";
+
+    for (uint32_t batch : {1u, 8u, 64u}) {
+        // Group the frames into blocks the way a flush does
+        std::vector<std::string> blocks;
+        std::string pending;
+        for (uint32_t i = 0; i < frames; ++i) {
+            if (pending.size() + input[i].size() > LZ_BLOCK_MAX || (i % batch == 0 && !pending.empty())) {
+                blocks.push_back(pending);
+                pending.clear();
+            }
+            pending += input[i];
+        }
+        blocks.push_back(pending);
+
+        lz_encoder_t *encoder = new lz_encoder_t;
+        std::vector<std::vector<char>> compressed(blocks.size());
+        size_t raw = 0, packed = 0;
+        double start = now_s();
+        for (size_t b = 0; b < blocks.size(); ++b) {
+            compressed[b].resize(LZ_BOUND(blocks[b].size()));
+            compressed[b].resize(lz_compress(*encoder, blocks[b].data(), blocks[b].size(), compressed[b].data()));
+            raw += blocks[b].size();
+            packed += compressed[b].size() + 8;  // Frame header and raw length
+        }
+        double compress_s = now_s() - start;
+
+        lz_decoder_t *decoder = new lz_decoder_t;
+        start = now_s();
+        for (size_t b = 0; b < blocks.size(); ++b) {
+            const char *out = lz_decompress(*decoder, compressed[b].data(), compressed[b].size(), blocks[b].size());
+            DIE(out == nullptr || memcmp(out, blocks[b].data(), blocks[b].size()) != 0, "round trip failed");
+        }
+        double decompress_s = now_s() - start;
+
+        std::cout << std::left << std::setw(10) << batch << std::right << std::fixed << std::setprecision(2)
+                  << std::setw(9) << (double)raw / packed << "x" << std::setw(11) << 100.0 * (raw - packed) / raw
+                  << "%" << std::setw(9) << compress_s * 1e9 / frames << " ns/fr" << std::setw(9)
+                  << decompress_s * 1e9 / frames << " ns/fr\n";
+        std::cout << std::left << std::setw(10) << "" << std::right << std::setw(37)
+                  << raw / compress_s / 1e6 << " MB/s" << std::setw(11) << raw / decompress_s / 1e6 << " MB/s\n";
+
+        delete encoder;
+        delete decoder;
+    }
+    return EXIT_SUCCESS;
+}
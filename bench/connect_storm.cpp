@@ -0,0 +1,121 @@
+// Connection storm benchmark: opens N subscriber connections at once and
+// measures how long it takes until every one of them is registered,
+// subscribed and receiving messages.
+//
+// Usage: connect_storm <SERVER_IP> <SERVER_PORT> [CLIENTS]
+
+#include "../common.h"
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <time.h>
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3 || argc > 4) {
+        std::cerr << "Usage: " << argv[0] << " <SERVER_IP> <SERVER_PORT> [CLIENTS]\n";
+        return EXIT_FAILURE;
+    }
+
+    int clients = (argc == 4) ? atoi(argv[3]) : 10000;
+    uint16_t port = atoi(argv[2]);
+
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    DIE(inet_pton(AF_INET, argv[1], &server_addr.sin_addr) <= 0, "inet_pton");
+
+    struct rlimit fd_limit;
+    getrlimit(RLIMIT_NOFILE, &fd_limit);
+    fd_limit.rlim_cur = fd_limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &fd_limit);
+    DIE(fd_limit.rlim_cur < (rlim_t)clients + 16, "RLIMIT_NOFILE too low for the client count");
+
+    // Unique ID prefix per run, so repeated runs do not collide
+    unsigned run = getpid() & 0xffff;
+
+    std::vector<struct pollfd> fds(clients);
+    std::vector<char> sent(clients, 0), received(clients, 0);
+
+    double start = now_ms();
+
+    // Fire off every connect at once
+    for (int i = 0; i < clients; ++i) {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        DIE(fd < 0, "socket");
+        int rc = connect(fd, (sockaddr*)&server_addr, sizeof(server_addr));
+        DIE(rc < 0 && errno != EINPROGRESS, "connect");
+        fds[i] = {fd, POLLOUT, 0};
+    }
+
+    // As connections complete, register and subscribe each client
+    int pending = clients;
+    while (pending > 0) {
+        DIE(poll(fds.data(), fds.size(), 5000) <= 0, "connect phase timed out");
+        for (int i = 0; i < clients; ++i) {
+            if (sent[i] || !(fds[i].revents & (POLLOUT | POLLERR | POLLHUP)))
+                continue;
+
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            DIE(err != 0, "connection failed");
+
+            tcp_request_t req[2] = {};
+            snprintf(req[0].id, sizeof(req[0].id), "%04x%05d", run, i % 100000);
+            req[0].type = MESSAGE;
+            req[0].message = CONNECT;
+            strcpy(req[1].id, req[0].id);
+            req[1].type = SUBSCRIBE;
+            strcpy(req[1].subscribe.topic, "storm/probe");
+            send_all(fds[i].fd, req, sizeof(req));
+
+            sent[i] = 1;
+            fds[i].events = POLLIN;
+            pending--;
+        }
+    }
+
+    double connected = now_ms();
+
+    // Keep publishing probes until every client has received one
+    int udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    char probe[56] = "storm/probe";
+    probe[50] = INT;
+
+    pending = clients;
+    while (pending > 0) {
+        sendto(udp_fd, probe, sizeof(probe), 0, (sockaddr*)&server_addr, sizeof(server_addr));
+        if (poll(fds.data(), fds.size(), 50) < 0)
+            break;
+        for (int i = 0; i < clients; ++i) {
+            if (!(fds[i].revents & POLLIN))
+                continue;
+
+            char buff[4096];
+            int rc = recv(fds[i].fd, buff, sizeof(buff), 0);
+            DIE(rc <= 0, "server closed a connection");
+            if (!received[i]) {
+                received[i] = 1;
+                pending--;
+            }
+        }
+        DIE(now_ms() - start > 60000, "clients still not served after 60 s");
+    }
+
+    double served = now_ms();
+
+    std::cout << "clients:            " << clients << "\n";
+    std::cout << "connect + register: " << connected - start << " ms\n";
+    std::cout << "all connected:      " << served - start << " ms\n";
+
+    for (auto& pfd : fds)
+        close(pfd.fd);
+    close(udp_fd);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,107 @@
+// End-to-end latency benchmark: sends one probe datagram at a time and
+// spins on a library subscriber until the server delivers it back, with a
+// pause between probes so the server goes idle in between. Reports the
+// percentiles of the UDP send to TCP delivery time. Running it against a
+// server started normally and one started with --busy-poll compares the
+// cost of waking the blocking poll loop with that of a spinning one. The
+// spinning loop only wins with a core of its own: this benchmark spins
+// too, so it needs at least one more.
+//
+// Usage: latency_bench <SERVER_IP> <SERVER_PORT> [PROBES] [--gap-us N]
+
+#include "../subscriber.h"
+
+#include <getopt.h>
+
+// Give up on a probe that did not come back within this time
+#define PROBE_TIMEOUT_MS 1000
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        {"gap-us", required_argument, nullptr, 'g'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int gap_us = 200;
+    int opt;
+    bool valid = true;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        if (opt == 'g')
+            valid &= (gap_us = atoi(optarg)) >= 0;
+        else
+            valid = false;
+    }
+    if (!valid || argc - optind < 2 || argc - optind > 3) {
+        std::cerr << "Usage: " << argv[0] << " <SERVER_IP> <SERVER_PORT> [PROBES] [--gap-us N]\n";
+        return EXIT_FAILURE;
+    }
+    const char *ip = argv[optind];
+    uint16_t port = atoi(argv[optind + 1]);
+    int probes = argc - optind == 3 ? atoi(argv[optind + 2]) : 10000;
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2)
+        std::cerr << "Only one CPU online: a --busy-poll server and this benchmark will starve each other\n";
+
+    // A topic of its own, so other traffic on the server does not count
+    char id[11], topic[51];
+    snprintf(id, sizeof(id), "lat%u", (unsigned)getpid() % 10000000);
+    snprintf(topic, sizeof(topic), "bench/latency/%s", id);
+
+    subscriber_client_t *client = subscriber_connect(ip, port, id, 0);
+    DIE(!client, "subscriber_connect");
+    const char *patterns[] = {topic};
+    subscriber_subscribe(client, patterns, 1, false);
+
+    uint64_t deadline = monotonic_ns() + 5000000000ull;
+    while (subscriber_events(client) & POLLOUT) {
+        DIE(monotonic_ns() > deadline || subscriber_poll(client) < 0, "could not register");
+        usleep(1000);
+    }
+    usleep(100000);
+
+    int udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    DIE(inet_pton(AF_INET, ip, &server_addr.sin_addr) <= 0, "inet_pton");
+    DIE(connect(udp_fd, (sockaddr*)&server_addr, sizeof(server_addr)) < 0, "UDP connect");
+
+    // 50 byte topic field, INT type, sign byte and the probe number
+    char datagram[50 + 1 + 1 + 4] = {};
+    memcpy(datagram, topic, strlen(topic));
+    datagram[50] = INT;
+
+    histogram_t latency;
+    int lost = 0;
+    for (int i = 0; i < probes; ++i) {
+        uint32_t value = htonl(i);
+        memcpy(datagram + 52, &value, sizeof(value));
+
+        uint64_t sent_ns = monotonic_ns();
+        DIE(send(udp_fd, datagram, sizeof(datagram), 0) < 0, "send");
+
+        // Spin on the subscriber too, so only the server's wakeup differs
+        bool received = false;
+        while (!received && monotonic_ns() - sent_ns < PROBE_TIMEOUT_MS * 1000000ull) {
+            DIE(subscriber_poll(client) < 0, "server closed the connection");
+            decoded_message_t message;
+            while (subscriber_next(client, message)) {
+                if (message.type == INT && message.integer == i) {
+                    latency.record(monotonic_ns() - sent_ns);
+                    received = true;
+                }
+            }
+        }
+        lost += !received;
+
+        if (gap_us > 0)
+            usleep(gap_us);
+    }
+
+    std::cout << "Probes: " << probes << ", lost: " << lost << ", gap: " << gap_us << " us\n"
+              << "Latency (ns), UDP send to delivery:\n";
+    histogram_print(std::cout, "latency", histogram_summary(latency));
+
+    subscriber_close(client);
+    close(udp_fd);
+    return EXIT_SUCCESS;
+}
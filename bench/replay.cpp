@@ -0,0 +1,297 @@
+// Capture replay: resends the datagrams of a `server --record` capture to a
+// server, at the recorded pace scaled by a speed factor or as fast as
+// possible, while scripted subscribers consume the messages through the
+// subscriber library. Reports the send and delivery rates, the delivery
+// latency (when the server runs with --trace-latency) and, when its admin
+// socket is given, how many datagrams the server read and its memory
+// high-water mark.
+//
+// Usage: replay <SERVER_IP> <SERVER_PORT> <CAPTURE> [--speed X|max]
+//               [--script FILE] [--admin-socket PATH]
+//
+// A script line is "CLIENT_ID PATTERN [SF]"; a client may have several
+// lines. Without a script, one client subscribes to "*".
+
+#include "../capture.h"
+#include "../subscriber.h"
+
+#include <getopt.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+// Stop draining once no message arrived for this long
+#define REPLAY_QUIET_MS 500
+
+// Datagrams sent between two looks at the subscribers at maximum speed
+#define REPLAY_BURST 256
+
+struct replay_subscriber_t {
+    std::string id;
+    std::vector<std::string> patterns;
+    bool sf = false;
+    subscriber_client_t *client = nullptr;
+    uint64_t received = 0;
+};
+
+struct replay_totals_t {
+    uint64_t messages = 0;
+    uint64_t untraced = 0;
+    uint64_t last_ns = 0;       ///< Monotonic time of the last message
+    histogram_t latency;        ///< Kernel receive on the server to decode here
+};
+
+static void count_message(const decoded_message_t& message, void *context) {
+    replay_totals_t *totals = (replay_totals_t*)context;
+    totals->messages++;
+    if (!message.trace) {
+        totals->untraced++;
+        return;
+    }
+
+    uint64_t now = realtime_ns();
+    uint64_t from = be64toh(message.trace->kernel_rx_ns);
+    if (!from)
+        from = be64toh(message.trace->read_ns);
+    totals->latency.record(now > from ? now - from : 0);
+}
+
+static bool load_script(const char *path, std::vector<replay_subscriber_t>& subscribers) {
+    std::ifstream in(path);
+    if (!in)
+        return false;
+
+    std::map<std::string, size_t> index;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string id, pattern;
+        int sf = 0;
+        if (!(fields >> id) || id[0] == '#')
+            continue;
+        if (!(fields >> pattern) || id.size() > 10)
+            return false;
+        fields >> sf;
+
+        auto [it, inserted] = index.emplace(id, subscribers.size());
+        if (inserted) {
+            subscribers.emplace_back();
+            subscribers.back().id = id;
+        }
+        subscribers[it->second].patterns.push_back(pattern);
+        subscribers[it->second].sf |= sf != 0;
+    }
+    return true;
+}
+
+// Ask the admin socket for the stats line and pick one number out of it
+static bool admin_stat(const char *path, const char *name, uint64_t& value) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    if (fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return false;
+    }
+
+    send_all(fd, (void*)"stats\n", 6);
+    std::string reply;
+    char buf[4096];
+    int rc;
+    while (reply.find("END\n") == std::string::npos && (rc = recv(fd, buf, sizeof(buf), 0)) > 0)
+        reply.append(buf, rc);
+    close(fd);
+
+    std::string key = std::string("\"") + name + "\":";
+    size_t pos = reply.find(key);
+    if (pos == std::string::npos)
+        return false;
+    value = strtoull(reply.c_str() + pos + key.size(), nullptr, 10);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        {"speed", required_argument, nullptr, 's'},
+        {"script", required_argument, nullptr, 'c'},
+        {"admin-socket", required_argument, nullptr, 'a'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    double speed = 1.0;     // 0 = as fast as possible
+    const char *script = nullptr, *admin_socket = nullptr;
+    bool valid = true;
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        if (opt == 's') {
+            speed = strcmp(optarg, "max") == 0 ? 0 : atof(optarg);
+            valid &= speed > 0 || strcmp(optarg, "max") == 0;
+        } else if (opt == 'c') {
+            script = optarg;
+        } else if (opt == 'a') {
+            admin_socket = optarg;
+        } else {
+            valid = false;
+        }
+    }
+    if (!valid || argc - optind != 3) {
+        std::cerr << "Usage: " << argv[0] << " <SERVER_IP> <SERVER_PORT> <CAPTURE> [--speed X|max]"
+                  << " [--script FILE] [--admin-socket PATH]\n";
+        return EXIT_FAILURE;
+    }
+    const char *ip = argv[optind];
+    uint16_t port = atoi(argv[optind + 1]);
+
+    capture_reader_t capture;
+    DIE(!capture_map(argv[optind + 2], capture), "cannot read the capture");
+
+    std::vector<replay_subscriber_t> subscribers;
+    if (script) {
+        DIE(!load_script(script, subscribers) || subscribers.empty(), "invalid script");
+    } else {
+        subscribers.emplace_back();
+        subscribers.back().id = "replay0";
+        subscribers.back().patterns.push_back("*");
+    }
+
+    // Connect and subscribe every scripted client, traced if the server can
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    DIE(epfd < 0, "epoll_create1");
+    for (size_t i = 0; i < subscribers.size(); ++i) {
+        auto& sub = subscribers[i];
+        sub.client = subscriber_connect(ip, port, sub.id.c_str(), CONNECT_TRACE);
+        DIE(!sub.client, "subscriber_connect");
+        std::vector<const char*> patterns;
+        for (const auto& p : sub.patterns)
+            patterns.push_back(p.c_str());
+        DIE(subscriber_subscribe(sub.client, patterns.data(), patterns.size(), sub.sf) < 0, "pattern too long");
+
+        struct epoll_event ev = {};
+        ev.events = EPOLLIN | EPOLLOUT;
+        ev.data.u64 = i;
+        DIE(epoll_ctl(epfd, EPOLL_CTL_ADD, subscriber_fd(sub.client), &ev) < 0, "epoll_ctl");
+    }
+
+    // Wait until every request is written, then give the server a moment
+    uint64_t deadline = monotonic_ns() + 5000000000ull;
+    size_t pending = subscribers.size();
+    while (pending > 0) {
+        DIE(monotonic_ns() > deadline, "subscribers could not register");
+        struct epoll_event ready[64];
+        int n = epoll_wait(epfd, ready, 64, 100);
+        for (int i = 0; i < n; ++i) {
+            auto& sub = subscribers[ready[i].data.u64];
+            bool was_pending = subscriber_events(sub.client) & POLLOUT;
+            DIE(subscriber_poll(sub.client) < 0, "server closed a subscriber");
+            if (was_pending && !(subscriber_events(sub.client) & POLLOUT)) {
+                struct epoll_event ev = {};
+                ev.events = EPOLLIN;
+                ev.data.u64 = ready[i].data.u64;
+                epoll_ctl(epfd, EPOLL_CTL_MOD, subscriber_fd(sub.client), &ev);
+                pending--;
+            }
+        }
+    }
+    usleep(100000);
+
+    // Datagrams the server read before the replay, to tell kernel drops apart
+    uint64_t read_before = 0, read_after = 0;
+    bool server_counts = admin_socket && admin_stat(admin_socket, "udp_received", read_before);
+
+    int udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(port);
+    DIE(inet_pton(AF_INET, ip, &server_addr.sin_addr) <= 0, "inet_pton");
+    DIE(connect(udp_fd, (sockaddr*)&server_addr, sizeof(server_addr)) < 0, "UDP connect");
+
+    replay_totals_t totals;
+    uint64_t sent = 0, base_ns = 0;
+    bool have_record = false, first = true;
+    capture_record_t record;
+    const char *datagram = nullptr;
+    uint64_t start = monotonic_ns();
+
+    have_record = capture_next(capture, record, datagram);
+    if (have_record)
+        base_ns = record.rx_ns;
+    totals.last_ns = start;
+
+    while (true) {
+        // Send whatever is due at the recorded pace (a burst at maximum speed)
+        uint64_t now = monotonic_ns();
+        int timeout_ms = 0;
+        for (int burst = 0; have_record; ++burst) {
+            uint64_t due = start + (speed > 0 ? (uint64_t)((record.rx_ns - base_ns) / speed) : 0);
+            if (speed == 0 ? burst == REPLAY_BURST : due > now) {
+                timeout_ms = speed == 0 ? 0 : (due - now) / 1000000;
+                break;
+            }
+            if (send(udp_fd, datagram, record.len, 0) == record.len)
+                sent++;
+            have_record = capture_next(capture, record, datagram);
+        }
+        if (!have_record) {
+            if (first) {
+                first = false;
+                totals.last_ns = monotonic_ns();
+            }
+            uint64_t quiet = monotonic_ns() - totals.last_ns;
+            if (quiet >= REPLAY_QUIET_MS * 1000000ull)
+                break;
+            timeout_ms = REPLAY_QUIET_MS - quiet / 1000000;
+        }
+
+        struct epoll_event ready[64];
+        int n = epoll_wait(epfd, ready, 64, timeout_ms);
+        for (int i = 0; i < n; ++i) {
+            auto& sub = subscribers[ready[i].data.u64];
+            int rc = subscriber_poll(sub.client);
+            uint64_t before = totals.messages;
+            subscriber_dispatch(sub.client, count_message, &totals);
+            sub.received += totals.messages - before;
+            if (totals.messages != before)
+                totals.last_ns = monotonic_ns();
+            if (rc < 0)
+                epoll_ctl(epfd, EPOLL_CTL_DEL, subscriber_fd(sub.client), nullptr);
+        }
+    }
+    double send_s = (totals.last_ns - start) / 1e9;
+
+    char pace[32];
+    if (speed > 0)
+        snprintf(pace, sizeof(pace), "%gx", speed);
+    else
+        strcpy(pace, "max speed");
+    std::cout << std::fixed << std::setprecision(3)
+              << "Replayed " << sent << " datagrams at " << pace << " in " << send_s << " s\n"
+              << std::setprecision(0)
+              << "Delivered " << totals.messages << " messages to " << subscribers.size() << " subscribers ("
+              << totals.messages / send_s << " msgs/s)\n";
+    if (server_counts && admin_stat(admin_socket, "udp_received", read_after))
+        std::cout << "Server read " << read_after - read_before << " datagrams ("
+                  << sent - std::min(sent, read_after - read_before) << " lost before reaching it)\n";
+    for (const auto& sub : subscribers)
+        std::cout << "  " << std::left << std::setw(12) << sub.id << std::right << sub.received << "\n";
+
+    if (totals.latency.count.value.load() > 0) {
+        std::cout << "Latency (ns), server receive to subscriber decode:\n";
+        histogram_print(std::cout, "latency", histogram_summary(totals.latency));
+    } else if (totals.untraced > 0) {
+        std::cout << "No latency: the server does not run with --trace-latency\n";
+    }
+
+    uint64_t rss = 0, hwm = 0;
+    if (admin_socket && admin_stat(admin_socket, "rss_kb", rss) && admin_stat(admin_socket, "rss_hwm_kb", hwm))
+        std::cout << "Server memory: " << rss << " KB resident, " << hwm << " KB peak\n";
+
+    for (auto& sub : subscribers)
+        subscriber_close(sub.client);
+    close(udp_fd);
+    close(epfd);
+    capture_unmap(capture);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,196 @@
+// Subscriber library throughput benchmark: a forked fake broker streams
+// frames of every data type as fast as the socket takes them, while the
+// parent drives an embedded client from an epoll loop and decodes them
+// through the callback interface. Allocations are counted while messages
+// flow, to check that receiving allocates nothing.
+//
+// Usage: subscriber_bench [MESSAGES]
+
+#include "../subscriber.h"
+
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <new>
+
+static uint64_t allocations = 0;
+
+void *operator new(size_t size) {
+    allocations++;
+    void *p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    free(p);
+}
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// One frame of each type, as the server writes them
+static void append_frame(std::string& block, int i) {
+    char body[6 + 50 + 1 + 32] = {};
+    size_t len = 6 + 50 + 1;
+    in_addr_t ip = htonl(INADDR_LOOPBACK);
+    uint16_t port = htons(4242);
+    memcpy(body, &ip, sizeof(ip));
+    memcpy(body + 4, &port, sizeof(port));
+    snprintf(body + 6, 50, "bench/sensor/%d", i % 100);
+
+    char *payload = body + 57;
+    body[56] = i % 4;
+    switch (i % 4) {
+        case INT: {
+            uint32_t v = htonl(i);
+            payload[0] = i & 1;
+            memcpy(payload + 1, &v, sizeof(v));
+            len += 5;
+            break;
+        }
+        case SHORT_REAL: {
+            uint16_t v = htons(i % 10000);
+            memcpy(payload, &v, sizeof(v));
+            len += 2;
+            break;
+        }
+        case FLOAT: {
+            uint32_t v = htonl(i);
+            payload[0] = 0;
+            memcpy(payload + 1, &v, sizeof(v));
+            payload[5] = 3;
+            len += 6;
+            break;
+        }
+        case STRING:
+            len += snprintf(payload, 32, "reading %d", i);
+            break;
+    }
+
+    int header = len;
+    block.append((const char*)&header, sizeof(header));
+    block.append(body, len);
+}
+
+// Fake broker: take the registration, then stream the frames and shut down
+static void broker(int listener, uint64_t messages) {
+    int fd = accept(listener, nullptr, nullptr);
+    DIE(fd < 0, "accept");
+    tcp_request_t requests[2];
+    DIE(recv_all(fd, requests, sizeof(requests)) <= 0, "registration");
+
+    const int per_block = 1024;
+    std::string block;
+    for (int i = 0; i < per_block; ++i)
+        append_frame(block, i);
+
+    for (uint64_t sent = 0; sent < messages; sent += per_block)
+        send_all(fd, block.data(), block.size());
+
+    struct {
+        int header;
+        tcp_request_t notice;
+    } __attribute__((packed)) shutdown_frame = {};
+    shutdown_frame.header = sizeof(tcp_request_t) | FRAME_CONTROL;
+    shutdown_frame.notice.type = MESSAGE;
+    shutdown_frame.notice.message = SHUTDOWN;
+    send_all(fd, &shutdown_frame, sizeof(shutdown_frame));
+    close(fd);
+}
+
+struct totals_t {
+    uint64_t messages = 0;
+    uint64_t bytes = 0;
+    double sum = 0;
+};
+
+static void count_message(const decoded_message_t& message, void *context) {
+    totals_t *totals = (totals_t*)context;
+    totals->messages++;
+    totals->bytes += message.topic.size() + message.text.size();
+    if (message.type == INT)
+        totals->sum += message.integer;
+    else if (message.type != STRING)
+        totals->sum += message.real;
+}
+
+int main(int argc, char *argv[]) {
+    uint64_t messages = (argc > 1) ? strtoull(argv[1], nullptr, 10) : 4000000;
+    messages = (messages + 1023) / 1024 * 1024;
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    DIE(listener < 0, "socket");
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addr_len = sizeof(addr);
+    DIE(bind(listener, (sockaddr*)&addr, sizeof(addr)) < 0, "bind");
+    DIE(listen(listener, 1) < 0, "listen");
+    getsockname(listener, (sockaddr*)&addr, &addr_len);
+
+    pid_t child = fork();
+    DIE(child < 0, "fork");
+    if (child == 0) {
+        broker(listener, messages);
+        _exit(EXIT_SUCCESS);
+    }
+    close(listener);
+
+    subscriber_client_t *client = subscriber_connect("127.0.0.1", ntohs(addr.sin_port), "bench", 0);
+    DIE(!client, "subscriber_connect");
+    const char *patterns[] = {"bench/*"};
+    subscriber_subscribe(client, patterns, 1, false);
+
+    int epfd = epoll_create1(0);
+    struct epoll_event ev = {};
+    short events = subscriber_events(client);
+    ev.events = events;
+    DIE(epoll_ctl(epfd, EPOLL_CTL_ADD, subscriber_fd(client), &ev) < 0, "epoll_ctl");
+
+    totals_t totals;
+    uint64_t steady_allocations = 0;
+    double start = 0;
+    while (true) {
+        struct epoll_event ready;
+        DIE(epoll_wait(epfd, &ready, 1, 5000) <= 0, "no data from the broker");
+
+        int rc = subscriber_poll(client);
+        bool first = totals.messages == 0;
+        subscriber_dispatch(client, count_message, &totals);
+        if (first && totals.messages > 0) {
+            start = now_s();
+            steady_allocations = allocations;
+        }
+        if (rc < 0)
+            break;
+
+        // Stop asking for writability once the requests are out
+        if (subscriber_events(client) != events) {
+            events = subscriber_events(client);
+            ev.events = events;
+            epoll_ctl(epfd, EPOLL_CTL_MOD, subscriber_fd(client), &ev);
+        }
+    }
+    double elapsed = now_s() - start;
+    steady_allocations = allocations - steady_allocations;
+
+    subscriber_close(client);
+    close(epfd);
+    waitpid(child, nullptr, 0);
+
+    DIE(totals.messages != messages, "messages lost");
+    std::cout << std::fixed << std::setprecision(2)
+              << "messages:       " << totals.messages << "\n"
+              << "elapsed:        " << elapsed << " s\n"
+              << "throughput:     " << totals.messages / elapsed / 1e6 << " M msg/s\n"
+              << "allocations:    " << steady_allocations << " while receiving\n";
+    return totals.sum == 0.5 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,211 @@
+// Subscription churn benchmark: grows the subscriber list of one topic in
+// steps, up to SUBSCRIBERS offline clients, and at every step has CHURNERS
+// connected clients unsubscribe from it and subscribe again, CHURN pairs in
+// all. It reports the time the server spends per request while churning
+// (request_ns of the stats), which should not depend on how many clients
+// share the topic, the wall time per request, which is mostly the socket
+// reads, and the time to route a message to the topic, which walks its
+// whole subscriber list. The server must run with --admin-socket, which is
+// used for the stats and to know when the server is done.
+//
+// Usage: subscription_churn <SERVER_IP> <SERVER_PORT> <ADMIN_SOCKET> [SUBSCRIBERS] [CHURN] [CHURNERS]
+
+#include "../common.h"
+
+#include <sys/un.h>
+
+// Connections per source address, below the ephemeral port range, since
+// every closed connection leaves its port in TIME_WAIT
+#define CLIENTS_PER_ADDRESS 20000
+
+#define HOT_TOPIC "churn/hot"
+#define REGISTER_BATCH 1000
+#define ROUTED_MESSAGES 1000
+#define ROUTED_BURST 50
+
+static double now_s() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Send a request to the admin socket and return the whole reply
+static std::string admin_query(const char *path, const char *request) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    DIE(fd < 0 || connect(fd, (sockaddr*)&addr, sizeof(addr)) < 0, "admin socket");
+
+    send_all(fd, (void*)request, strlen(request));
+    std::string reply;
+    char buf[4096];
+    int rc;
+    while ((reply.find("END") == std::string::npos && reply.find("ERR") == std::string::npos) &&
+           (rc = recv(fd, buf, sizeof(buf), 0)) > 0)
+        reply.append(buf, rc);
+    close(fd);
+    return reply;
+}
+
+// Requests handled so far, and the total time spent on them
+static void request_totals(const char *admin, double& count, double& total_ns) {
+    std::string reply = admin_query(admin, "stats\n");
+    size_t pos = reply.find("\"request_ns\":{\"n\":");
+    DIE(pos == std::string::npos, "no request_ns in the stats");
+    char *end;
+    count = strtod(reply.c_str() + pos + 18, &end);
+    total_ns = count * strtod(end + 8, nullptr);  // ,"mean":
+}
+
+// Wait until the admin socket lists a topic with that many subscribers
+static void wait_subscribers(const char *admin, const std::string& topic, size_t count) {
+    std::string line = "\n" + topic + " " + std::to_string(count) + "\n";
+    time_t deadline = time(nullptr) + 120;
+    while (("\n" + admin_query(admin, "topics\n")).find(line) == std::string::npos) {
+        DIE(time(nullptr) > deadline, "the server did not register every subscription");
+        usleep(1000);
+    }
+}
+
+static tcp_request_t request(const char *id, command_t type) {
+    tcp_request_t req = {};
+    strcpy(req.id, id);
+    req.type = type;
+    return req;
+}
+
+static tcp_request_t subscription(const char *id, command_t type, const char *topic) {
+    tcp_request_t req = request(id, type);
+    strcpy(type == SUBSCRIBE ? req.subscribe.topic : req.unsubscribe.topic, topic);
+    return req;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 4 || argc > 7) {
+        std::cerr << "Usage: " << argv[0]
+                  << " <SERVER_IP> <SERVER_PORT> <ADMIN_SOCKET> [SUBSCRIBERS] [CHURN] [CHURNERS]\n";
+        return EXIT_FAILURE;
+    }
+    const char *admin = argv[3];
+    int subscribers = argc > 4 ? atoi(argv[4]) : 100000;
+    int churn = argc > 5 ? atoi(argv[5]) : 100000;
+    int churners = argc > 6 ? atoi(argv[6]) : 100;
+    DIE(subscribers <= 0 || churn <= 0 || churners <= 0 || churners > 1000, "invalid counts");
+
+    sockaddr_in server_addr{};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(atoi(argv[2]));
+    DIE(inet_pton(AF_INET, argv[1], &server_addr.sin_addr) <= 0, "inet_pton");
+    unsigned run = getpid() & 0xffff;
+
+    // The churners stay connected; the first one also receives the routed messages
+    std::vector<int> churner_fds(churners);
+    std::vector<std::string> churner_ids(churners);
+    for (int c = 0; c < churners; ++c) {
+        char id[11];
+        snprintf(id, sizeof(id), "%04xc%05d", run, c);
+        churner_ids[c] = id;
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        DIE(fd < 0 || connect(fd, (sockaddr*)&server_addr, sizeof(server_addr)) < 0, "connect");
+        tcp_request_t reqs[2] = {request(id, MESSAGE), subscription(id, SUBSCRIBE, HOT_TOPIC)};
+        reqs[0].message = CONNECT;
+        send_all(fd, reqs, sizeof(reqs));
+        churner_fds[c] = fd;
+    }
+
+    int udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    DIE(udp_fd < 0, "socket");
+    char datagram[50 + 1 + 5] = HOT_TOPIC;
+    datagram[50] = 0;  // INT, payload left at +0
+
+    std::cout << std::left << std::setw(14) << "subscribers" << std::right << std::setw(16) << "server"
+              << std::setw(16) << "wall" << std::setw(16) << "route" << "\n";
+
+    int registered = 0;
+    for (int step = 1000; ; step = std::min(step * 10, subscribers)) {
+        step = std::min(step, subscribers);
+
+        // Offline clients subscribed to the topic, the subscriber list being filled
+        for (; registered < step; ++registered) {
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            DIE(fd < 0, "socket");
+            sockaddr_in local{};
+            local.sin_family = AF_INET;
+            local.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + registered / CLIENTS_PER_ADDRESS);
+            DIE(bind(fd, (sockaddr*)&local, sizeof(local)) < 0, "bind");
+            DIE(connect(fd, (sockaddr*)&server_addr, sizeof(server_addr)) < 0, "connect");
+
+            char id[11];
+            snprintf(id, sizeof(id), "%04x%06u", run, (unsigned)registered % 1000000);
+            tcp_request_t reqs[3] = {request(id, MESSAGE), subscription(id, SUBSCRIBE, HOT_TOPIC),
+                                     request(id, EXIT)};
+            reqs[0].message = CONNECT;
+            send_all(fd, reqs, sizeof(reqs));
+            close(fd);
+
+            // In batches the accept queue can hold
+            if ((registered + 1) % REGISTER_BATCH == 0)
+                wait_subscribers(admin, HOT_TOPIC, registered + 1 + churners);
+        }
+        size_t listed = registered + churners;
+        wait_subscribers(admin, HOT_TOPIC, listed);
+
+        // Unsubscribe and subscribe again, round robin over the churners.
+        // The server reads a request per connection per turn, so the hot
+        // topic count can be right while the churners are midway; each one
+        // subscribes to a marker of the step once done instead
+        int rounds = (churn + churners - 1) / churners;
+        std::string done = "churn/done/" + std::to_string(step);
+        double requests_before, spent_before, requests_after, spent_after;
+        request_totals(admin, requests_before, spent_before);
+        double start = now_s();
+        for (int c = 0; c < churners; ++c) {
+            std::vector<tcp_request_t> reqs;
+            reqs.reserve(2 * rounds);
+            for (int r = 0; r < rounds; ++r) {
+                reqs.push_back(subscription(churner_ids[c].c_str(), UNSUBSCRIBE, HOT_TOPIC));
+                reqs.push_back(subscription(churner_ids[c].c_str(), SUBSCRIBE, HOT_TOPIC));
+            }
+            reqs.back() = subscription(churner_ids[c].c_str(), UNSUBSCRIBE, HOT_TOPIC);
+            reqs.push_back(subscription(churner_ids[c].c_str(), SUBSCRIBE, done.c_str()));
+            send_all(churner_fds[c], reqs.data(), reqs.size() * sizeof(tcp_request_t));
+        }
+        wait_subscribers(admin, done, churners);
+        double churn_s = now_s() - start;
+        request_totals(admin, requests_after, spent_after);
+
+        // Route messages through the whole list to one connected churner
+        tcp_request_t back = subscription(churner_ids[0].c_str(), SUBSCRIBE, HOT_TOPIC);
+        send_all(churner_fds[0], &back, sizeof(back));
+        wait_subscribers(admin, HOT_TOPIC, listed - churners + 1);
+
+        const size_t frame_len = sizeof(int) + 6 + sizeof(datagram);
+        std::vector<char> frames(ROUTED_BURST * frame_len);
+        start = now_s();
+        for (int sent = 0; sent < ROUTED_MESSAGES; sent += ROUTED_BURST) {
+            for (int m = 0; m < ROUTED_BURST; ++m)
+                sendto(udp_fd, datagram, sizeof(datagram), 0, (sockaddr*)&server_addr, sizeof(server_addr));
+            DIE(recv_all(churner_fds[0], frames.data(), frames.size()) <= 0, "lost the server");
+        }
+        double route_s = now_s() - start;
+
+        // Back to where the next step expects the churners to be
+        for (int c = 0; c < churners; ++c) {
+            tcp_request_t sub = subscription(churner_ids[c].c_str(), SUBSCRIBE, HOT_TOPIC);
+            send_all(churner_fds[c], &sub, sizeof(sub));
+        }
+
+        std::cout << std::left << std::setw(14) << listed << std::right << std::fixed << std::setprecision(0)
+                  << std::setw(11) << (spent_after - spent_before) / (requests_after - requests_before)
+                  << " ns/op" << std::setw(11) << churn_s * 1e9 / (2 * rounds * churners) << " ns/op" << std::setw(11)
+                  << route_s * 1e9 / ROUTED_MESSAGES << " ns/msg\n";
+        if (step == subscribers)
+            break;
+    }
+
+    for (int fd : churner_fds)
+        close(fd);
+    close(udp_fd);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,223 @@
+// Topic matching micro-benchmark: compares the original string-splitting
+// matcher with the level-view matcher using the scalar and the vector
+// separator kernels, and with patterns compiled to shape-specialized
+// matchers, across topic depths. Every pair is also checked for identical
+// results before timing.
+//
+// Usage: topic_bench [ITERATIONS]
+
+#include "../topic.h"
+
+#include <time.h>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <vector>
+
+// The matcher as it was before topic views, kept as the reference
+static bool legacy_matches(const std::string &topic, const std::string &pattern) {
+    std::vector<std::string> topic_parts, pattern_parts;
+    size_t start = 0, end;
+    while ((end = topic.find('/', start)) != std::string::npos) {
+        topic_parts.push_back(topic.substr(start, end - start));
+        start = end + 1;
+    }
+    topic_parts.push_back(topic.substr(start));
+    start = 0;
+    while ((end = pattern.find('/', start)) != std::string::npos) {
+        pattern_parts.push_back(pattern.substr(start, end - start));
+        start = end + 1;
+    }
+    pattern_parts.push_back(pattern.substr(start));
+
+    size_t t_idx = 0, p_idx = 0, t_back = 0, p_back = 0;
+    bool backtrack = false;
+    while (t_idx < topic_parts.size()) {
+        if (p_idx < pattern_parts.size()) {
+            if (pattern_parts[p_idx] == "+" || pattern_parts[p_idx] == topic_parts[t_idx]) {
+                t_idx++;
+                p_idx++;
+                continue;
+            }
+            if (pattern_parts[p_idx] == "*") {
+                t_back = t_idx;
+                p_back = p_idx;
+                p_idx++;
+                backtrack = true;
+                continue;
+            }
+        }
+        if (backtrack && p_back < pattern_parts.size()) {
+            t_back++;
+            t_idx = t_back;
+            p_idx = p_back + 1;
+            continue;
+        }
+        return false;
+    }
+    while (p_idx < pattern_parts.size() && pattern_parts[p_idx] == "*")
+        p_idx++;
+    return t_idx == topic_parts.size() && p_idx == pattern_parts.size();
+}
+
+static double now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static const char *words[] = {"upb", "precis", "ec", "100", "101", "temperature", "pressure",
+                              "humidity", "floor", "elevator", "sensor", "a", "building"};
+
+static std::string make_topic(std::mt19937& rng, int depth) {
+    std::string topic;
+    for (int i = 0; i < depth; ++i) {
+        std::string word = words[rng() % (sizeof(words) / sizeof(words[0]))];
+        if (topic.size() + word.size() + 1 > TOPIC_MAX_LEN)
+            break;
+        if (i)
+            topic += '/';
+        topic += word;
+    }
+    return topic;
+}
+
+// Pattern derived from a topic: some levels become '+', some runs '*'
+static std::string make_pattern(std::mt19937& rng, const std::string& topic) {
+    std::string pattern, level;
+    size_t start = 0;
+    bool first = true;
+    while (start <= topic.size()) {
+        size_t end = topic.find('/', start);
+        if (end == std::string::npos)
+            end = topic.size();
+        level = topic.substr(start, end - start);
+        unsigned roll = rng() % 10;
+        if (roll == 0)
+            level = "+";
+        else if (roll == 1)
+            level = "*";
+        else if (roll == 2)
+            level = words[rng() % (sizeof(words) / sizeof(words[0]))];
+        if (!first)
+            pattern += '/';
+        pattern += level;
+        first = false;
+        start = end + 1;
+    }
+    return pattern.substr(0, TOPIC_MAX_LEN);
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = (argc > 1) ? atoi(argv[1]) : 200;
+    std::mt19937 rng(42);
+    volatile uint64_t sink = 0;
+
+    // Edge cases the generated topics never hit
+    const char *edge_topics[] = {"", "/", "a", "a/", "/a", "a//b", "a/b", "a/b/c", "ab/c", "+/*"};
+    const char *edge_patterns[] = {"*", "/*", "a/*", "a/b/*", "+", "+/+", "a/+", "*/b", "a/*/c",
+                                   "+/*", "a", "a/", "*/*", "ab*", "a+/c"};
+    for (const char *t : edge_topics) {
+        topic_view_t tv;
+        topic_view_init(tv, t, strlen(t));
+        for (const char *p : edge_patterns) {
+            if (topic_matches(topic_compile(p), tv) != legacy_matches(t, p)) {
+                std::cerr << "mismatch: " << t << " vs " << p << "\n";
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    std::cout << "split kernel: " << topic_split_kernel() << "\n\n";
+    std::cout << std::left << std::setw(7) << "depth"
+              << std::setw(14) << "split scalar" << std::setw(14) << "split vector"
+              << std::setw(14) << "match legacy" << std::setw(14) << "match scalar"
+              << std::setw(14) << "match vector" << std::setw(16) << "match compiled"
+              << "(ns per op)\n";
+
+    for (int depth = 1; depth <= 8; ++depth) {
+        std::vector<std::string> topics, patterns;
+        for (int i = 0; i < 256; ++i)
+            topics.push_back(make_topic(rng, depth));
+        for (int i = 0; i < 64; ++i)
+            patterns.push_back(make_pattern(rng, topics[rng() % topics.size()]));
+
+        // Patterns are split once, as the server does at subscribe time
+        std::vector<topic_view_t> pattern_views(patterns.size());
+        for (size_t p = 0; p < patterns.size(); ++p)
+            topic_view_init(pattern_views[p], patterns[p].data(), patterns[p].size());
+        std::vector<topic_matcher_t> compiled;
+        for (const auto& p : patterns)
+            compiled.push_back(topic_compile(p));
+
+        for (const auto& t : topics) {
+            topic_view_t tv;
+            topic_view_init(tv, t.data(), t.size());
+            for (size_t p = 0; p < patterns.size(); ++p) {
+                bool expected = legacy_matches(t, patterns[p]);
+                if (topic_matches_pattern(tv, pattern_views[p]) != expected ||
+                    topic_matches(compiled[p], tv) != expected) {
+                    std::cerr << "mismatch: " << t << " vs " << patterns[p] << "\n";
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+
+        double results[6];
+        topic_split_fn kernels[2] = {topic_split_scalar, topic_split};
+
+        // Split only
+        for (int k = 0; k < 2; ++k) {
+            topic_view_t tv;
+            double start = now_ns();
+            for (int it = 0; it < iterations * 64; ++it) {
+                for (const auto& t : topics) {
+                    topic_view_init(tv, t.data(), t.size(), kernels[k]);
+                    sink += tv.levels;
+                }
+            }
+            results[k] = (now_ns() - start) / (iterations * 64.0 * topics.size());
+        }
+
+        // Legacy: both sides split into strings on every comparison
+        double start = now_ns();
+        for (int it = 0; it < iterations; ++it)
+            for (const auto& t : topics)
+                for (const auto& p : patterns)
+                    sink += legacy_matches(t, p);
+        results[2] = (now_ns() - start) / ((double)iterations * topics.size() * patterns.size());
+
+        // Views: the topic is split once per message, patterns are pre-split
+        for (int k = 0; k < 2; ++k) {
+            start = now_ns();
+            for (int it = 0; it < iterations; ++it) {
+                for (const auto& t : topics) {
+                    topic_view_t tv;
+                    topic_view_init(tv, t.data(), t.size(), kernels[k]);
+                    for (const auto& pv : pattern_views)
+                        sink += topic_matches_pattern(tv, pv);
+                }
+            }
+            results[3 + k] = (now_ns() - start) / ((double)iterations * topics.size() * patterns.size());
+        }
+
+        // Compiled: each pattern dispatched to the matcher for its shape
+        start = now_ns();
+        for (int it = 0; it < iterations; ++it) {
+            for (const auto& t : topics) {
+                topic_view_t tv;
+                topic_view_init(tv, t.data(), t.size());
+                for (const auto& m : compiled)
+                    sink += topic_matches(m, tv);
+            }
+        }
+        results[5] = (now_ns() - start) / ((double)iterations * topics.size() * patterns.size());
+
+        std::cout << std::setw(7) << depth << std::fixed << std::setprecision(1);
+        for (double r : results)
+            std::cout << std::setw(14) << r;
+        std::cout << "\n";
+    }
+
+    return sink == 42 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
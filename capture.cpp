@@ -0,0 +1,94 @@
+#include "capture.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+capture_writer_t *capture_open(const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (!file)
+        return nullptr;
+    setvbuf(file, nullptr, _IOFBF, 1 << 20);
+
+    capture_header_t header = {};
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = CAPTURE_VERSION;
+    header.start_ns = realtime_ns();
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        fclose(file);
+        return nullptr;
+    }
+
+    capture_writer_t *writer = new capture_writer_t;
+    writer->file = file;
+    writer->start_ns = header.start_ns;
+    writer->records = 0;
+    return writer;
+}
+
+void capture_write(capture_writer_t *writer, uint64_t rx_ns, const sockaddr_in& from,
+                   const char *datagram, uint16_t len) {
+    capture_record_t record;
+    record.rx_ns = rx_ns > writer->start_ns ? rx_ns - writer->start_ns : 0;
+    record.addr = from.sin_addr.s_addr;
+    record.port = from.sin_port;
+    record.len = len;
+    fwrite(&record, sizeof(record), 1, writer->file);
+    fwrite(datagram, 1, len, writer->file);
+    writer->records++;
+}
+
+void capture_close(capture_writer_t *writer) {
+    if (!writer)
+        return;
+    if (fclose(writer->file) != 0)
+        perror("capture write");
+    delete writer;
+}
+
+bool capture_map(const char *path, capture_reader_t& reader) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(capture_header_t)) {
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    reader.map = (const char*)map;
+    reader.size = st.st_size;
+    reader.pos = sizeof(capture_header_t);
+    memcpy(&reader.header, reader.map, sizeof(reader.header));
+    if (memcmp(reader.header.magic, CAPTURE_MAGIC, sizeof(reader.header.magic)) != 0 ||
+        reader.header.version != CAPTURE_VERSION) {
+        capture_unmap(reader);
+        return false;
+    }
+    return true;
+}
+
+bool capture_next(capture_reader_t& reader, capture_record_t& record, const char *&datagram) {
+    // A record cut short by a crash ends the capture
+    if (reader.size - reader.pos < sizeof(record))
+        return false;
+    memcpy(&record, reader.map + reader.pos, sizeof(record));
+    if (reader.size - reader.pos - sizeof(record) < record.len)
+        return false;
+
+    datagram = reader.map + reader.pos + sizeof(record);
+    reader.pos += sizeof(record) + record.len;
+    return true;
+}
+
+void capture_unmap(capture_reader_t& reader) {
+    munmap((void*)reader.map, reader.size);
+    reader.map = nullptr;
+}
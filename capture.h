@@ -0,0 +1,110 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include "common.h"
+
+#include <stdio.h>
+
+/**
+ * @brief Magic bytes at the start of a capture file
+ */
+#define CAPTURE_MAGIC "PCCAPT\r\n"
+
+/**
+ * @brief Version of the capture layout written by this build
+ */
+#define CAPTURE_VERSION 1
+
+/**
+ * @brief Fixed header of a capture file
+ *
+ * Followed by one capture_record_t and the datagram bytes per received
+ * datagram, in arrival order. Integers are in host byte order except the
+ * source address, which is kept as it came off the socket.
+ */
+struct capture_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t start_ns;          ///< CLOCK_REALTIME when the capture was opened
+};
+
+/**
+ * @brief Header of one captured datagram
+ */
+struct capture_record_t {
+    uint64_t rx_ns;             ///< Receive time, relative to start_ns
+    uint32_t addr;              ///< Source IPv4 address (network byte order)
+    uint16_t port;              ///< Source port (network byte order)
+    uint16_t len;               ///< Datagram length
+};
+
+/**
+ * @brief Buffered writer of a capture file
+ */
+struct capture_writer_t {
+    FILE *file;
+    uint64_t start_ns;          ///< Time base of the records
+    uint64_t records;           ///< Datagrams written so far
+};
+
+/**
+ * @brief Read-only mapping of a capture file
+ */
+struct capture_reader_t {
+    const char *map;
+    size_t size;
+    size_t pos;                 ///< Offset of the next record
+    capture_header_t header;
+};
+
+/**
+ * @brief Create a capture file and write its header
+ *
+ * @param path Capture file path (truncated if it exists)
+ * @return capture_writer_t* Writer, or nullptr on failure
+ */
+capture_writer_t *capture_open(const char *path);
+
+/**
+ * @brief Append one datagram
+ *
+ * @param writer Capture writer
+ * @param rx_ns CLOCK_REALTIME receive time
+ * @param from Source of the datagram
+ * @param datagram Datagram bytes
+ * @param len Datagram length
+ */
+void capture_write(capture_writer_t *writer, uint64_t rx_ns, const sockaddr_in& from,
+                   const char *datagram, uint16_t len);
+
+/**
+ * @brief Flush and close a capture file, then free the writer
+ */
+void capture_close(capture_writer_t *writer);
+
+/**
+ * @brief Map a capture file and check its header
+ *
+ * @param path Capture file path
+ * @param reader Reader positioned on the first record
+ * @return true if the file is a capture of this version
+ */
+bool capture_map(const char *path, capture_reader_t& reader);
+
+/**
+ * @brief Take the next datagram
+ *
+ * @param reader Capture reader
+ * @param record Filled with the record header
+ * @param datagram Set to the datagram bytes, inside the mapping
+ * @return true if a complete record was taken
+ */
+bool capture_next(capture_reader_t& reader, capture_record_t& record, const char *&datagram);
+
+/**
+ * @brief Unmap a capture file
+ */
+void capture_unmap(capture_reader_t& reader);
+
+#endif // CAPTURE_H
@@ -1,11 +1,31 @@
 #include "common.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ARRAY_X86 1
+#endif
+
+// Non-blocking sockets are waited on here, so both helpers keep their
+// all-or-nothing semantics whatever mode the socket is in
+static bool retry_later(int sockfd, short events) {
+    if (errno == EINTR)
+        return true;
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return false;
+
+    struct pollfd pfd = {sockfd, events, 0};
+    poll(&pfd, 1, -1);
+    return true;
+}
+
 int recv_all(int sockfd, void *buffer, int len) {
     char *data = (char *)buffer;
     int total = 0;
     
     while(total < len) {
         int rc = recv(sockfd, data + total, len - total, 0);
+        if (rc == -1 && retry_later(sockfd, POLLIN))
+            continue;
         DIE(rc == -1, "receive failure");
         
         if(rc == 0) 
@@ -22,7 +42,12 @@ int send_all(int sockfd, void *buffer, int len) {
     int total = 0;
     
     while(total < len) {
-        int rc = send(sockfd, data + total, len - total, 0);
+        int rc = send(sockfd, data + total, len - total, MSG_NOSIGNAL);
+        if (rc == -1 && retry_later(sockfd, POLLOUT))
+            continue;
+        // The peer is gone; the caller's poll loop sees the hangup next
+        if (rc == -1 && (errno == EPIPE || errno == ECONNRESET))
+            return -1;
         DIE(rc == -1, "transmission failure");
         
         total += rc;
@@ -33,12 +58,15 @@ int send_all(int sockfd, void *buffer, int len) {
 
 // Parse a string into an array of arguments, similar to how main() receives argv
 // Returns the number of arguments found
-int string_to_argv(char *buf, char **argv) {
+int string_to_argv(char *buf, char **argv, int max_args) {
     int argc = 0;
     char *p, delim[3] = " \n";
 
     p = strtok(buf, delim);
     while (p) {
+        if (argc == max_args) {
+            return -1;
+        }
         argv[argc] = p;
         argc++;
         p = strtok(NULL, delim);
@@ -47,105 +75,295 @@ int string_to_argv(char *buf, char **argv) {
     return argc;
 }
 
-void parse_input(const std::string& buff) {
+bool message_decode(const char *buff, size_t len, decoded_message_t& message) {
     size_t pos = 0;
 
-    // Extract UDP client IP (4 bytes)
-    in_addr_t ip_addr;
-    memcpy(&ip_addr, buff.data() + pos, sizeof(in_addr_t));
+    // Source header, topic field and type byte come first
+    if (len < sizeof(in_addr_t) + sizeof(uint16_t) + 50 + 1) {
+        return false;
+    }
+
+    // Extract UDP client IP (4 bytes) and port (2 bytes)
+    memcpy(&message.source_ip.s_addr, buff + pos, sizeof(in_addr_t));
     pos += sizeof(in_addr_t);
-    
-    // Extract UDP client port (2 bytes)
     uint16_t port;
-    memcpy(&port, buff.data() + pos, sizeof(uint16_t));
+    memcpy(&port, buff + pos, sizeof(uint16_t));
+    message.source_port = ntohs(port);
     pos += sizeof(uint16_t);
-    
-    // Convert IP to string format
-    struct in_addr ip_struct;
-    ip_struct.s_addr = ip_addr;
-    std::string ip_str = inet_ntoa(ip_struct);
-    
-    // Format beginning of output string
-    std::string output = ip_str + ":" + std::to_string(ntohs(port)) + " - ";
-
-    // Extract topic (fixed 50 byte field) and trim at first null character
-    std::string topic = buff.substr(pos, 50);
-    size_t null_pos = topic.find('\0');
-    if (null_pos != std::string::npos) {
-        topic.resize(null_pos);
-    }
+
+    // Topic (fixed 50 byte field), up to the first null character
+    message.topic = std::string_view(buff + pos, strnlen(buff + pos, 50));
     pos += 50;
 
-    // Ensure there's still data to read
-    if (pos >= buff.size()) return;
-    
     // Read message type byte (INT, SHORT_REAL, FLOAT, or STRING)
-    unsigned char type = buff[pos++];
+    message.type = (data_t)(unsigned char)buff[pos++];
+    message.trace = nullptr;
+    message.seq = 0;
 
-    std::cout << output << topic;
-
-    // Process message based on data type
-    switch (type) {
+    switch (message.type) {
         case INT: {
             // Integer format: 1 byte sign + 4 bytes integer (network byte order)
-            if (pos + sizeof(char) + sizeof(uint32_t) > buff.size()) break;
+            if (pos + sizeof(char) + sizeof(uint32_t) > len) return false;
             char sign = buff[pos++];
-            
-            // Extract integer value and convert from network byte order
+
             uint32_t net_value;
-            memcpy(&net_value, buff.data() + pos, sizeof(uint32_t));
+            memcpy(&net_value, buff + pos, sizeof(uint32_t));
             int value = ntohl(net_value);
             if (sign) value = -value;
-            
-            std::cout << " - INT - " << value << "\n";
-            pos += sizeof(uint32_t);
-            break;
+            message.integer = value;
+            return true;
         }
         case SHORT_REAL: {
             // Short real format: 2 bytes for fixed-point value with 2 decimal places
-            if (pos + sizeof(uint16_t) > buff.size()) break;
-            
-            // Extract value and convert from network byte order
-            // Division by 100 converts fixed-point to floating point
+            if (pos + sizeof(uint16_t) > len) return false;
+
             uint16_t net_value;
-            memcpy(&net_value, buff.data() + pos, sizeof(uint16_t));
+            memcpy(&net_value, buff + pos, sizeof(uint16_t));
             float value = ntohs(net_value) / 100.0f;
-            
-            std::cout << " - SHORT_REAL - " 
-                      << std::fixed << std::setprecision(2) << value << "\n";
-            pos += sizeof(uint16_t);
-            break;
+            message.real = value;
+            message.precision = 2;
+            return true;
         }
         case FLOAT: {
             // Float format: 1 byte sign + 4 bytes value + 1 byte exponent
-            if (pos + sizeof(char) + sizeof(uint32_t) + sizeof(char) > buff.size()) break;
+            if (pos + sizeof(char) + sizeof(uint32_t) + sizeof(char) > len) return false;
             char sign = buff[pos++];
-            
-            // Extract mantissa and exponent
+
             uint32_t net_value;
-            memcpy(&net_value, buff.data() + pos, sizeof(uint32_t));
+            memcpy(&net_value, buff + pos, sizeof(uint32_t));
             pos += sizeof(uint32_t);
             char exponent = buff[pos++];
-            
+
             // Calculate actual float value: mantissa / 10^exponent
             float value = ntohl(net_value);
             if (sign) value = -value;
             value /= pow(10, exponent);
-            
-            // Display with appropriate precision based on exponent
-            std::cout << " - FLOAT - " 
-                      << std::fixed << std::setprecision(exponent) << value << "\n";
-            break;
+            message.real = value;
+            message.precision = exponent;
+            return true;
         }
         case STRING: {
-            // String format: null-terminated string
-            // Find end of string (null character or end of buffer)
-            size_t end = buff.find('\0', pos);
-            if (end == std::string::npos) end = buff.size();
-            std::string payload = buff.substr(pos, end - pos);
-            
-            std::cout << " - STRING - " << payload << "\n";
-            break;
+            // String format: up to a null character or the end of the body
+            message.text = std::string_view(buff + pos, strnlen(buff + pos, len - pos));
+            return true;
+        }
+        case AGGREGATE_VALUE: {
+            // Window, count, precision, then minimum, maximum and mean as doubles
+            if (pos + AGGREGATE_PAYLOAD_SIZE > len) return false;
+            uint32_t net_value;
+            memcpy(&net_value, buff + pos, sizeof(uint32_t));
+            message.window_ms = ntohl(net_value);
+            memcpy(&net_value, buff + pos + 4, sizeof(uint32_t));
+            message.count = ntohl(net_value);
+            message.precision = (unsigned char)buff[pos + 8];
+
+            double values[3];
+            for (int i = 0; i < 3; ++i) {
+                uint64_t bits;
+                memcpy(&bits, buff + pos + 9 + i * sizeof(bits), sizeof(bits));
+                bits = be64toh(bits);
+                memcpy(&values[i], &bits, sizeof(bits));
+            }
+            message.minimum = values[0];
+            message.maximum = values[1];
+            message.real = values[2];
+            return true;
+        }
+        case INT32_ARRAY:
+        case FIXED_ARRAY: {
+            // Element count, the decimals of a FIXED_ARRAY, then the elements
+            // themselves, left in place for the array kernels
+            size_t header = message.type == INT32_ARRAY ? INT32_ARRAY_HEADER_SIZE : FIXED_ARRAY_HEADER_SIZE;
+            if (pos + header > len) return false;
+
+            uint16_t net_count;
+            memcpy(&net_count, buff + pos, sizeof(uint16_t));
+            message.count = ntohs(net_count);
+            message.precision = message.type == FIXED_ARRAY ? (unsigned char)buff[pos + 2] : 0;
+            if (message.precision > FIXED_ARRAY_MAX_DECIMALS) return false;
+            pos += header;
+
+            if (pos + (size_t)message.count * sizeof(int32_t) > len) return false;
+            message.array = buff + pos;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Exact doubles, so dividing by them rounds once, like a decimal point shift
+static const double powers_of_ten[FIXED_ARRAY_MAX_DECIMALS + 1] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9
+};
+
+void array_to_int32_scalar(const char *src, uint32_t count, int32_t *dst) {
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t net_value;
+        memcpy(&net_value, src + i * sizeof(net_value), sizeof(net_value));
+        dst[i] = (int32_t)ntohl(net_value);
+    }
+}
+
+void array_to_double_scalar(const char *src, uint32_t count, int decimals, double *dst) {
+    double scale = powers_of_ten[decimals];
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t net_value;
+        memcpy(&net_value, src + i * sizeof(net_value), sizeof(net_value));
+        dst[i] = (int32_t)ntohl(net_value) / scale;
+    }
+}
+
+#ifdef ARRAY_X86
+// Reverses the bytes of each 32-bit lane
+#define BSWAP32_LANES 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+
+__attribute__((target("ssse3")))
+static void array_to_int32_ssse3(const char *src, uint32_t count, int32_t *dst) {
+    const __m128i swap = _mm_setr_epi8(BSWAP32_LANES);
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(src + i * 4));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_shuffle_epi8(chunk, swap));
+    }
+    array_to_int32_scalar(src + i * 4, count - i, dst + i);
+}
+
+__attribute__((target("ssse3")))
+static void array_to_double_ssse3(const char *src, uint32_t count, int decimals, double *dst) {
+    const __m128i swap = _mm_setr_epi8(BSWAP32_LANES);
+    const __m128d scale = _mm_set1_pd(powers_of_ten[decimals]);
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i chunk = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(src + i * 4)), swap);
+        _mm_storeu_pd(dst + i, _mm_div_pd(_mm_cvtepi32_pd(chunk), scale));
+        _mm_storeu_pd(dst + i + 2, _mm_div_pd(_mm_cvtepi32_pd(_mm_unpackhi_epi64(chunk, chunk)), scale));
+    }
+    array_to_double_scalar(src + i * 4, count - i, decimals, dst + i);
+}
+
+// The AVX2 kernels finish with the scalar loop, not the SSSE3 kernels:
+// legacy SSE code right after AVX2 code pays a state transition per call
+__attribute__((target("avx2")))
+static void array_to_int32_avx2(const char *src, uint32_t count, int32_t *dst) {
+    const __m256i swap = _mm256_setr_epi8(BSWAP32_LANES, BSWAP32_LANES);
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(src + i * 4));
+        _mm256_storeu_si256((__m256i*)(dst + i), _mm256_shuffle_epi8(chunk, swap));
+    }
+    array_to_int32_scalar(src + i * 4, count - i, dst + i);
+}
+
+__attribute__((target("avx2")))
+static void array_to_double_avx2(const char *src, uint32_t count, int decimals, double *dst) {
+    const __m256i swap = _mm256_setr_epi8(BSWAP32_LANES, BSWAP32_LANES);
+    const __m256d scale = _mm256_set1_pd(powers_of_ten[decimals]);
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i chunk = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(src + i * 4)), swap);
+        __m256d low = _mm256_cvtepi32_pd(_mm256_castsi256_si128(chunk));
+        __m256d high = _mm256_cvtepi32_pd(_mm256_extracti128_si256(chunk, 1));
+        _mm256_storeu_pd(dst + i, _mm256_div_pd(low, scale));
+        _mm256_storeu_pd(dst + i + 4, _mm256_div_pd(high, scale));
+    }
+    array_to_double_scalar(src + i * 4, count - i, decimals, dst + i);
+}
+#endif
+
+struct array_kernels_t {
+    const char *name;
+    array_int32_fn to_int32;
+    array_double_fn to_double;
+};
+
+static array_kernels_t resolve_array_kernels() {
+#ifdef ARRAY_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return {"avx2", array_to_int32_avx2, array_to_double_avx2};
+    if (__builtin_cpu_supports("ssse3"))
+        return {"ssse3", array_to_int32_ssse3, array_to_double_ssse3};
+#endif
+    return {"scalar", array_to_int32_scalar, array_to_double_scalar};
+}
+
+static const array_kernels_t array_kernels = resolve_array_kernels();
+
+void array_to_int32(const char *src, uint32_t count, int32_t *dst) {
+    array_kernels.to_int32(src, count, dst);
+}
+
+void array_to_double(const char *src, uint32_t count, int decimals, double *dst) {
+    array_kernels.to_double(src, count, decimals, dst);
+}
+
+const char *array_kernel() {
+    return array_kernels.name;
+}
+
+// Print array elements, converted a chunk at a time so nothing is allocated
+static void print_array(const decoded_message_t& message, std::ostream& out) {
+    const uint32_t chunk = 256;
+    out << "[";
+    for (uint32_t done = 0; done < message.count; done += chunk) {
+        uint32_t n = std::min(chunk, message.count - done);
+        const char *src = message.array + done * sizeof(int32_t);
+        if (message.type == INT32_ARRAY) {
+            int32_t values[chunk];
+            array_to_int32(src, n, values);
+            for (uint32_t i = 0; i < n; ++i)
+                out << (done + i ? ", " : "") << values[i];
+        } else {
+            double values[chunk];
+            array_to_double(src, n, message.precision, values);
+            out << std::fixed << std::setprecision(message.precision);
+            for (uint32_t i = 0; i < n; ++i)
+                out << (done + i ? ", " : "") << values[i];
         }
     }
-}
\ No newline at end of file
+    out << "]\n";
+}
+
+void message_print(const decoded_message_t& message, std::ostream& out) {
+    out << inet_ntoa(message.source_ip) << ":" << message.source_port << " - " << message.topic;
+
+    switch (message.type) {
+        case INT:
+            out << " - INT - " << message.integer << "\n";
+            break;
+        case SHORT_REAL:
+            out << " - SHORT_REAL - "
+                << std::fixed << std::setprecision(message.precision) << message.real << "\n";
+            break;
+        case FLOAT:
+            // Display with appropriate precision based on exponent
+            out << " - FLOAT - "
+                << std::fixed << std::setprecision(message.precision) << message.real << "\n";
+            break;
+        case STRING:
+            out << " - STRING - " << message.text << "\n";
+            break;
+        case AGGREGATE_VALUE:
+            // The mean gets two more decimals than the values it summarizes
+            out << " - AGGREGATE - " << message.count << " values in " << message.window_ms << " ms"
+                << std::fixed << std::setprecision(message.precision)
+                << ", min " << message.minimum << ", max " << message.maximum
+                << std::setprecision(message.precision + 2) << ", avg " << message.real << "\n";
+            break;
+        case INT32_ARRAY:
+            out << " - INT32_ARRAY - ";
+            print_array(message, out);
+            break;
+        case FIXED_ARRAY:
+            out << " - FIXED_ARRAY - ";
+            print_array(message, out);
+            break;
+    }
+}
+
+void parse_input(const std::string& buff) {
+    decoded_message_t message;
+    if (message_decode(buff.data(), buff.size(), message)) {
+        message_print(message, std::cout);
+    }
+}
@@ -2,14 +2,17 @@
 #define COMMON_H
 
 #include <arpa/inet.h>
+#include <endian.h>
 #include <errno.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <string.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <cmath>
+#include <string_view>
 #include <vector>
 #include <poll.h>
 #include <iostream>
@@ -20,6 +23,95 @@
  */
 #define MESSAGES_SIZE 1500
 
+/**
+ * @brief Bits of a frame's length word that hold the body length
+ *
+ * Every frame the server sends is an int length word followed by the body.
+ * The high byte of the word carries FRAME_* flags.
+ */
+#define FRAME_LEN_MASK 0x00ffffff
+
+/**
+ * @brief Frame flag: the body is a tcp_request_t from the server (e.g. SHUTDOWN)
+ */
+#define FRAME_CONTROL (1 << 24)
+
+/**
+ * @brief Frame flag: the body starts with a trace_stamps_t, then the message
+ */
+#define FRAME_TRACE (1 << 25)
+
+/**
+ * @brief Frame flag: empty frame telling an idle reader its shared-memory ring has data
+ */
+#define FRAME_DOORBELL (1 << 26)
+
+/**
+ * @brief Frame flag: the body starts with the message's sequence number (u64, network order)
+ *
+ * The sequence number comes before the trace stamps when both are present.
+ */
+#define FRAME_SEQ (1 << 27)
+
+/**
+ * @brief Frame flag: the body is a block of whole frames, compressed (see lz.h)
+ *
+ * The body starts with the block's length before compression (u32, network
+ * order). Blocks of one connection form a single stream: each can refer
+ * back to the ones before it, so they must be decoded in order.
+ */
+#define FRAME_COMPRESSED (1 << 28)
+
+/**
+ * @brief Frame flag: a multicast datagram resent over TCP after a NACK
+ *
+ * The body is the datagram as it was multicast: its multicast sequence
+ * number (u64, network order), then an unflagged body.
+ */
+#define FRAME_REPAIR (1 << 29)
+
+/**
+ * @brief Multicast datagrams the server keeps for repair; older ones cannot be NACKed
+ */
+#define MULTICAST_HISTORY 4096
+
+/**
+ * @brief CONNECT option: stamp the messages sent to this client (see trace_stamps_t)
+ */
+#define CONNECT_TRACE 0x1
+
+/**
+ * @brief CONNECT option: the client is another broker linking to this one
+ */
+#define CONNECT_PEER 0x2
+
+/**
+ * @brief CONNECT option: deliver through the shared-memory ring named in the request
+ */
+#define CONNECT_SHM 0x4
+
+/**
+ * @brief CONNECT option: number the messages, keep SF ones until acknowledged and resume after resume_seq
+ */
+#define CONNECT_SEQ 0x8
+
+/**
+ * @brief CONNECT option: batch the frames of a loop turn into FRAME_COMPRESSED frames
+ *
+ * The server may still send plain frames (to a ring or peer, or before the
+ * option took effect), so the client must accept both.
+ */
+#define CONNECT_COMPRESS 0x10
+
+/**
+ * @brief CONNECT option: the client can receive hot messages from a multicast group
+ *
+ * The server answers with a MULTICAST_JOIN notice when it multicasts and the
+ * client is eligible (same host, plain TCP delivery); otherwise the flag has
+ * no effect.
+ */
+#define CONNECT_MULTICAST 0x20
+
 /**
  * @brief Macro to handle errors
  * 
@@ -43,6 +135,10 @@ enum command_t {
     SUBSCRIBE,          ///< Client subscribes to a topic
     UNSUBSCRIBE,        ///< Client unsubscribes from a topic
     MESSAGE,          ///< Client sends a message
+    ACK,                ///< Client processed every message up to a sequence number
+    AGGREGATE,          ///< Client subscribes to per-window aggregates of numeric topics
+    JOINED,             ///< Client joined the multicast group it was told to join
+    NACK,               ///< Client missed multicast datagrams and asks for them over TCP
 };
 
 /**
@@ -50,7 +146,9 @@ enum command_t {
  */
 enum system_message_t {
     CONNECT,        ///< Client connects to the server
-    SHUTDOWN        ///< Server notifies clients it's shutting down
+    SHUTDOWN,       ///< Server notifies clients it's shutting down
+    MULTICAST_JOIN, ///< Server tells a client to join its multicast group
+    MULTICAST_START ///< Server multicasts to the client from a sequence number on
 };
 
 /**
@@ -60,9 +158,40 @@ enum data_t {
     INT = 0,            ///< Integer value
     SHORT_REAL = 1,     ///< Short real value (fixed 2 decimal places)
     FLOAT = 2,          ///< Float value (variable decimal places)
-    STRING = 3          ///< String value
+    STRING = 3,         ///< String value
+    AGGREGATE_VALUE = 4,///< Window aggregate emitted by the server
+    INT32_ARRAY = 5,    ///< Array of signed 32-bit integers
+    FIXED_ARRAY = 6     ///< Array of fixed-point values sharing one number of decimals
 };
 
+/**
+ * @brief Header of an INT32_ARRAY payload: the element count (u16, network order)
+ *
+ * The elements follow as two's complement 32-bit integers in network byte order.
+ */
+#define INT32_ARRAY_HEADER_SIZE 2
+
+/**
+ * @brief Header of a FIXED_ARRAY payload: the element count (u16, network order), then the decimals (u8)
+ *
+ * The elements follow as in an INT32_ARRAY; each value is element / 10^decimals.
+ */
+#define FIXED_ARRAY_HEADER_SIZE 3
+
+/**
+ * @brief Most decimals a FIXED_ARRAY may have (an int32 has at most 10 digits)
+ */
+#define FIXED_ARRAY_MAX_DECIMALS 9
+
+/**
+ * @brief Payload of an AGGREGATE_VALUE message, after the type byte
+ *
+ * Window length and value count as u32, the decimals of the most precise
+ * value as one byte, then minimum, maximum and mean as IEEE 754 doubles
+ * whose bit patterns are in network byte order.
+ */
+#define AGGREGATE_PAYLOAD_SIZE (4 + 4 + 1 + 3 * 8)
+
 /**
  * @brief Structure for a subscription request
  */
@@ -71,6 +200,17 @@ struct subscribe_t {
     bool sf;            ///< Store-and-forward flag
 };
 
+/**
+ * @brief Structure for an aggregate subscription request
+ *
+ * Packed so that it fits the union of tcp_request_t without changing its
+ * size, which leaves room for patterns of up to 47 characters.
+ */
+struct __attribute__((packed)) aggregate_t {
+    char topic[48];     ///< Topic pattern (max 47 chars + null terminator)
+    uint32_t window_ms; ///< Window length in milliseconds (network byte order)
+};
+
 /**
  * @brief Structure for an unsubscription request
  */
@@ -78,6 +218,56 @@ struct unsubscribe_t {
     char topic[51];     ///< Topic name (max 50 chars + null terminator)
 };
 
+/**
+ * @brief Structure for a connection request
+ *
+ * Packed so that it fits the union of tcp_request_t without changing its size.
+ */
+struct __attribute__((packed)) connect_t {
+    system_message_t message;   ///< CONNECT (shares its place with tcp_request_t::message)
+    uint32_t flags;             ///< CONNECT_* options requested by the client
+    uint8_t ring_token[16];     ///< Token the ring of a CONNECT_SHM client was offered under
+    uint64_t resume_seq;        ///< Last sequence number a CONNECT_SEQ client processed (0 = none)
+};
+
+/**
+ * @brief Structure for an acknowledgement
+ */
+struct __attribute__((packed)) ack_t {
+    uint64_t seq;               ///< Every message numbered up to this one was processed
+};
+
+/**
+ * @brief Structure for a NACK: multicast datagrams to resend
+ */
+struct __attribute__((packed)) nack_t {
+    uint64_t from;              ///< First multicast sequence number missing
+    uint32_t count;             ///< Number of consecutive datagrams missing
+};
+
+/**
+ * @brief Structure for a multicast notice from the server (MULTICAST_JOIN or MULTICAST_START)
+ */
+struct __attribute__((packed)) multicast_notice_t {
+    system_message_t message;   ///< Notice (shares its place with tcp_request_t::message)
+    uint32_t group;             ///< MULTICAST_JOIN: group address (network order)
+    uint16_t port;              ///< MULTICAST_JOIN: group port (network order)
+    uint64_t mseq;              ///< MULTICAST_START: first sequence number sent to the group for the client
+};
+
+/**
+ * @brief Points in a message's life, prepended to FRAME_TRACE frames
+ *
+ * CLOCK_REALTIME nanoseconds in network byte order, so a subscriber on the
+ * same host can measure every stage against its own receive time.
+ */
+struct trace_stamps_t {
+    uint64_t kernel_rx_ns;  ///< Datagram reached the UDP socket (kernel timestamp, 0 if unknown)
+    uint64_t read_ns;       ///< Datagram read by the server
+    uint64_t matched_ns;    ///< Matching against all subscriptions finished
+    uint64_t sent_ns;       ///< Frame handed to the kernel for this subscriber
+};
+
 /**
  * @brief Structure for a TCP request
  */
@@ -87,10 +277,48 @@ struct tcp_request_t {
         subscribe_t subscribe;      ///< Subscribe request data
         unsubscribe_t unsubscribe;  ///< Unsubscribe request data
         system_message_t message;  ///< System message data
+        connect_t connect;          ///< Connect request data
+        ack_t ack;                  ///< Acknowledgement data
+        aggregate_t aggregate;      ///< Aggregate subscription data
+        nack_t nack;                ///< Multicast repair request
+        multicast_notice_t multicast;  ///< Multicast notice from the server
     };
     command_t type;  ///< Type of request (-1 for system messages)
 };
 
+/**
+ * @brief A subscription message decoded in place
+ *
+ * The views point into the frame body the message was decoded from and are
+ * only valid as long as that buffer is.
+ */
+struct decoded_message_t {
+    in_addr source_ip;              ///< UDP client that published the message
+    uint16_t source_port;           ///< UDP client port (host byte order)
+    std::string_view topic;         ///< Topic, without the padding of its field
+    data_t type;                    ///< Which of the value fields is set
+    int64_t integer;                ///< INT value
+    double real;                    ///< SHORT_REAL or FLOAT value, mean of an AGGREGATE_VALUE
+    int precision;                  ///< Decimals of a SHORT_REAL, FLOAT, AGGREGATE_VALUE or FIXED_ARRAY value
+    double minimum;                 ///< Smallest value of an AGGREGATE_VALUE window
+    double maximum;                 ///< Largest value of an AGGREGATE_VALUE window
+    uint32_t count;                 ///< Values in an AGGREGATE_VALUE window, elements of an array
+    uint32_t window_ms;             ///< Length of an AGGREGATE_VALUE window
+    std::string_view text;          ///< STRING value
+    const char *array;              ///< Raw elements of an INT32_ARRAY or FIXED_ARRAY (see array_to_int32)
+    const trace_stamps_t *trace;    ///< Stamps of a FRAME_TRACE frame, else nullptr
+    uint64_t seq;                   ///< Sequence number of a FRAME_SEQ frame, else 0
+};
+
+/**
+ * @brief Current CLOCK_REALTIME time in nanoseconds
+ */
+inline uint64_t realtime_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 /**
  * @brief Receives exactly 'len' bytes from socket
  * 
@@ -107,7 +335,7 @@ int recv_all(int sockfd, void *buffer, int len);
  * @param sockfd Socket file descriptor
  * @param buffer Buffer containing data to send
  * @param len Number of bytes to send
- * @return int Number of bytes sent
+ * @return int Number of bytes sent, or -1 if the peer closed the connection
  */
 int send_all(int sockfd, void *buffer, int len);
 
@@ -116,9 +344,71 @@ int send_all(int sockfd, void *buffer, int len);
  * 
  * @param buf String to parse
  * @param argv Array to store parsed arguments
- * @return int Number of arguments parsed
+ * @param max_args Room in argv
+ * @return int Number of arguments parsed, -1 if there are more than max_args
+ */
+int string_to_argv(char *buf, char **argv, int max_args);
+
+/**
+ * @brief Decode a frame body (source header, then the datagram) without copying
+ *
+ * @param buff Frame body
+ * @param len Length of the body
+ * @param message Filled with the decoded fields
+ * @return true if the body holds a complete message of a known type
+ */
+bool message_decode(const char *buff, size_t len, decoded_message_t& message);
+
+/**
+ * @brief Array conversion kernel: count big-endian int32 elements to host integers
+ */
+typedef void (*array_int32_fn)(const char *src, uint32_t count, int32_t *dst);
+
+/**
+ * @brief Array conversion kernel: count big-endian int32 elements scaled down by 10^decimals
+ */
+typedef void (*array_double_fn)(const char *src, uint32_t count, int decimals, double *dst);
+
+/**
+ * @brief Reference kernels: one byte swap, and one division by a table power of ten, per element
+ */
+void array_to_int32_scalar(const char *src, uint32_t count, int32_t *dst);
+void array_to_double_scalar(const char *src, uint32_t count, int decimals, double *dst);
+
+/**
+ * @brief Convert the elements of an INT32_ARRAY with the fastest kernel the CPU supports
+ *
+ * @param src Raw elements (decoded_message_t::array), no alignment required
+ * @param count Number of elements
+ * @param dst Room for count integers
+ */
+void array_to_int32(const char *src, uint32_t count, int32_t *dst);
+
+/**
+ * @brief Convert the elements of a FIXED_ARRAY (or an INT32_ARRAY, with 0 decimals) to doubles
+ *
+ * Results are exactly those of the scalar kernel: each element divided by
+ * the exact double 10^decimals.
+ *
+ * @param src Raw elements (decoded_message_t::array), no alignment required
+ * @param count Number of elements
+ * @param decimals Decimals, 0 to FIXED_ARRAY_MAX_DECIMALS
+ * @param dst Room for count doubles
+ */
+void array_to_double(const char *src, uint32_t count, int decimals, double *dst);
+
+/**
+ * @brief Name of the kernels the array conversions dispatch to ("avx2", "ssse3", "scalar")
+ */
+const char *array_kernel();
+
+/**
+ * @brief Print a decoded message as a line of subscriber output
+ *
+ * @param message Decoded message
+ * @param out Stream to print to
  */
-int string_to_argv(char *buf, char **argv);
+void message_print(const decoded_message_t& message, std::ostream& out);
 
 /**
  * @brief Parse a subscription message and print it
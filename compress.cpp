@@ -0,0 +1,188 @@
+#include "compress.h"
+
+static compress_stream_t* stream_new(compressor_t& owner, const topic_set_t* topics, uint32_t flags) {
+    compress_stream_t* stream = new compress_stream_t;
+    stream->owner = &owner;
+    stream->topics = topics;
+    stream->flags = flags;
+    stream->joinable = false;
+    return stream;
+}
+
+// Stop offering a stream to connecting clients
+static void stream_seal(compress_stream_t* stream) {
+    if (stream->joinable) {
+        stream->owner->fresh.erase({stream->topics, stream->flags});
+        stream->joinable = false;
+    }
+}
+
+static void stream_free(compress_stream_t* stream) {
+    stream_seal(stream);
+    if (stream->dirty) {
+        auto& dirty = stream->owner->dirty;
+        dirty.erase(std::find(dirty.begin(), dirty.end(), stream));
+    }
+    delete stream->encoder;
+    delete stream;
+}
+
+// Traced clients get stamps of their own in every frame, so they never share
+static void stream_join(compressor_t& owner, tcp_client_t* client) {
+    bool shareable = !(client->flags & CONNECT_TRACE);
+    std::pair<const topic_set_t*, uint32_t> key = {client->topics, client->flags};
+
+    auto it = shareable ? owner.fresh.find(key) : owner.fresh.end();
+    if (it != owner.fresh.end()) {
+        client->stream = it->second;
+    } else {
+        client->stream = stream_new(owner, client->topics, client->flags);
+        if (shareable) {
+            client->stream->joinable = true;
+            owner.fresh[key] = client->stream;
+        }
+    }
+    client->stream->members.push_back(client);
+}
+
+// Compress what is pending and send it to every member
+static void stream_flush(compress_stream_t* stream) {
+    compressor_t& owner = *stream->owner;
+    if (!stream->encoder) {
+        stream->encoder = new lz_encoder_t;
+    }
+
+    uint32_t raw_len = stream->pending.size();
+    const size_t prefix = sizeof(int) + sizeof(uint32_t);
+    owner.out.resize(prefix + LZ_BOUND(raw_len));
+    size_t len = prefix + lz_compress(*stream->encoder, stream->pending.data(), raw_len, owner.out.data() + prefix);
+
+    int header = FRAME_COMPRESSED | (int)(len - sizeof(int));
+    uint32_t net_raw_len = htonl(raw_len);
+    memcpy(owner.out.data(), &header, sizeof(header));
+    memcpy(owner.out.data() + sizeof(int), &net_raw_len, sizeof(net_raw_len));
+
+    for (auto* member : stream->members) {
+        send_all(member->fd, owner.out.data(), len);
+    }
+    stream->pending.clear();
+
+    metrics_t& metrics = local_metrics();
+    metrics.compress_in.add(raw_len);
+    metrics.compress_out.add(len);
+    metrics.compress_sent.add(len * stream->members.size());
+}
+
+void compress_attach(ServerState& state, tcp_client_t* client) {
+    if (!state.compression) {
+        state.compression = new compressor_t;
+    }
+    compress_leave(state, client);
+    stream_join(*state.compression, client);
+}
+
+void compress_leave(ServerState& state, tcp_client_t* client) {
+    compress_stream_t* stream = client->stream;
+    if (!stream) {
+        return;
+    }
+    client->stream = nullptr;
+
+    auto& members = stream->members;
+    members.erase(std::find(members.begin(), members.end(), client));
+    if (members.empty()) {
+        stream_free(stream);
+    }
+}
+
+void compress_isolate(ServerState& state, tcp_client_t* client) {
+    compress_stream_t* stream = client->stream;
+    if (!stream) {
+        return;
+    }
+    if (stream->members.size() == 1) {
+        stream_seal(stream);
+        return;
+    }
+
+    // The copy continues exactly where the shared stream is, pending frames included
+    compress_stream_t* copy = stream_new(*stream->owner, stream->topics, stream->flags);
+    if (stream->encoder) {
+        copy->encoder = new lz_encoder_t(*stream->encoder);
+    }
+    copy->pending = stream->pending;
+    if (!copy->pending.empty()) {
+        copy->dirty = true;
+        copy->owner->dirty.push_back(copy);
+    }
+
+    auto& members = stream->members;
+    members.erase(std::find(members.begin(), members.end(), client));
+    copy->members.push_back(client);
+    client->stream = copy;
+}
+
+void compress_rekey(ServerState& state, tcp_client_t* client) {
+    compress_stream_t* stream = client->stream;
+    if (!stream || stream->topics == client->topics) {
+        return;
+    }
+
+    // Nothing was written to a joinable stream yet: move to the one of the new set
+    if (stream->joinable) {
+        compress_leave(state, client);
+        stream_join(*state.compression, client);
+        return;
+    }
+
+    compress_isolate(state, client);
+    client->stream->topics = client->topics;
+}
+
+void compress_append(tcp_client_t* client, const stored_message_t* message, const struct iovec* parts,
+                     int count) {
+    compress_stream_t* stream = client->stream;
+    if (stream->members.size() > 1 && stream->last_message == message && stream->last_seq == message->seq) {
+        return;  // Already appended for another member
+    }
+    stream->last_message = message;
+    stream->last_seq = message->seq;
+
+    size_t len = 0;
+    for (int i = 0; i < count; ++i) {
+        len += parts[i].iov_len;
+    }
+    if (stream->pending.size() + len > LZ_BLOCK_MAX) {
+        stream_flush(stream);
+    }
+
+    stream_seal(stream);
+    for (int i = 0; i < count; ++i) {
+        stream->pending.append((const char*)parts[i].iov_base, parts[i].iov_len);
+    }
+    if (!stream->dirty) {
+        stream->dirty = true;
+        stream->owner->dirty.push_back(stream);
+    }
+}
+
+void compress_flush(ServerState& state) {
+    if (!state.compression || state.compression->dirty.empty()) {
+        return;
+    }
+
+    for (auto* stream : state.compression->dirty) {
+        stream->dirty = false;
+        if (!stream->pending.empty()) {
+            stream_flush(stream);
+        }
+    }
+    state.compression->dirty.clear();
+}
+
+void compress_free(ServerState& state) {
+    for (auto& client : state.client_list) {
+        compress_leave(state, &client);
+    }
+    delete state.compression;
+}
@@ -0,0 +1,98 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include "server.h"
+#include "lz.h"
+
+struct compressor_t;
+
+/**
+ * @brief Compressed output of one or more CONNECT_COMPRESS clients
+ *
+ * Frames for the members are appended to pending and compressed together
+ * once per loop turn, as one FRAME_COMPRESSED frame. Clients with the same
+ * subscription set and flags that connect before any output is written
+ * share a stream: every routed message reaches all of them, so the stream
+ * is compressed once and the same bytes go to every member. A member that
+ * is about to receive frames of its own first gets a private copy.
+ */
+struct compress_stream_t {
+    compressor_t* owner;                    ///< Compression state of the server
+    lz_encoder_t* encoder = nullptr;        ///< Allocated with the first output
+    std::string pending;                    ///< Frames appended since the last flush
+    std::vector<tcp_client_t*> members;     ///< Clients receiving the stream
+    const topic_set_t* topics;              ///< Subscription set of the members
+    uint32_t flags;                         ///< CONNECT_* flags of the members
+    bool joinable;                          ///< Listed in compressor_t::fresh
+    bool dirty = false;                     ///< Listed in compressor_t::dirty
+    const stored_message_t* last_message = nullptr;  ///< Last message appended, with its
+    uint64_t last_seq = 0;                  ///< sequence number: the other members skip it
+};
+
+/**
+ * @brief Compressed streams of the server
+ */
+struct compressor_t {
+    std::map<std::pair<const topic_set_t*, uint32_t>, compress_stream_t*> fresh;  ///< Joinable streams, by set and flags
+    std::vector<compress_stream_t*> dirty;  ///< Streams with pending frames
+    std::vector<char> out;                  ///< Compressed frame being sent
+};
+
+/**
+ * @brief Give a connecting CONNECT_COMPRESS client a stream
+ *
+ * It joins a stream no output was written to yet with the same
+ * subscriptions and flags, or starts one.
+ */
+void compress_attach(ServerState& state, tcp_client_t* client);
+
+/**
+ * @brief Take a disconnecting client out of its stream
+ *
+ * Frames pending for the other members are still flushed to them.
+ */
+void compress_leave(ServerState& state, tcp_client_t* client);
+
+/**
+ * @brief Make sure a client's stream is its own, before frames only it receives
+ *
+ * A shared stream is copied, pending frames and compressor state included.
+ */
+void compress_isolate(ServerState& state, tcp_client_t* client);
+
+/**
+ * @brief Follow a change of a client's subscriptions
+ *
+ * A stream with no output yet is swapped for one matching the new set;
+ * otherwise the client keeps (a private copy of) its stream.
+ */
+void compress_rekey(ServerState& state, tcp_client_t* client);
+
+/**
+ * @brief Append a frame to a client's stream
+ *
+ * The members of a shared stream all get the same messages, so a message
+ * is appended once, for the first of them. Streams are flushed early when
+ * the pending frames would exceed LZ_BLOCK_MAX.
+ *
+ * @param client Recipient (client->stream set)
+ * @param message Message the frame carries
+ * @param parts Frame, header included
+ * @param count Number of parts
+ */
+void compress_append(tcp_client_t* client, const stored_message_t* message, const struct iovec* parts,
+                     int count);
+
+/**
+ * @brief Compress the pending frames of every stream and send them to the members
+ *
+ * Called once per loop turn, before the loop waits for events.
+ */
+void compress_flush(ServerState& state);
+
+/**
+ * @brief Free every stream (server exit)
+ */
+void compress_free(ServerState& state);
+
+#endif // COMPRESS_H
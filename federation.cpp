@@ -0,0 +1,206 @@
+#include "federation.h"
+
+bool peer_parse(const char *spec, sockaddr_in& addr) {
+    const char *colon = strrchr(spec, ':');
+    if (!colon || colon == spec)
+        return false;
+
+    char *end;
+    long port = strtol(colon + 1, &end, 10);
+    if (*end != '\0' || port < 1 || port > 65535)
+        return false;
+
+    std::string host(spec, colon - spec);
+    struct addrinfo hints = {}, *res = nullptr;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), nullptr, &hints, &res) != 0 || !res)
+        return false;
+
+    addr = *(sockaddr_in*)res->ai_addr;
+    addr.sin_port = htons(port);
+    freeaddrinfo(res);
+    return true;
+}
+
+void federation_init(ServerState& state) {
+    for (size_t i = 0; i < config.peers.size(); ++i) {
+        peer_link_t *link = new peer_link_t;
+        link->address = config.peers[i];
+        link->addr = config.peer_addrs[i];
+        link->fd = -1;
+        link->connecting = false;
+        link->retry_ns = 0;
+        state.peer_links.push_back(link);
+    }
+}
+
+// Forget a link's socket and schedule the next attempt
+static void link_down(peer_link_t *link, ServerState& state, std::vector<struct pollfd>& poll_fds,
+                      uint64_t index) {
+    if (!link->connecting)
+        std::cout << "Lost peer " << link->address << ".\n";
+
+    close(link->fd);
+    state.peer_fds.erase(link->fd);
+    poll_fds.erase(poll_fds.begin() + index);
+    link->fd = -1;
+    link->connecting = false;
+    link->retry_ns = monotonic_ns() + PEER_RETRY_MS * 1000000ull;
+}
+
+// Register on the peer and subscribe it to every locally used pattern
+static bool link_established(peer_link_t *link, ServerState& state) {
+    tcp_request_t request = {};
+    strncpy(request.id, config.node_id, sizeof(request.id) - 1);
+    request.type = MESSAGE;
+    request.connect.message = CONNECT;
+    request.connect.flags = CONNECT_PEER;
+    if (send_all(link->fd, &request, sizeof(request)) < 0)
+        return false;
+
+    for (const auto& [pattern, subscription] : state.subscriptions) {
+        if (subscription.local_subscribers == 0)
+            continue;
+
+        tcp_request_t sub = {};
+        strcpy(sub.id, request.id);
+        sub.type = SUBSCRIBE;
+        strcpy(sub.subscribe.topic, pattern.c_str());
+        if (send_all(link->fd, &sub, sizeof(sub)) < 0)
+            return false;
+    }
+
+    std::cout << "Linked to peer " << link->address << ".\n";
+    return true;
+}
+
+int federation_poll(ServerState& state, std::vector<struct pollfd>& poll_fds) {
+    uint64_t now = monotonic_ns();
+    int timeout_ms = -1;
+
+    for (auto *link : state.peer_links) {
+        if (link->fd >= 0)
+            continue;
+
+        if (link->retry_ns > now) {
+            int wait_ms = (link->retry_ns - now + 999999) / 1000000;
+            if (timeout_ms < 0 || wait_ms < timeout_ms)
+                timeout_ms = wait_ms;
+            continue;
+        }
+
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        DIE(fd < 0, "peer socket() failed");
+        int enable = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+        if (connect(fd, (sockaddr*)&link->addr, sizeof(link->addr)) < 0 && errno != EINPROGRESS) {
+            close(fd);
+            link->retry_ns = now + PEER_RETRY_MS * 1000000ull;
+            continue;
+        }
+
+        // Completion is reported as POLLOUT
+        link->fd = fd;
+        link->connecting = true;
+        state.peer_fds[fd] = link;
+        poll_fds.push_back({.fd = fd, .events = POLLOUT, .revents = 0});
+    }
+
+    return timeout_ms;
+}
+
+bool federation_handle(int fd, ServerState& state, std::vector<struct pollfd>& poll_fds, uint64_t index) {
+    peer_link_t *link = state.peer_fds[fd];
+
+    if (link->connecting) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            link_down(link, state, poll_fds, index);
+            return true;
+        }
+
+        link->connecting = false;
+        poll_fds[index].events = POLLIN;
+        if (!link_established(link, state)) {
+            link_down(link, state, poll_fds, index);
+            return true;
+        }
+        return false;
+    }
+
+    if (poll_fds[index].revents & (POLLERR | POLLHUP | POLLNVAL) &&
+        !(poll_fds[index].revents & POLLIN)) {
+        link_down(link, state, poll_fds, index);
+        return true;
+    }
+    if (!(poll_fds[index].revents & POLLIN))
+        return false;
+
+    int header = 0;
+    if (recv_all(fd, &header, sizeof(header)) <= 0) {
+        link_down(link, state, poll_fds, index);
+        return true;
+    }
+    int len = header & FRAME_LEN_MASK;
+
+    // The peer is shutting down: retry until it is back
+    if (header & FRAME_CONTROL) {
+        tcp_request_t notice;
+        if (len != sizeof(notice) || recv_all(fd, &notice, sizeof(notice)) <= 0 ||
+            notice.message == SHUTDOWN) {
+            link_down(link, state, poll_fds, index);
+            return true;
+        }
+        return false;
+    }
+
+    // Links never ask for traced frames; anything else is a protocol error
+    if ((header & ~FRAME_LEN_MASK) || len < SOURCE_HEADER_SIZE + UDP_RECORD_MIN ||
+        len > SOURCE_HEADER_SIZE + UDP_DATAGRAM_MAX) {
+        link_down(link, state, poll_fds, index);
+        return true;
+    }
+
+    if (!state.record_message) {
+        state.record_message = message_alloc(SOURCE_HEADER_SIZE + UDP_DATAGRAM_MAX);
+    }
+    stored_message_t *message = state.record_message;
+    if (recv_all(fd, message->buff, len) <= 0) {
+        link_down(link, state, poll_fds, index);
+        return true;
+    }
+    message->len = len;
+    message->c = 0;
+
+    // The frame still carries the original UDP source; deliver it locally only
+    metrics_t& metrics = local_metrics();
+    metrics.peer_received.add(1);
+    route_message(message, state, metrics, nullptr, true);
+    return false;
+}
+
+void federation_export(ServerState& state, const std::string& pattern, bool subscribe) {
+    // Without peers there is no node ID either
+    if (state.peer_links.empty())
+        return;
+
+    tcp_request_t request = {};
+    strncpy(request.id, config.node_id, sizeof(request.id) - 1);
+    if (subscribe) {
+        request.type = SUBSCRIBE;
+        strcpy(request.subscribe.topic, pattern.c_str());
+    } else {
+        request.type = UNSUBSCRIBE;
+        strcpy(request.unsubscribe.topic, pattern.c_str());
+    }
+
+    // Links still connecting get the full list once they are established
+    for (auto *link : state.peer_links) {
+        if (link->fd >= 0 && !link->connecting)
+            send_all(link->fd, &request, sizeof(request));
+    }
+}
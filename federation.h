@@ -0,0 +1,74 @@
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+#include "server.h"
+
+#include <netdb.h>
+
+/**
+ * @brief Delay between attempts to (re)connect a peer link
+ */
+#define PEER_RETRY_MS 1000
+
+/**
+ * @brief Outgoing link to another broker of the federation
+ *
+ * The local node registers on the peer as a client with CONNECT_PEER and
+ * subscribes to every pattern that has local subscribers. The peer then
+ * forwards matching UDP-originated messages over the link; those are
+ * delivered to local clients only, so a message crosses at most one link.
+ */
+struct peer_link_t {
+    std::string address;        ///< HOST:PORT as given on the command line
+    sockaddr_in addr;           ///< Resolved address of the peer
+    int fd;                     ///< Link socket, -1 while the link is down
+    bool connecting;            ///< Non-blocking connect still in progress
+    uint64_t retry_ns;          ///< Earliest time of the next connection attempt
+};
+
+/**
+ * @brief Resolve a HOST:PORT peer specification
+ *
+ * @param spec Peer given on the command line
+ * @param addr Resolved IPv4 address
+ * @return true if the specification is valid
+ */
+bool peer_parse(const char *spec, sockaddr_in& addr);
+
+/**
+ * @brief Create a link for every configured peer
+ *
+ * @param state Server state
+ */
+void federation_init(ServerState& state);
+
+/**
+ * @brief Start the connection attempts that are due
+ *
+ * @param state Server state
+ * @param poll_fds List of poll file descriptors
+ * @return int Milliseconds until the next attempt is due (-1 if none)
+ */
+int federation_poll(ServerState& state, std::vector<struct pollfd>& poll_fds);
+
+/**
+ * @brief Serve a link whose connect completed, that sent a frame or failed
+ *
+ * @param fd Link socket
+ * @param state Server state
+ * @param poll_fds List of poll file descriptors
+ * @param index Index of the link in the poll_fds array
+ * @return true if the link was closed and removed from poll_fds
+ */
+bool federation_handle(int fd, ServerState& state, std::vector<struct pollfd>& poll_fds, uint64_t index);
+
+/**
+ * @brief Announce a pattern gaining its first or losing its last local subscriber
+ *
+ * @param state Server state
+ * @param pattern Subscription pattern
+ * @param subscribe true to subscribe the peers to it, false to unsubscribe them
+ */
+void federation_export(ServerState& state, const std::string& pattern, bool subscribe);
+
+#endif // FEDERATION_H
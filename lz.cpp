@@ -0,0 +1,178 @@
+#include "lz.h"
+
+#include <string.h>
+
+static inline uint32_t read32(const char *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint64_t read64(const char *p) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// Length of the common prefix of a and b, at most limit bytes; eight at a time
+static inline uint32_t common_length(const char *a, const char *b, uint32_t limit) {
+    uint32_t len = 0;
+    while (len + 8 <= limit) {
+        uint64_t diff = read64(a + len) ^ read64(b + len);
+        if (diff)
+            return len + (__builtin_ctzll(diff) >> 3);
+        len += 8;
+    }
+    while (len < limit && a[len] == b[len])
+        len++;
+    return len;
+}
+
+static inline uint32_t lz_hash(uint32_t value) {
+    return (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Keep the last window of history at the front, so the next block fits after it
+static uint32_t slide(char *history, uint32_t pos) {
+    uint32_t keep = pos < LZ_WINDOW ? pos : LZ_WINDOW;
+    memmove(history, history + pos - keep, keep);
+    return keep;
+}
+
+// A length that did not fit its 4-bit field: the rest in bytes of 255
+static char *put_length(char *out, size_t len) {
+    for (len -= 15; len >= 255; len -= 255)
+        *out++ = (char)255;
+    *out++ = (char)len;
+    return out;
+}
+
+// One sequence: literals, then a match unless match_len is 0 (last sequence)
+static char *put_sequence(char *out, const char *literals, size_t literal_len, uint32_t offset,
+                          size_t match_len) {
+    size_t extra = match_len ? match_len - LZ_MIN_MATCH : 0;
+    *out++ = (char)((literal_len < 15 ? literal_len : 15) << 4 | (extra < 15 ? extra : 15));
+    if (literal_len >= 15)
+        out = put_length(out, literal_len);
+    memcpy(out, literals, literal_len);
+    out += literal_len;
+
+    if (match_len) {
+        *out++ = (char)(offset & 0xff);
+        *out++ = (char)(offset >> 8);
+        if (extra >= 15)
+            out = put_length(out, extra);
+    }
+    return out;
+}
+
+size_t lz_compress(lz_encoder_t& encoder, const char *src, size_t len, char *dst) {
+    if (encoder.pos + len > LZ_HISTORY) {
+        uint32_t delta = encoder.pos;
+        encoder.pos = slide(encoder.history, encoder.pos);
+        delta -= encoder.pos;
+        for (auto& entry : encoder.table)
+            entry = entry > delta ? entry - delta : 0;
+    }
+
+    // The block joins the history, so matches are found within it too
+    char *history = encoder.history;
+    uint32_t ip = encoder.pos, anchor = ip, end = encoder.pos + len;
+    memcpy(history + ip, src, len);
+    encoder.pos = end;
+
+    // Stretches without matches (already compressed data) are skipped faster and faster
+    char *out = dst;
+    uint32_t misses = 0;
+    while (ip + LZ_MIN_MATCH <= end) {
+        uint32_t bytes = read32(history + ip);
+        uint32_t& slot = encoder.table[lz_hash(bytes)];
+        uint32_t candidate = slot;
+        slot = ip + 1;
+
+        if (!candidate || ip + 1 - candidate > LZ_WINDOW || read32(history + candidate - 1) != bytes) {
+            ip += 1 + (misses++ >> 5);
+            continue;
+        }
+        misses = 0;
+
+        uint32_t ref = candidate - 1;
+        uint32_t match = LZ_MIN_MATCH +
+                         common_length(history + ref + LZ_MIN_MATCH, history + ip + LZ_MIN_MATCH,
+                                       end - ip - LZ_MIN_MATCH);
+
+        out = put_sequence(out, history + anchor, ip - anchor, ip - ref, match);
+        ip += match;
+        anchor = ip;
+    }
+    out = put_sequence(out, history + anchor, end - anchor, 0, 0);
+    return out - dst;
+}
+
+// Read the extension bytes of a length; false if the input ends first
+static bool get_length(const char *&in, const char *in_end, size_t& len) {
+    uint8_t byte;
+    do {
+        if (in >= in_end)
+            return false;
+        byte = *in++;
+        len += byte;
+    } while (byte == 255);
+    return true;
+}
+
+const char *lz_decompress(lz_decoder_t& decoder, const char *src, size_t len, size_t raw_len) {
+    if (raw_len > LZ_BLOCK_MAX)
+        return nullptr;
+    if (decoder.pos + raw_len > LZ_HISTORY)
+        decoder.pos = slide(decoder.history, decoder.pos);
+
+    char *history = decoder.history;
+    size_t start = decoder.pos, op = start, end = start + raw_len;
+    const char *in = src, *in_end = src + len;
+
+    while (true) {
+        if (in >= in_end)
+            return nullptr;
+        uint8_t token = *in++;
+
+        size_t literal_len = token >> 4;
+        if (literal_len == 15 && !get_length(in, in_end, literal_len))
+            return nullptr;
+        if (literal_len > (size_t)(in_end - in) || literal_len > end - op)
+            return nullptr;
+        memcpy(history + op, in, literal_len);
+        op += literal_len;
+        in += literal_len;
+
+        // Only the last sequence ends right after its literals
+        if (in == in_end)
+            break;
+
+        if (in_end - in < 2)
+            return nullptr;
+        size_t offset = (uint8_t)in[0] | (uint8_t)in[1] << 8;
+        in += 2;
+        size_t match_len = token & 15;
+        if (match_len == 15 && !get_length(in, in_end, match_len))
+            return nullptr;
+        match_len += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || match_len > end - op)
+            return nullptr;
+
+        // An overlapping match repeats bytes it produces itself, so it is copied byte by byte
+        const char *from = history + op - offset;
+        if (offset >= match_len) {
+            memcpy(history + op, from, match_len);
+        } else {
+            for (size_t i = 0; i < match_len; ++i)
+                history[op + i] = from[i];
+        }
+        op += match_len;
+    }
+
+    if (op != end)
+        return nullptr;
+    decoder.pos = end;
+    return history + start;
+}
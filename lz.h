@@ -0,0 +1,84 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief How far back a match may reach: offsets are 16 bits
+ */
+#define LZ_WINDOW 65535
+
+/**
+ * @brief Largest block compressed at once (bytes before compression)
+ */
+#define LZ_BLOCK_MAX (32 << 10)
+
+/**
+ * @brief History kept by both ends: the window, and room for the block being coded
+ */
+#define LZ_HISTORY (LZ_WINDOW + LZ_BLOCK_MAX)
+
+/**
+ * @brief Size of the match finder's hash table (log2 of the entries)
+ */
+#define LZ_HASH_BITS 12
+
+/**
+ * @brief Shortest match worth a sequence
+ */
+#define LZ_MIN_MATCH 4
+
+/**
+ * @brief Largest compressed size of a block of len bytes
+ */
+#define LZ_BOUND(len) ((len) + (len) / 255 + 16)
+
+/**
+ * @brief Compressing end of a stream
+ *
+ * Blocks are LZ77 sequences in the LZ4 block layout: a token with the
+ * literal and match lengths (4 bits each, extended by bytes of 255), the
+ * literals, and a 16-bit little-endian offset. The last sequence of a block
+ * has literals only. Matches may reach into earlier blocks of the same
+ * stream, which is what makes small, repetitive frames compress.
+ */
+struct lz_encoder_t {
+    char history[LZ_HISTORY];               ///< Last blocks, the current one at the end
+    uint32_t pos = 0;                       ///< Bytes of history in use
+    uint32_t table[1 << LZ_HASH_BITS] = {}; ///< Last position + 1 of each 4-byte hash (0 = none)
+};
+
+/**
+ * @brief Decompressing end of a stream
+ */
+struct lz_decoder_t {
+    char history[LZ_HISTORY];   ///< Last blocks, the current one at the end
+    uint32_t pos = 0;           ///< Bytes of history in use
+};
+
+/**
+ * @brief Compress the next block of a stream
+ *
+ * @param encoder Stream state
+ * @param src Block
+ * @param len Block length, at most LZ_BLOCK_MAX
+ * @param dst Room for LZ_BOUND(len) bytes
+ * @return size_t Compressed length
+ */
+size_t lz_compress(lz_encoder_t& encoder, const char *src, size_t len, char *dst);
+
+/**
+ * @brief Decompress the next block of a stream
+ *
+ * A block that fails to decode leaves the stream unusable.
+ *
+ * @param decoder Stream state
+ * @param src Compressed block
+ * @param len Compressed length
+ * @param raw_len Length of the block before compression
+ * @return const char* The block, valid until the next call; nullptr if it is corrupt
+ */
+const char *lz_decompress(lz_decoder_t& decoder, const char *src, size_t len, size_t raw_len);
+
+#endif // LZ_H
@@ -0,0 +1,208 @@
+#include "metrics.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <iomanip>
+#include <mutex>
+
+thread_local metrics_t *metrics_tls = nullptr;
+
+// Every block ever registered; blocks are never freed so a snapshot can
+// still read the counters of threads that already exited
+static std::mutex registry_lock;
+static std::vector<metrics_t *> registry;
+
+static unsigned bucket_index(uint64_t v) {
+    if (v < 16)
+        return v;
+
+    unsigned exp = 63 - __builtin_clzll(v);
+    unsigned sub = (v >> (exp - 4)) & 15;
+    return 16 + (exp - 4) * 16 + sub;
+}
+
+// Middle of the value range covered by a bucket
+static uint64_t bucket_value(unsigned idx) {
+    if (idx < 16)
+        return idx;
+
+    unsigned exp = (idx - 16) / 16 + 4;
+    uint64_t sub = (idx - 16) % 16;
+    uint64_t low = (16 + sub) << (exp - 4);
+    return low + ((1ull << (exp - 4)) >> 1);
+}
+
+void histogram_t::record(uint64_t v) {
+    std::atomic<uint64_t>& bucket = buckets[bucket_index(v)];
+    bucket.store(bucket.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    count.add(1);
+    sum.add(v);
+    if (v > max.load(std::memory_order_relaxed))
+        max.store(v, std::memory_order_relaxed);
+}
+
+metrics_t *metrics_register() {
+    metrics_t *m = new metrics_t;
+    std::lock_guard<std::mutex> guard(registry_lock);
+    registry.push_back(m);
+    return m;
+}
+
+histogram_summary_t histogram_summarize(const std::vector<uint64_t>& buckets, uint64_t sum, uint64_t max) {
+    histogram_summary_t s = {};
+    for (uint64_t b : buckets)
+        s.count += b;
+    if (s.count == 0)
+        return s;
+
+    s.mean = sum / s.count;
+    s.max = max;
+
+    // Walk the buckets once, filling the percentiles in increasing order
+    const double targets[] = {0.50, 0.90, 0.99};
+    uint64_t *outs[] = {&s.p50, &s.p90, &s.p99};
+    size_t next = 0;
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < buckets.size() && next < 3; ++i) {
+        seen += buckets[i];
+        while (next < 3 && seen >= targets[next] * s.count) {
+            *outs[next] = std::min(bucket_value(i), max);
+            next++;
+        }
+    }
+    return s;
+}
+
+static void merge(const histogram_t& h, std::vector<uint64_t>& buckets, uint64_t& sum, uint64_t& max) {
+    for (unsigned i = 0; i < HISTOGRAM_BUCKETS; ++i)
+        buckets[i] += h.buckets[i].load(std::memory_order_relaxed);
+    sum += h.sum.value.load(std::memory_order_relaxed);
+    max = std::max(max, h.max.load(std::memory_order_relaxed));
+}
+
+histogram_summary_t histogram_summary(const histogram_t& h) {
+    std::vector<uint64_t> buckets(HISTOGRAM_BUCKETS, 0);
+    uint64_t sum = 0, max = 0;
+    merge(h, buckets, sum, max);
+    return histogram_summarize(buckets, sum, max);
+}
+
+void metrics_collect(metrics_snapshot_t& snap) {
+    snap = {};
+
+    // Histograms of all threads are merged bucket by bucket before summarizing
+    histogram_t metrics_t::*hists[] = {&metrics_t::matches_per_msg, &metrics_t::fanout,
+                                       &metrics_t::sf_depth, &metrics_t::udp_ns,
+                                       &metrics_t::request_ns};
+    histogram_summary_t *summaries[] = {&snap.matches_per_msg, &snap.fanout, &snap.sf_depth,
+                                        &snap.udp_ns, &snap.request_ns};
+    std::vector<uint64_t> buckets[5];
+    uint64_t sums[5] = {}, maxes[5] = {};
+    for (auto& b : buckets)
+        b.assign(HISTOGRAM_BUCKETS, 0);
+
+    uint64_t stored = 0, released = 0;
+    {
+        std::lock_guard<std::mutex> guard(registry_lock);
+        for (metrics_t *m : registry) {
+            snap.udp_received += m->udp_received.value.load(std::memory_order_relaxed);
+            snap.udp_dropped += m->udp_dropped.value.load(std::memory_order_relaxed);
+            snap.udp_kernel_drops += m->udp_kernel_drops.value.load(std::memory_order_relaxed);
+            snap.udp_shed += m->udp_shed.value.load(std::memory_order_relaxed);
+            snap.udp_records += m->udp_records.value.load(std::memory_order_relaxed);
+            snap.peer_received += m->peer_received.value.load(std::memory_order_relaxed);
+            snap.matches += m->matches.value.load(std::memory_order_relaxed);
+            snap.sends += m->sends.value.load(std::memory_order_relaxed);
+            snap.bytes_sent += m->bytes_sent.value.load(std::memory_order_relaxed);
+            stored += m->sf_stored.value.load(std::memory_order_relaxed);
+            released += m->sf_released.value.load(std::memory_order_relaxed);
+            snap.compress_in += m->compress_in.value.load(std::memory_order_relaxed);
+            snap.compress_out += m->compress_out.value.load(std::memory_order_relaxed);
+            snap.compress_sent += m->compress_sent.value.load(std::memory_order_relaxed);
+            snap.multicast_sent += m->multicast_sent.value.load(std::memory_order_relaxed);
+            snap.multicast_saved += m->multicast_saved.value.load(std::memory_order_relaxed);
+            snap.multicast_repaired += m->multicast_repaired.value.load(std::memory_order_relaxed);
+
+            for (int i = 0; i < 5; ++i)
+                merge(m->*hists[i], buckets[i], sums[i], maxes[i]);
+        }
+    }
+
+    snap.sf_queued = stored - released;
+
+    // Resident set now and at its peak, as the kernel accounts them
+    snap.rss_kb = snap.rss_hwm_kb = 0;
+    if (FILE *status = fopen("/proc/self/status", "r")) {
+        char line[128];
+        while (fgets(line, sizeof(line), status)) {
+            sscanf(line, "VmRSS: %lu", &snap.rss_kb);
+            sscanf(line, "VmHWM: %lu", &snap.rss_hwm_kb);
+        }
+        fclose(status);
+    }
+    for (int i = 0; i < 5; ++i)
+        *summaries[i] = histogram_summarize(buckets[i], sums[i], maxes[i]);
+}
+
+void histogram_print(std::ostream& out, const char *name, const histogram_summary_t& h) {
+    out << "  " << std::left << std::setw(16) << name << std::right
+        << " n=" << h.count << " mean=" << h.mean << " p50=" << h.p50
+        << " p90=" << h.p90 << " p99=" << h.p99 << " max=" << h.max << "\n";
+}
+
+void metrics_print(const metrics_snapshot_t& snap, std::ostream& out) {
+    out << "UDP received: " << snap.udp_received << ", dropped: " << snap.udp_dropped
+        << ", records: " << snap.udp_records << "\n";
+    out << "UDP kernel drops: " << snap.udp_kernel_drops << ", shed: " << snap.udp_shed << "\n";
+    out << "Peer messages received: " << snap.peer_received << "\n";
+    out << "Pattern matches: " << snap.matches << "\n";
+    out << "Sends: " << snap.sends << " (" << snap.bytes_sent << " bytes)\n";
+    out << "SF queued: " << snap.sf_queued << "\n";
+    out << "Compression: " << snap.compress_in << " bytes in, " << snap.compress_out << " out, "
+        << snap.compress_sent << " sent\n";
+    out << "Multicast: " << snap.multicast_sent << " datagrams, " << snap.multicast_saved << " sends saved, "
+        << snap.multicast_repaired << " repaired\n";
+    out << "Memory: " << snap.rss_kb << " KB resident, " << snap.rss_hwm_kb << " KB peak\n";
+    histogram_print(out, "matches/msg", snap.matches_per_msg);
+    histogram_print(out, "fanout", snap.fanout);
+    histogram_print(out, "sf_depth", snap.sf_depth);
+    histogram_print(out, "udp_ns", snap.udp_ns);
+    histogram_print(out, "request_ns", snap.request_ns);
+}
+
+static void print_summary_json(std::ostream& out, const char *name, const histogram_summary_t& h) {
+    out << ",\"" << name << "\":{\"n\":" << h.count << ",\"mean\":" << h.mean
+        << ",\"p50\":" << h.p50 << ",\"p90\":" << h.p90 << ",\"p99\":" << h.p99
+        << ",\"max\":" << h.max << "}";
+}
+
+void metrics_print_line(const metrics_snapshot_t& snap, std::ostream& out) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    out << "{\"ts\":" << now.tv_sec
+        << ",\"udp_received\":" << snap.udp_received
+        << ",\"udp_dropped\":" << snap.udp_dropped
+        << ",\"udp_kernel_drops\":" << snap.udp_kernel_drops
+        << ",\"udp_shed\":" << snap.udp_shed
+        << ",\"udp_records\":" << snap.udp_records
+        << ",\"peer_received\":" << snap.peer_received
+        << ",\"matches\":" << snap.matches
+        << ",\"sends\":" << snap.sends
+        << ",\"bytes_sent\":" << snap.bytes_sent
+        << ",\"sf_queued\":" << snap.sf_queued
+        << ",\"compress_in\":" << snap.compress_in
+        << ",\"compress_out\":" << snap.compress_out
+        << ",\"compress_sent\":" << snap.compress_sent
+        << ",\"multicast_sent\":" << snap.multicast_sent
+        << ",\"multicast_saved\":" << snap.multicast_saved
+        << ",\"multicast_repaired\":" << snap.multicast_repaired
+        << ",\"rss_kb\":" << snap.rss_kb
+        << ",\"rss_hwm_kb\":" << snap.rss_hwm_kb;
+    print_summary_json(out, "matches_per_msg", snap.matches_per_msg);
+    print_summary_json(out, "fanout", snap.fanout);
+    print_summary_json(out, "sf_depth", snap.sf_depth);
+    print_summary_json(out, "udp_ns", snap.udp_ns);
+    print_summary_json(out, "request_ns", snap.request_ns);
+    out << "}\n";
+}
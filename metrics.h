@@ -0,0 +1,179 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <ostream>
+#include <vector>
+
+/**
+ * @brief Number of buckets in a latency/size histogram
+ *
+ * Values below 16 get an exact bucket, larger values are grouped into
+ * 16 linear sub-buckets per power of two (HDR-style, ~6% relative error).
+ */
+#define HISTOGRAM_BUCKETS 976
+
+/**
+ * @brief Monotonically increasing counter owned by a single thread
+ *
+ * Only the owning thread writes it, so an add is a plain load + store
+ * (no locked instruction); readers on other threads see a relaxed value.
+ */
+struct counter_t {
+    std::atomic<uint64_t> value{0};
+
+    void add(uint64_t n) {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+};
+
+/**
+ * @brief Log-linear histogram owned by a single thread
+ */
+struct histogram_t {
+    std::atomic<uint64_t> buckets[HISTOGRAM_BUCKETS] = {};
+    counter_t count;
+    counter_t sum;
+    std::atomic<uint64_t> max{0};
+
+    void record(uint64_t v);
+};
+
+/**
+ * @brief Per-thread hot-path metrics of the server
+ */
+struct metrics_t {
+    counter_t udp_received;     ///< UDP datagrams read from the socket
+    counter_t udp_dropped;      ///< UDP datagrams discarded as malformed
+    counter_t udp_kernel_drops; ///< UDP datagrams the kernel dropped on a full receive queue
+    counter_t udp_shed;         ///< Records shed by priority while overloaded
+    counter_t udp_records;      ///< Records routed (one per plain datagram, several per batch)
+    counter_t peer_received;    ///< Messages received from peer brokers
+    counter_t matches;          ///< Pattern evaluations against incoming topics
+    counter_t sends;            ///< send calls issued towards subscribers
+    counter_t bytes_sent;       ///< Bytes handed to send calls
+    counter_t sf_stored;        ///< Messages queued for offline clients
+    counter_t sf_released;      ///< Queued messages replayed or freed
+    counter_t compress_in;      ///< Frame bytes compressed for CONNECT_COMPRESS clients
+    counter_t compress_out;     ///< Compressed bytes produced (once per stream)
+    counter_t compress_sent;    ///< Compressed bytes sent (once per member of a stream)
+    counter_t multicast_sent;   ///< Datagrams sent to the multicast group
+    counter_t multicast_saved;  ///< TCP sends replaced by those datagrams
+    counter_t multicast_repaired;  ///< Datagrams resent over TCP after a NACK
+
+    histogram_t matches_per_msg; ///< Pattern evaluations per routed record
+    histogram_t fanout;          ///< Recipients (live + stored) per routed record
+    histogram_t sf_depth;        ///< Queue length of a client after a store
+    histogram_t udp_ns;          ///< Time spent in process_udp_message
+    histogram_t request_ns;      ///< Time spent in handle_client_request
+};
+
+/**
+ * @brief Percentile summary of a merged histogram
+ */
+struct histogram_summary_t {
+    uint64_t count;
+    uint64_t mean;
+    uint64_t p50;
+    uint64_t p90;
+    uint64_t p99;
+    uint64_t max;
+};
+
+/**
+ * @brief Metrics of all threads added together
+ */
+struct metrics_snapshot_t {
+    uint64_t udp_received;
+    uint64_t udp_dropped;
+    uint64_t udp_kernel_drops;
+    uint64_t udp_shed;
+    uint64_t udp_records;
+    uint64_t peer_received;
+    uint64_t matches;
+    uint64_t sends;
+    uint64_t bytes_sent;
+    uint64_t sf_queued;         ///< Messages currently waiting in SF queues
+    uint64_t compress_in;
+    uint64_t compress_out;
+    uint64_t compress_sent;
+    uint64_t multicast_sent;
+    uint64_t multicast_saved;
+    uint64_t multicast_repaired;
+    uint64_t rss_kb;            ///< Resident memory of the process
+    uint64_t rss_hwm_kb;        ///< Peak resident memory of the process
+
+    histogram_summary_t matches_per_msg;
+    histogram_summary_t fanout;
+    histogram_summary_t sf_depth;
+    histogram_summary_t udp_ns;
+    histogram_summary_t request_ns;
+};
+
+/**
+ * @brief Register a metrics block for the calling thread
+ *
+ * @return metrics_t* Block that lives until the process exits
+ */
+metrics_t *metrics_register();
+
+extern thread_local metrics_t *metrics_tls;
+
+/**
+ * @brief Metrics block of the calling thread (registered on first use)
+ */
+inline metrics_t& local_metrics() {
+    if (!metrics_tls)
+        metrics_tls = metrics_register();
+    return *metrics_tls;
+}
+
+/**
+ * @brief Current CLOCK_MONOTONIC time in nanoseconds
+ */
+inline uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * @brief Summarize the buckets of a histogram
+ *
+ * @param buckets Bucket counters (HISTOGRAM_BUCKETS entries)
+ * @param sum Sum of all recorded values
+ * @param max Largest recorded value
+ * @return histogram_summary_t Count, mean and percentiles
+ */
+histogram_summary_t histogram_summarize(const std::vector<uint64_t>& buckets, uint64_t sum, uint64_t max);
+
+/**
+ * @brief Summarize a single histogram
+ */
+histogram_summary_t histogram_summary(const histogram_t& h);
+
+/**
+ * @brief Print one summary as an indented "name n= mean= p50= ..." line
+ */
+void histogram_print(std::ostream& out, const char *name, const histogram_summary_t& h);
+
+/**
+ * @brief Add up the metrics of every registered thread
+ *
+ * @param snap Snapshot to fill
+ */
+void metrics_collect(metrics_snapshot_t& snap);
+
+/**
+ * @brief Print a snapshot in human readable form (console `stats`)
+ */
+void metrics_print(const metrics_snapshot_t& snap, std::ostream& out);
+
+/**
+ * @brief Print a snapshot as a single JSON line
+ */
+void metrics_print_line(const metrics_snapshot_t& snap, std::ostream& out);
+
+#endif // METRICS_H
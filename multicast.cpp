@@ -0,0 +1,150 @@
+#include "multicast.h"
+#include "topic_set.h"
+
+static bool eligible(const tcp_client_t* client) {
+    return client->flags == CONNECT_MULTICAST && same_host(client->fd);
+}
+
+static void send_notice(tcp_client_t* client, system_message_t message, uint64_t mseq) {
+    struct {
+        int header;
+        tcp_request_t notice;
+    } frame = {};
+    frame.header = sizeof(tcp_request_t) | FRAME_CONTROL;
+    strcpy(frame.notice.id, "SERVER");
+    frame.notice.type = MESSAGE;
+    frame.notice.multicast.message = message;
+    frame.notice.multicast.group = config.multicast_group.sin_addr.s_addr;
+    frame.notice.multicast.port = config.multicast_group.sin_port;
+    frame.notice.multicast.mseq = mseq;
+    send_all(client->fd, &frame, sizeof(frame));
+}
+
+// The client filters the group by the patterns the server has for it, which
+// include those of its earlier connections: one SUBSCRIBE frame per pattern
+static void send_patterns(tcp_client_t* client) {
+    std::string frames;
+    for (size_t i = 0; i < topic_set_size(client->topics); ++i) {
+        struct {
+            int header;
+            tcp_request_t pattern;
+        } frame = {};
+        frame.header = sizeof(tcp_request_t) | FRAME_CONTROL;
+        strcpy(frame.pattern.id, "SERVER");
+        frame.pattern.type = SUBSCRIBE;
+        const std::string& pattern = client->topics->patterns[i]->pattern;
+        memcpy(frame.pattern.subscribe.topic, pattern.data(),
+               std::min(pattern.size(), sizeof(frame.pattern.subscribe.topic) - 1));
+        frame.pattern.subscribe.sf = topic_set_sf(client->topics, i);
+        frames.append((const char*)&frame, sizeof(frame));
+    }
+    send_all(client->fd, frames.data(), frames.size());
+}
+
+void multicast_init(ServerState& state) {
+    if (!config.multicast) {
+        return;
+    }
+
+    multicaster_t* multicast = new multicaster_t;
+    multicast->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    DIE(multicast->fd < 0, "multicast socket() failed");
+
+    // Out through loopback with a TTL of 0, and back to the members on this host
+    in_addr loopback = {htonl(INADDR_LOOPBACK)};
+    unsigned char ttl = 0, loop = 1;
+    DIE(setsockopt(multicast->fd, IPPROTO_IP, IP_MULTICAST_IF, &loopback, sizeof(loopback)) < 0 ||
+        setsockopt(multicast->fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0 ||
+        setsockopt(multicast->fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0,
+        "multicast setsockopt() failed");
+    DIE(connect(multicast->fd, (sockaddr*)&config.multicast_group, sizeof(config.multicast_group)) < 0,
+        "multicast connect() failed");
+
+    // Room for a burst; the rest is dropped and repaired
+    int sndbuf = 4 << 20;
+    setsockopt(multicast->fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+    multicast->history.resize(MULTICAST_HISTORY);
+    state.multicast = multicast;
+}
+
+void multicast_offer(ServerState& state, tcp_client_t* client) {
+    client->multicast = false;
+    if (state.multicast && eligible(client)) {
+        send_notice(client, MULTICAST_JOIN, 0);
+    }
+}
+
+void multicast_joined(ServerState& state, tcp_client_t* client) {
+    if (!state.multicast || client->multicast || !eligible(client)) {
+        return;
+    }
+    client->multicast = true;
+    send_patterns(client);
+    send_notice(client, MULTICAST_START, state.multicast->next_mseq);
+}
+
+void multicast_send(ServerState& state, const stored_message_t* message, metrics_t& metrics) {
+    multicaster_t& multicast = *state.multicast;
+    uint64_t mseq = multicast.next_mseq++;
+    uint64_t net_mseq = htobe64(mseq);
+
+    // The slot keeps its capacity, so the history stops allocating once warm
+    std::string& datagram = multicast.history[mseq % MULTICAST_HISTORY];
+    datagram.assign((const char*)&net_mseq, sizeof(net_mseq));
+    datagram.append(message->buff, message->len);
+
+    // A datagram the kernel refuses is lost like one dropped on the way: it is repaired
+    send(multicast.fd, datagram.data(), datagram.size(), 0);
+    metrics.multicast_sent.add(1);
+    multicast.heartbeat_ns = monotonic_ns() + MULTICAST_HEARTBEAT_MS * 1000000ull;
+}
+
+void multicast_repair(ServerState& state, tcp_client_t* client, const nack_t& nack, metrics_t& metrics) {
+    if (!state.multicast || !client->multicast) {
+        return;
+    }
+    multicaster_t& multicast = *state.multicast;
+
+    // Only what is still in the history, and was sent
+    uint64_t oldest = multicast.next_mseq > MULTICAST_HISTORY ? multicast.next_mseq - MULTICAST_HISTORY : 1;
+    uint64_t from = std::max(nack.from, oldest);
+    uint64_t to = std::min(nack.from + nack.count, multicast.next_mseq);
+    if (nack.from + nack.count < nack.from || from >= to) {
+        return;
+    }
+
+    multicast.repair.clear();
+    for (uint64_t mseq = from; mseq < to; ++mseq) {
+        const std::string& datagram = multicast.history[mseq % MULTICAST_HISTORY];
+        int header = FRAME_REPAIR | (int)datagram.size();
+        multicast.repair.append((const char*)&header, sizeof(header));
+        multicast.repair += datagram;
+    }
+    send_all(client->fd, multicast.repair.data(), multicast.repair.size());
+    metrics.multicast_repaired.add(to - from);
+}
+
+int multicast_poll(ServerState& state) {
+    if (!state.multicast || !state.multicast->heartbeat_ns) {
+        return -1;
+    }
+    multicaster_t& multicast = *state.multicast;
+
+    uint64_t now = monotonic_ns();
+    if (now < multicast.heartbeat_ns) {
+        return (multicast.heartbeat_ns - now + 999999) / 1000000;
+    }
+    uint64_t net_mseq = htobe64(multicast.next_mseq - 1);
+    send(multicast.fd, &net_mseq, sizeof(net_mseq), 0);
+    multicast.heartbeat_ns = 0;
+    return -1;
+}
+
+void multicast_free(ServerState& state) {
+    if (state.multicast) {
+        close(state.multicast->fd);
+        delete state.multicast;
+        state.multicast = nullptr;
+    }
+}
@@ -0,0 +1,98 @@
+#ifndef MULTICAST_H
+#define MULTICAST_H
+
+#include "server.h"
+
+/**
+ * @brief Joined recipients from which a message is multicast, unless --multicast-fanout says otherwise
+ */
+#define MULTICAST_FANOUT_DEFAULT 64
+
+/**
+ * @brief Quiet time after the last datagram before its sequence number is announced again
+ */
+#define MULTICAST_HEARTBEAT_MS 20
+
+/**
+ * @brief Size of the sequence number in front of every multicast datagram
+ */
+#define MULTICAST_HEADER_SIZE 8
+
+/**
+ * @brief Multicast delivery of messages with a wide fan-out
+ *
+ * A message that reaches at least config.multicast_fanout clients joined to
+ * the group is sent once, as a datagram to the group, instead of once per
+ * joined client over TCP. Every datagram is its multicast sequence number
+ * followed by the frame body the clients would have received; each client
+ * keeps the ones its own patterns match. A client that sees a gap in the
+ * numbers NACKs it over TCP and gets the datagrams back as FRAME_REPAIR
+ * frames, as long as they are still in the history. After a quiet period,
+ * a datagram holding only the last sequence number lets clients notice
+ * that the last datagrams of a burst were lost.
+ *
+ * The group is sent to through the loopback interface, so only clients on
+ * the same host are offered to join.
+ */
+struct multicaster_t {
+    int fd;                                 ///< Socket connected to the group
+    uint64_t next_mseq = 1;                 ///< Sequence number of the next datagram
+    std::vector<std::string> history;       ///< Last datagrams as sent, at mseq % MULTICAST_HISTORY
+    std::string repair;                     ///< FRAME_REPAIR frames being sent
+    uint64_t heartbeat_ns = 0;              ///< When the last number is announced (0 = already announced)
+};
+
+/**
+ * @brief Open the socket sending to the group of --multicast (nothing without it)
+ */
+void multicast_init(ServerState& state);
+
+/**
+ * @brief Tell a connecting client to join the group, if it asked and is eligible
+ *
+ * Eligible clients connect from the same host with CONNECT_MULTICAST and no
+ * other option: stamped, numbered, ring and compressed frames are the
+ * client's own. Until the client confirms with JOINED, it gets everything
+ * over TCP.
+ */
+void multicast_offer(ServerState& state, tcp_client_t* client);
+
+/**
+ * @brief Start multicasting to a client that joined the group
+ *
+ * The client's patterns go first, as SUBSCRIBE control frames, so that it
+ * filters the group by everything it is subscribed to, not only by what it
+ * subscribed to since it connected. The MULTICAST_START notice that ends
+ * them tells the client the first sequence number it gets from the group;
+ * every earlier message reached it over TCP.
+ */
+void multicast_joined(ServerState& state, tcp_client_t* client);
+
+/**
+ * @brief Send a message to the group and keep it for repair
+ *
+ * @param state Server state
+ * @param message Message, framed for plain TCP clients
+ * @param metrics Counters of the calling thread
+ */
+void multicast_send(ServerState& state, const stored_message_t* message, metrics_t& metrics);
+
+/**
+ * @brief Resend the datagrams of a NACK that are still in the history, over TCP
+ */
+void multicast_repair(ServerState& state, tcp_client_t* client, const nack_t& nack, metrics_t& metrics);
+
+/**
+ * @brief Announce the last sequence number once the group has been quiet long enough
+ *
+ * @param state Server state
+ * @return int Milliseconds until the announcement is due, -1 if none is
+ */
+int multicast_poll(ServerState& state);
+
+/**
+ * @brief Close the socket and drop the history (server exit)
+ */
+void multicast_free(ServerState& state);
+
+#endif // MULTICAST_H
@@ -0,0 +1,139 @@
+#include "overload.h"
+
+#include <linux/sock_diag.h>
+
+bool priority_parse(const char *spec, std::string& pattern, int& priority) {
+    const char *colon = strrchr(spec, ':');
+    if (!colon || colon == spec || colon - spec > TOPIC_MAX_LEN)
+        return false;
+
+    char *end;
+    long value = strtol(colon + 1, &end, 10);
+    if (*end != '\0' || end == colon + 1 || value < 0 || value > TOPIC_PRIORITY_MAX)
+        return false;
+
+    pattern.assign(spec, colon - spec);
+    priority = value;
+    return true;
+}
+
+void overload_init(ServerState& state, int udp_fd) {
+    state.overload = new overload_t;
+    overload_t& overload = *state.overload;
+
+    // SO_RCVBUFFORCE goes past net.core.rmem_max but needs CAP_NET_ADMIN
+    if (config.rcvbuf > 0) {
+        if (setsockopt(udp_fd, SOL_SOCKET, SO_RCVBUFFORCE, &config.rcvbuf, sizeof(config.rcvbuf)) < 0) {
+            DIE(setsockopt(udp_fd, SOL_SOCKET, SO_RCVBUF, &config.rcvbuf, sizeof(config.rcvbuf)) < 0,
+                "setsockopt(SO_RCVBUF) failed");
+        }
+
+        // The kernel doubles the value for its bookkeeping
+        int granted = 0;
+        socklen_t len = sizeof(granted);
+        getsockopt(udp_fd, SOL_SOCKET, SO_RCVBUF, &granted, &len);
+        if (granted / 2 < config.rcvbuf) {
+            std::cerr << "UDP receive buffer capped at " << granted / 2
+                      << " bytes (raise net.core.rmem_max)\n";
+        }
+    }
+
+    // Every datagram then carries the socket's running drop count
+    int enable = 1;
+    DIE(setsockopt(udp_fd, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable)) < 0,
+        "setsockopt(SO_RXQ_OVFL) failed");
+
+    overload.max_level = TOPIC_PRIORITY_DEFAULT;
+    for (const auto& [pattern, priority] : config.topic_priorities) {
+        overload.priorities.push_back({pattern, topic_compile(pattern), priority});
+        overload.max_level = std::max(overload.max_level, priority);
+    }
+}
+
+int topic_priority(const overload_t& overload, const topic_view_t& topic) {
+    for (const auto& rule : overload.priorities) {
+        if (topic_matches(rule.matcher, topic))
+            return rule.priority;
+    }
+    return TOPIC_PRIORITY_DEFAULT;
+}
+
+// Share of the receive buffer taken by queued datagrams, in percent
+static int queue_fill(int udp_fd) {
+    uint32_t meminfo[SK_MEMINFO_VARS] = {};
+    socklen_t len = sizeof(meminfo);
+    if (getsockopt(udp_fd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) < 0 || !meminfo[SK_MEMINFO_RCVBUF])
+        return 0;
+    return (uint64_t)meminfo[SK_MEMINFO_RMEM_ALLOC] * 100 / meminfo[SK_MEMINFO_RCVBUF];
+}
+
+static void set_level(overload_t& overload, int level, int fill, uint64_t now) {
+    if (overload.level == 0) {
+        overload.since_ns = now;
+        overload.window_drops = 0;
+    }
+    overload.window_drops += overload.kernel_drops - overload.checked_drops;
+    bool easing = level < overload.level;
+    overload.level = level;
+    overload.changed_ns = now;
+
+    if (level > 0 && easing) {
+        std::cout << "UDP load easing (queue " << fill << "% full): shedding topics of priority below "
+                  << level << ".\n";
+    } else if (level > 0) {
+        std::cout << "UDP overload (queue " << fill << "% full, " << overload.window_drops
+                  << " dropped by the kernel): shedding topics of priority below " << level << ".\n";
+    } else {
+        std::cout << "UDP load back to normal after " << (now - overload.since_ns) / 1000000
+                  << " ms (" << overload.window_drops << " dropped by the kernel).\n";
+    }
+}
+
+static void check(overload_t& overload, int udp_fd, uint64_t now) {
+    overload.next_check_ns = now + OVERLOAD_CHECK_MS * 1000000ull;
+
+    int fill = queue_fill(udp_fd);
+    bool dropping = overload.kernel_drops != overload.checked_drops;
+
+    if (dropping || fill >= OVERLOAD_HIGH_PCT) {
+        overload.calm_ns = 0;
+        if (overload.level < overload.max_level &&
+            (overload.level == 0 || now - overload.changed_ns >= OVERLOAD_STEP_MS * 1000000ull)) {
+            set_level(overload, overload.level + 1, fill, now);
+        } else if (overload.level > 0) {
+            overload.window_drops += overload.kernel_drops - overload.checked_drops;
+        }
+    } else if (overload.level > 0 && fill <= OVERLOAD_LOW_PCT) {
+        if (!overload.calm_ns) {
+            overload.calm_ns = now;
+        } else if (now - overload.calm_ns >= OVERLOAD_CALM_MS * 1000000ull) {
+            set_level(overload, overload.level - 1, fill, now);
+            overload.calm_ns = now;
+        }
+    } else {
+        overload.calm_ns = 0;
+    }
+    overload.checked_drops = overload.kernel_drops;
+}
+
+void overload_update(overload_t& overload, int udp_fd, uint32_t kernel_drops, uint64_t now,
+                     metrics_t& metrics) {
+    if (kernel_drops != overload.kernel_drops) {
+        metrics.udp_kernel_drops.add(kernel_drops - overload.kernel_drops);
+        overload.kernel_drops = kernel_drops;
+    }
+    if (now >= overload.next_check_ns)
+        check(overload, udp_fd, now);
+}
+
+int overload_poll(overload_t& overload, int udp_fd) {
+    if (overload.level == 0)
+        return -1;
+
+    uint64_t now = monotonic_ns();
+    if (now >= overload.next_check_ns)
+        check(overload, udp_fd, now);
+    if (overload.level == 0)
+        return -1;
+    return (overload.next_check_ns - now + 999999) / 1000000;
+}
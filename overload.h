@@ -0,0 +1,126 @@
+#ifndef OVERLOAD_H
+#define OVERLOAD_H
+
+#include "server.h"
+
+/**
+ * @brief Topic priority classes: 0 is shed first, the highest is never shed
+ */
+#define TOPIC_PRIORITY_MAX 3
+
+/**
+ * @brief Priority of topics that no --topic-priority rule matches
+ */
+#define TOPIC_PRIORITY_DEFAULT 1
+
+/**
+ * @brief Least time between two looks at the receive queue while datagrams flow
+ */
+#define OVERLOAD_CHECK_MS 10
+
+/**
+ * @brief Least time between two steps up of the shedding level
+ */
+#define OVERLOAD_STEP_MS 100
+
+/**
+ * @brief Time without drops, below the low watermark, before a step down
+ */
+#define OVERLOAD_CALM_MS 1000
+
+/**
+ * @brief Receive queue fill (percent of SO_RCVBUF) that counts as overload
+ */
+#define OVERLOAD_HIGH_PCT 75
+
+/**
+ * @brief Receive queue fill (percent of SO_RCVBUF) below which load is normal
+ */
+#define OVERLOAD_LOW_PCT 25
+
+/**
+ * @brief A --topic-priority rule, compiled
+ */
+struct topic_priority_t {
+    std::string pattern;        ///< Pattern as given on the command line
+    topic_matcher_t matcher;    ///< Compiled pattern
+    int priority;               ///< Class of the topics it matches
+};
+
+/**
+ * @brief Overload detector and shedding state of the UDP socket
+ *
+ * At shedding level L, records whose topic has a priority below L are
+ * dropped before matching. The level goes up one step while the kernel
+ * drops datagrams or the receive queue stays above the high watermark,
+ * and down one step after a calm period. It never reaches the highest
+ * priority in use, so those topics always go through.
+ */
+struct overload_t {
+    std::vector<topic_priority_t> priorities;   ///< Rules, first match wins
+    int level = 0;              ///< Current shedding level (0 = normal)
+    int max_level = 0;          ///< Highest priority in use
+    uint32_t kernel_drops = 0;  ///< Last SO_RXQ_OVFL count (wraps)
+    uint32_t checked_drops = 0; ///< Count at the previous check
+    uint64_t next_check_ns = 0; ///< Earliest time of the next check
+    uint64_t changed_ns = 0;    ///< Time of the last level change
+    uint64_t calm_ns = 0;       ///< Start of the current calm period (0 = not calm)
+    uint64_t since_ns = 0;      ///< Start of the current overload
+    uint64_t window_drops = 0;  ///< Kernel drops since the overload started
+};
+
+/**
+ * @brief Parse a PATTERN:CLASS priority rule
+ *
+ * @param spec Rule given on the command line
+ * @param pattern Topic pattern
+ * @param priority Class, 0 to TOPIC_PRIORITY_MAX
+ * @return true if the rule is valid
+ */
+bool priority_parse(const char *spec, std::string& pattern, int& priority);
+
+/**
+ * @brief Size the receive buffer, enable drop counting and compile the rules
+ *
+ * @param state Server state
+ * @param udp_fd UDP socket
+ */
+void overload_init(ServerState& state, int udp_fd);
+
+/**
+ * @brief Priority of a topic under the configured rules
+ */
+int topic_priority(const overload_t& overload, const topic_view_t& topic);
+
+/**
+ * @brief Check whether a record is shed at the current level
+ */
+inline bool overload_sheds(const overload_t& overload, const topic_view_t& topic) {
+    return overload.level > 0 && topic_priority(overload, topic) < overload.level;
+}
+
+/**
+ * @brief Account the drop count of a received datagram and check the load
+ *
+ * The receive queue is only looked at once per OVERLOAD_CHECK_MS; level
+ * changes are reported on the console.
+ *
+ * @param overload Overload state
+ * @param udp_fd UDP socket
+ * @param kernel_drops SO_RXQ_OVFL count that came with the datagram
+ * @param now Monotonic time
+ * @param metrics Metrics of the calling thread
+ */
+void overload_update(overload_t& overload, int udp_fd, uint32_t kernel_drops, uint64_t now,
+                     metrics_t& metrics);
+
+/**
+ * @brief Keep checking while shedding, even if no datagram arrives
+ *
+ * @param overload Overload state
+ * @param udp_fd UDP socket
+ * @return int Milliseconds until the next check is due (-1 if not shedding)
+ */
+int overload_poll(overload_t& overload, int udp_fd);
+
+#endif // OVERLOAD_H
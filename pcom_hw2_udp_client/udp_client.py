@@ -8,11 +8,17 @@ import time
 import json
 import os
 import argparse
+import struct
 from ipaddress import ip_address
 from utils.unpriv_port import unprivileged_port_type, get_unprivileged_port_meta
 import textwrap
 
 
+# Batched datagram: magic, record count, then (length, record) pairs in network byte order
+BATCH_MAGIC = b'\xff\x00B1'
+BATCH_SIZE_DEFAULT = 9000 - 20 - 8  # jumbo MTU minus IPv4 and UDP headers
+
+
 def setup_parser():
     def get_mode_help():
         return textwrap.dedent(
@@ -55,6 +61,10 @@ def setup_parser():
     load.add_argument('--count', type=int,
                       help='Number of packets to be send (only used for when mode is random, default: infinity)')
     load.add_argument('--delay', help='Wait time (in ms) between two messages (default: 0)', type=int, default=0)
+    load.add_argument('--batch', action='store_true',
+                      help='Pack several messages per datagram in the batched format (all_once and random modes)')
+    load.add_argument('--batch-size', type=int, default=BATCH_SIZE_DEFAULT, metavar='BYTES',
+                      help='Largest batched datagram (default: {}, a 9000 byte jumbo frame)'.format(BATCH_SIZE_DEFAULT))
 
     return parser
 
@@ -72,7 +82,40 @@ def send_message(sock, message, parsed_args):
     time.sleep(parsed_args.delay / 1000)
 
 
+class Batcher:
+    def __init__(self, sock, parsed_args):
+        self.sock = sock
+        self.parsed_args = parsed_args
+        self.records = []
+        self.size = len(BATCH_MAGIC) + 2
+
+    def add(self, message):
+        record = base64.standard_b64decode(message['payload_base64'])
+        if self.size + 2 + len(record) > self.parsed_args.batch_size or len(self.records) == 0xffff:
+            self.flush()
+        self.records.append(record)
+        self.size += 2 + len(record)
+
+    def flush(self):
+        if not self.records:
+            return
+        to_send = BATCH_MAGIC + struct.pack('!H', len(self.records))
+        to_send += b''.join(struct.pack('!H', len(r)) + r for r in self.records)
+        sent = self.sock.sendto(to_send, (str(self.parsed_args.server_ip), self.parsed_args.server_port))
+        print('Sent ({}/{} bytes) << batch of {} messages >>'.format(sent, len(to_send), len(self.records)))
+        self.records = []
+        self.size = len(BATCH_MAGIC) + 2
+        time.sleep(self.parsed_args.delay / 1000)
+
+
 def run_all_once(sock, parsed_args):
+    if parsed_args.batch:
+        batcher = Batcher(sock, parsed_args)
+        for message in parsed_args.input_file:
+            batcher.add(message)
+        batcher.flush()
+        return
+
     for message in parsed_args.input_file:
         send_message(sock, message, parsed_args)
 
@@ -101,10 +144,16 @@ def run_manual(sock, parsed_args):
 def run_random(sock, parsed_args):
     n = parsed_args.count
     count = 0
+    batcher = Batcher(sock, parsed_args) if parsed_args.batch else None
     while (n is None) or (count < n):
         message = random.choice(parsed_args.input_file)
-        send_message(sock, message, parsed_args)
+        if batcher:
+            batcher.add(message)
+        else:
+            send_message(sock, message, parsed_args)
         count += 1
+    if batcher:
+        batcher.flush()
 
 
 def main():
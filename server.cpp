@@ -1,187 +1,707 @@
 #include "server.h"
+#include "admin.h"
+#include "snapshot.h"
+#include "federation.h"
+#include "capture.h"
+#include "overload.h"
+#include "aggregate.h"
+#include "topic_set.h"
+#include "compress.h"
+#include "multicast.h"
 
 
-// Global variables for client and topic management
-std::unordered_map<std::string, tcp_client_t *> ids;           // Maps client IDs to client structures
-std::unordered_map<std::string, std::vector<tcp_client_t *>> topics;  // Maps topics to lists of subscribed clients
-std::unordered_map<int, std::pair<in_addr, uint16_t>> ips_ports;  // Maps socket file descriptors to client IP/port
+server_config_t config = {};
 
-void append_binary_data(std::string& str, const void* data, size_t len) {
-    const char* char_data = static_cast<const char*>(data);
-    str.append(char_data, len);
+void handle_new_connection(int listenfd, ServerState& state, std::vector<struct pollfd>& poll_fds) {
+    // Drain the whole accept queue in one wakeup; TCP_NODELAY is inherited
+    // from the listening socket, so accepted sockets need no further setup
+    while (true) {
+        struct sockaddr_in tcp_cli_addr;
+        socklen_t tcp_cli_len = sizeof(tcp_cli_addr);
+        int tcp_cli_fd = accept4(listenfd, (struct sockaddr*)&tcp_cli_addr, &tcp_cli_len,
+                                 SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (tcp_cli_fd < 0) {
+            if (errno == ECONNABORTED || errno == EINTR)
+                continue;
+            // Out of descriptors: leave the rest in the backlog for later
+            DIE(errno != EAGAIN && errno != EWOULDBLOCK && errno != EMFILE && errno != ENFILE,
+                "accept4() failed");
+            return;
+        }
+        
+        // Store client address info for future reference
+        state.client_addresses[tcp_cli_fd] = std::make_pair(tcp_cli_addr.sin_addr, tcp_cli_addr.sin_port);
+        
+        // Add new client socket to poll set
+        poll_fds.push_back({tcp_cli_fd, POLLIN, 0});
+    }
 }
 
-bool topic_matches_pattern(const std::string &topic, const std::string &pattern) {
-    // Split topic and pattern into parts separated by '/'
-    std::vector<std::string> topic_parts, pattern_parts;
-    std::string part;
-    
-    // Split topic by '/' delimiter
-    size_t start = 0, end;
-    while ((end = topic.find('/', start)) != std::string::npos) {
-        part = topic.substr(start, end - start);
-        topic_parts.push_back(part);
-        start = end + 1;
-    }
-    topic_parts.push_back(topic.substr(start));
-    
-    // Split pattern by '/' delimiter
-    start = 0;
-    while ((end = pattern.find('/', start)) != std::string::npos) {
-        part = pattern.substr(start, end - start);
-        pattern_parts.push_back(part);
-        start = end + 1;
-    }
-    pattern_parts.push_back(pattern.substr(start));
-
-    // Indices for traversing the parts
-    size_t t_idx = 0, p_idx = 0;
-    // Backtracking positions for '*' wildcard
-    size_t t_back = 0, p_back = 0;
-    bool backtrack = false;
-
-    while (t_idx < topic_parts.size()) {
-        if (p_idx < pattern_parts.size()) {
-            // Case 1: Exact match or '+' wildcard (matches exactly one level)
-            if (pattern_parts[p_idx] == "+" || pattern_parts[p_idx] == topic_parts[t_idx]) {
-                t_idx++;
-                p_idx++;
-                continue;
+stored_message_t* message_alloc(int len) {
+    stored_message_t* message = (stored_message_t*)malloc(sizeof(stored_message_t) + len);
+    DIE(message == nullptr, "malloc() failed");
+    message->c = 0;
+    message->len = len;
+    return message;
+}
+
+subscription_t* subscription_get(ServerState& state, const std::string& pattern) {
+    auto [it, inserted] = state.subscriptions.try_emplace(pattern);
+    subscription_t* subscription = &it->second;
+    if (inserted) {
+        subscription->pattern = pattern;
+        subscription->matcher = topic_compile(pattern);
+        if (topic_shape(subscription->matcher) == TOPIC_EXACT) {
+            state.exact_subscriptions.emplace(subscription->pattern, subscription);
+        } else {
+            state.wildcard_subscriptions.push_back(subscription);
+        }
+    }
+    return subscription;
+}
+
+// Send a frame gathered from several parts over TCP
+static void send_parts(int fd, struct iovec* parts, int count) {
+    struct msghdr msg = {};
+    msg.msg_iov = parts;
+    msg.msg_iovlen = count;
+
+    ssize_t rc = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (rc < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return;
+        rc = 0;
+    }
+
+    // Whatever the socket did not take goes out through the blocking path
+    for (int i = 0; i < count; ++i) {
+        size_t skip = std::min((size_t)rc, parts[i].iov_len);
+        rc -= skip;
+        if (skip < parts[i].iov_len &&
+            send_all(fd, (char*)parts[i].iov_base + skip, parts[i].iov_len - skip) < 0)
+            return;
+    }
+}
+
+// Wake the reader of a ring if it went idle
+static void shm_doorbell(tcp_client_t* client) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (client->ring->shared->idle.load(std::memory_order_relaxed) && client->ring->shared->idle.exchange(0)) {
+        int header = FRAME_DOORBELL;
+        send_all(client->fd, &header, sizeof(header));
+    }
+}
+
+// Whether the TCP connection of a client was closed by its end
+static bool client_gone(int fd) {
+    struct pollfd pfd = {fd, POLLRDHUP, 0};
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
+
+// Append a frame to a client's ring. A full ring stalls the sender, as a
+// full socket buffer would, until the reader catches up or goes away.
+static void shm_send(tcp_client_t* client, struct iovec* parts, int count) {
+    int rc;
+    for (int waited_us = 0; (rc = shm_ring_write(client->ring, parts, count)) == 0; waited_us += SHM_FULL_WAIT_US) {
+        if (waited_us % 10000 == 0) {
+            if (client_gone(client->fd)) return;
+            client->ring->shared->idle.store(1);
+            shm_doorbell(client);
+        }
+        usleep(SHM_FULL_WAIT_US);
+    }
+
+    if (rc < 0) {
+        std::cerr << "Client " << client->id << " corrupted its ring, falling back to TCP\n";
+        shm_writer_detach(client->ring);
+        client->ring = nullptr;
+        send_parts(client->fd, parts, count);
+        return;
+    }
+    shm_doorbell(client);
+}
+
+// Hand a message to a client: into its compressed stream or its ring if it
+// has one, otherwise over TCP. Sequenced clients get the number in front,
+// traced clients the stamps after it, the send time last. Returns the
+// frame size.
+size_t client_send(tcp_client_t* client, stored_message_t* message,
+                   const trace_stamps_t* trace, uint64_t matched_ns) {
+    bool traced = trace && (client->flags & CONNECT_TRACE);
+    bool sequenced = client->flags & CONNECT_SEQ;
+    if (!traced && !sequenced) {
+        if (client->stream) {
+            struct iovec frame = {&message->len, sizeof(int) + message->len};
+            compress_append(client, message, &frame, 1);
+        } else if (client->ring) {
+            struct iovec frame = {&message->len, sizeof(int) + message->len};
+            shm_send(client, &frame, 1);
+        } else {
+            send_all(client->fd, &message->len, sizeof(int) + message->len);
+        }
+        return sizeof(int) + message->len;
+    }
+
+    int header = 0;
+    uint64_t seq = htobe64(message->seq);
+    trace_stamps_t stamps;
+    struct iovec parts[4];
+    int count = 0;
+    size_t len = message->len;
+
+    parts[count++] = {&header, sizeof(header)};
+    if (sequenced) {
+        parts[count++] = {&seq, sizeof(seq)};
+        header |= FRAME_SEQ;
+        len += sizeof(seq);
+    }
+    if (traced) {
+        stamps = {htobe64(trace->kernel_rx_ns), htobe64(trace->read_ns), htobe64(matched_ns), 0};
+        parts[count++] = {&stamps, sizeof(stamps)};
+        header |= FRAME_TRACE;
+        len += sizeof(stamps);
+    }
+    parts[count++] = {message->buff, (size_t)message->len};
+    header |= (int)len;
+
+    if (traced) {
+        stamps.sent_ns = htobe64(realtime_ns());
+    }
+    if (client->stream) {
+        compress_append(client, message, parts, count);
+    } else if (client->ring) {
+        shm_send(client, parts, count);
+    } else {
+        send_parts(client->fd, parts, count);
+    }
+    return sizeof(header) + len;
+}
+
+// Drop the backlog entries up to a sequence number (oldest first)
+static void client_release(tcp_client_t* client, uint64_t seq, metrics_t& metrics) {
+    auto& backlog = client->lost_messages;
+    size_t done = 0;
+    while (done < backlog.size() && backlog[done]->seq <= seq) {
+        if (--backlog[done]->c == 0) {
+            free(backlog[done]);
+        }
+        done++;
+    }
+    backlog.erase(backlog.begin(), backlog.begin() + done);
+    metrics.sf_released.add(done);
+}
+
+bool same_host(int fd) {
+    sockaddr_in local, peer;
+    socklen_t len = sizeof(local);
+    if (getsockname(fd, (sockaddr*)&local, &len) < 0) {
+        return false;
+    }
+    len = sizeof(peer);
+    if (getpeername(fd, (sockaddr*)&peer, &len) < 0) {
+        return false;
+    }
+    return local.sin_addr.s_addr == peer.sin_addr.s_addr;
+}
+
+// Rings come as descriptors on a datagram socket of this host, each under a
+// random token that the CONNECT of its subscriber repeats. The server never
+// opens a ring by a name a client chose.
+static void ring_listen(ServerState& state) {
+    int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    DIE(fd < 0, "ring socket() failed");
+    sockaddr_un addr;
+    socklen_t len = shm_ring_address(addr, config.port);
+    if (bind(fd, (sockaddr*)&addr, len) < 0) {
+        std::cerr << "The ring socket of port " << config.port << " is taken, rings are disabled\n";
+        close(fd);
+        return;
+    }
+    state.ring_fd = fd;
+}
+
+// Take the offers waiting on the ring socket
+static void ring_receive(ServerState& state) {
+    while (state.ring_fd >= 0) {
+        uint8_t token[SHM_TOKEN_SIZE + 1];
+        struct iovec iov = {token, sizeof(token)};
+        union {
+            char buf[CMSG_SPACE(4 * sizeof(int))];
+            struct cmsghdr align;
+        } control;
+        struct msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        ssize_t len = recvmsg(state.ring_fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+        if (len < 0) {
+            return;
+        }
+
+        // Exactly one descriptor and a whole token; anything else is dropped
+        std::vector<int> fds;
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                fds.insert(fds.end(), (int*)CMSG_DATA(cmsg), (int*)CMSG_DATA(cmsg) + count);
             }
-            // Case 2: '*' wildcard (matches any number of levels)
-            if (pattern_parts[p_idx] == "*") {
-                // Save position for backtracking
-                t_back = t_idx;
-                p_back = p_idx;
-                p_idx++;
-                backtrack = true;
-                continue;
+        }
+        std::string key((const char*)token, SHM_TOKEN_SIZE);
+        if (fds.size() != 1 || len != (ssize_t)SHM_TOKEN_SIZE || (msg.msg_flags & MSG_CTRUNC) ||
+            state.ring_offers.count(key)) {
+            for (int fd : fds) {
+                close(fd);
             }
+            continue;
         }
-        
-        // Case 3: Backtrack for '*' when match fails
-        if (backtrack && p_back < pattern_parts.size()) {
-            t_back++;
-            t_idx = t_back;
-            p_idx = p_back + 1;
+
+        // Offers no CONNECT claimed in time make room when the table is full
+        uint64_t now = monotonic_ns();
+        if (state.ring_offers.size() >= SHM_OFFERS_MAX) {
+            for (auto it = state.ring_offers.begin(); it != state.ring_offers.end();) {
+                if (it->second.second < now) {
+                    close(it->second.first);
+                    it = state.ring_offers.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+        if (state.ring_offers.size() >= SHM_OFFERS_MAX) {
+            close(fds[0]);
             continue;
         }
+        state.ring_offers.emplace(key, std::make_pair(fds[0], now + SHM_OFFER_TTL_MS * 1000000ull));
+    }
+}
 
-        // No case matches, pattern doesn't match topic
-        return false;
+// Claim the ring offered under a token; -1 if there is none
+static int ring_take(ServerState& state, const uint8_t* token) {
+    // The offer was sent before the CONNECT, but may not have been read yet
+    ring_receive(state);
+    auto offer = state.ring_offers.find(std::string((const char*)token, SHM_TOKEN_SIZE));
+    if (offer == state.ring_offers.end()) {
+        return -1;
     }
+    int fd = offer->second.first;
+    state.ring_offers.erase(offer);
+    return fd;
+}
 
-    // Check if remaining pattern parts are only '*' wildcards
-    while (p_idx < pattern_parts.size() && pattern_parts[p_idx] == "*") {
-        p_idx++;
+// Apply the options of a CONNECT request to a (re)connecting client
+static void client_configure(ServerState& state, tcp_client_t* client, connect_t& connect) {
+    client->flags = connect.flags;
+
+    shm_writer_detach(client->ring);
+    client->ring = nullptr;
+    // Rings are offered on this host: a remote client cannot have one
+    if ((connect.flags & CONNECT_SHM) && !same_host(client->fd)) {
+        std::cerr << "Client " << client->id << ": rings are for clients on this host, using TCP\n";
+    } else if (connect.flags & CONNECT_SHM) {
+        int ring_fd = ring_take(state, connect.ring_token);
+        if (ring_fd >= 0) {
+            client->ring = shm_ring_attach(ring_fd);
+            close(ring_fd);
+        }
+        if (!client->ring) {
+            std::cerr << "Client " << client->id << ": "
+                      << (ring_fd < 0 ? "no ring offered" : "ring unsealed or malformed") << ", using TCP\n";
+        }
     }
 
-    // All parts must be processed for a complete match
-    return (t_idx == topic_parts.size() && p_idx == pattern_parts.size());
-}
+    // Compression is for TCP subscribers; rings and peer links stay plain
+    compress_leave(state, client);
+    if ((connect.flags & CONNECT_COMPRESS) && !client->ring && !(connect.flags & CONNECT_PEER)) {
+        compress_attach(state, client);
+    }
 
-void handle_new_connection(int listenfd, ServerState& state, std::vector<struct pollfd>& poll_fds) {
-    struct sockaddr_in tcp_cli_addr;
-    socklen_t tcp_cli_len = sizeof(tcp_cli_addr);
-    int tcp_cli_fd = accept(listenfd, (struct sockaddr*)&tcp_cli_addr, &tcp_cli_len);
-    DIE(tcp_cli_fd < 0, "accept() failed");
-    
-    // Disable Nagle's algorithm for improved latency
-    int enable = 1;
-    int result = setsockopt(tcp_cli_fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(int));
-    DIE(result < 0, "setsockopt TCP_NODELAY failed");
-    
-    // Store client address info for future reference
-    state.client_addresses[tcp_cli_fd] = std::make_pair(tcp_cli_addr.sin_addr, tcp_cli_addr.sin_port);
-    
-    // Add new client socket to poll set
-    poll_fds.push_back({tcp_cli_fd, POLLIN, 0});
+    multicast_offer(state, client);
 }
 
-void process_udp_message(int udp_fd, ServerState& state) {
-    char buff[2 * MESSAGES_SIZE];
-    struct sockaddr_in udp_cli_addr;
-    socklen_t udp_cli_len = sizeof(udp_cli_addr);
-    
-    int bytes_received = recvfrom(udp_fd, buff, sizeof(buff) - 1, 0,
-                                  (struct sockaddr*)&udp_cli_addr, &udp_cli_len);
-    DIE(bytes_received < 0, "recvfrom() failed");
-    
-    // Create message structure to store the UDP message
-    int total_len = sizeof(in_addr_t) + sizeof(uint16_t) + bytes_received;
-    stored_message_t* message = new stored_message_t;
-    message->len = total_len;
-    message->c = 0;  // Reference count (for memory management)
-    message->buff.reserve(total_len);
-    
-    // Add UDP source info and payload to message buffer
-    append_binary_data(message->buff, &udp_cli_addr.sin_addr.s_addr, sizeof(in_addr_t));
-    append_binary_data(message->buff, &udp_cli_addr.sin_port, sizeof(uint16_t));
-    append_binary_data(message->buff, buff, bytes_received);
-    
-    // Extract topic from the payload
-    char topic_str[51];
-    memcpy(topic_str, buff, 50);
-    topic_str[50] = '\0';
-    std::string current_topic = topic_str;
+void route_message(stored_message_t* message, ServerState& state, metrics_t& metrics,
+                   const trace_stamps_t* trace, bool from_peer) {
+    metrics.udp_records.add(1);
+
+    // Extract topic from the payload and split it into levels once
+    const char* datagram = message->buff + SOURCE_HEADER_SIZE;
+    topic_view_t current_topic;
+    topic_view_init(current_topic, datagram, strnlen(datagram, TOPIC_MAX_LEN));
+
+    // While overloaded, low priority topics are dropped before any matching
+    if (!from_peer && overload_sheds(*state.overload, current_topic)) {
+        metrics.udp_shed.add(1);
+        return;
+    }
+    message->seq = ++state.last_seq;
+
+    // Aggregate subscribers get one message per window instead
+    if (state.aggregates && !from_peer) {
+        aggregate_message(state, message, current_topic);
+    }
     
-    // Track clients that already received this message (avoid duplicates)
-    std::set<tcp_client_t*> message_recipients;
+    // Connected recipients, each listed once: a client matched by several
+    // patterns is marked the first time
+    auto& recipients = state.recipients;
+    recipients.clear();
+    uint64_t matches = 0;
+    size_t joined = 0;  // Recipients the multicast group reaches
+
+    // The frame block is reused for the next record, so offline clients
+    // get an exact-size copy, made on the first store only
+    stored_message_t* stored = nullptr;
     
-    // Distribute message to all matching subscribers
-    for (const auto& [pattern, subscribers] : state.subscriptions) {
-        if (topic_matches_pattern(current_topic, pattern)) {
-            for (auto* client : subscribers) {
-                if (!client->topics.count(pattern)) continue;
+    auto deliver = [&](const subscription_t& subscription) {
+        for (auto* client : subscription.subscribers) {
+            // Messages from other brokers never go back out (no loops)
+            if (from_peer && (client->flags & CONNECT_PEER)) continue;
+            
+            if (client->connected) {
+                // Connected clients are sent to once matching is complete
+                if (!client->routed) {
+                    client->routed = true;
+                    recipients.push_back(client);
+                    joined += client->multicast;
+                }
+            }
+            
+            // Store for disconnected client with Store-and-Forward enabled;
+            // sequenced clients also keep what they were sent until they ack.
+            // Only they need the pattern's SF flag looked up in their set
+            bool keep = client->connected ? (client->flags & CONNECT_SEQ) : true;
+            if (keep && topic_set_sf(client->topics, topic_set_find(client->topics, &subscription))) {
+                // A copy stored for this message is always the last entry
+                bool already_stored = stored && !client->lost_messages.empty() &&
+                                      client->lost_messages.back() == stored;
                 
-                if (client->connected) {
-                    // Send to connected client (if not already sent)
-                    if (message_recipients.insert(client).second) {
-                        send_all(client->fd, &message->len, sizeof(int));
-                        send_all(client->fd, (void*)message->buff.c_str(), message->len);
-                    }
-                } 
-                else if (client->topics[pattern]) {
-                    // Store for disconnected client with Store-and-Forward enabled
-                    bool already_stored = false;
-                    for (auto* stored_msg : client->lost_messages) {
-                        if (stored_msg == message) {
-                            already_stored = true;
-                            break;
-                        }
-                    }
-                    
-                    if (!already_stored) {
-                        ++message->c;  // Increment reference count
-                        client->lost_messages.push_back(message);
+                if (!already_stored) {
+                    if (!stored) {
+                        stored = message_alloc(message->len);
+                        stored->seq = message->seq;
+                        memcpy(stored->buff, message->buff, message->len);
                     }
+                    ++stored->c;  // Increment reference count
+                    client->lost_messages.push_back(stored);
+                    metrics.sf_stored.add(1);
+                    metrics.sf_depth.record(client->lost_messages.size());
                 }
             }
         }
+    };
+
+    // Patterns without wildcards: a single hash lookup
+    matches++;
+    auto exact = state.exact_subscriptions.find(std::string_view(current_topic.text, current_topic.len));
+    if (exact != state.exact_subscriptions.end()) {
+        deliver(*exact->second);
+    }
+
+    // Patterns with wildcards, each through the matcher for its shape
+    for (const auto* subscription : state.wildcard_subscriptions) {
+        matches++;
+        if (topic_matches(subscription->matcher, current_topic)) {
+            deliver(*subscription);
+        }
+    }
+    
+    // A wide fan-out goes to the group once instead of to each joined client
+    bool multicast = state.multicast && joined > 0 && joined >= (size_t)config.multicast_fanout;
+    if (multicast) {
+        multicast_send(state, message, metrics);
+        metrics.multicast_saved.add(joined);
+    }
+
+    // Send to every connected recipient once
+    uint64_t matched_ns = trace ? realtime_ns() : 0;
+    size_t kept = stored ? stored->c : 0;
+    for (auto* client : recipients) {
+        client->routed = false;
+        if (multicast && client->multicast) {
+            continue;
+        }
+        metrics.bytes_sent.add(client_send(client, message, trace, matched_ns));
+        metrics.sends.add(1);
+        if ((client->flags & CONNECT_SEQ) && stored && !client->lost_messages.empty() &&
+            client->lost_messages.back() == stored) {
+            kept--;  // Retained until acknowledged, but already delivered
+        }
+    }
+    
+    metrics.matches.add(matches);
+    metrics.matches_per_msg.record(matches);
+    metrics.fanout.record(recipients.size() + kept);
+}
+
+// Frame each record of a batched datagram and route it on its own
+static void route_batch(const stored_message_t* message, const char* datagram, int len,
+                        ServerState& state, metrics_t& metrics, const trace_stamps_t* trace) {
+    if (!state.record_message) {
+        state.record_message = message_alloc(SOURCE_HEADER_SIZE + UDP_DATAGRAM_MAX);
+    }
+    stored_message_t* record = state.record_message;
+    record->c = 0;
+    
+    // Every record carries the source of the datagram it came in
+    memcpy(record->buff, message->buff, SOURCE_HEADER_SIZE);
+
+    uint16_t count;
+    memcpy(&count, datagram + 4, sizeof(count));
+    count = ntohs(count);
+
+    int offset = UDP_BATCH_HEADER_SIZE;
+    for (uint16_t i = 0; i < count; ++i) {
+        // A batch cut short of its count, or a record overrunning it or
+        // too small to be one, ends the batch
+        uint16_t record_len;
+        if (offset + (int)sizeof(record_len) > len) {
+            metrics.udp_dropped.add(1);
+            return;
+        }
+        memcpy(&record_len, datagram + offset, sizeof(record_len));
+        record_len = ntohs(record_len);
+        offset += sizeof(record_len);
+
+        if (record_len < UDP_RECORD_MIN || offset + record_len > len) {
+            metrics.udp_dropped.add(1);
+            return;
+        }
+
+        memcpy(record->buff + SOURCE_HEADER_SIZE, datagram + offset, record_len);
+        record->len = SOURCE_HEADER_SIZE + record_len;
+        route_message(record, state, metrics, trace, false);
+        offset += record_len;
+    }
+}
+
+// Pick the control messages of a received datagram: the running
+// SO_RXQ_OVFL drop count and, when tracing, the SO_TIMESTAMPNS stamp
+static void read_control(struct msghdr& msg, trace_stamps_t& stamps, uint32_t& kernel_drops) {
+    // The kernel leaves the drop count out while it is still 0
+    for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET) continue;
+        if (cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+            struct timespec ts;
+            memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            stamps.kernel_rx_ns = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+        } else if (cmsg->cmsg_type == SO_RXQ_OVFL) {
+            memcpy(&kernel_drops, CMSG_DATA(cmsg), sizeof(kernel_drops));
+        }
+    }
+}
+
+// Receive a datagram together with its control messages
+static int recv_control(int udp_fd, char* datagram, struct sockaddr_in* from, trace_stamps_t& stamps,
+                        uint32_t& kernel_drops) {
+    struct iovec iov = {datagram, UDP_DATAGRAM_MAX};
+    char control[UDP_CONTROL_SIZE];
+    struct msghdr msg = {};
+    msg.msg_name = from;
+    msg.msg_namelen = sizeof(*from);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    int rc = recvmsg(udp_fd, &msg, 0);
+    stamps = {};
+    if (config.trace_latency) {
+        stamps.read_ns = realtime_ns();
+    }
+    read_control(msg, stamps, kernel_drops);
+    return rc;
+}
+
+uint32_t subscription_attach(ServerState& state, subscription_t* subscription, tcp_client_t* client) {
+    subscription->subscribers.push_back(client);
+    if (!(client->flags & CONNECT_PEER) && subscription->local_subscribers++ == 0) {
+        federation_export(state, subscription->pattern, true);
+    }
+    return subscription->subscribers.size() - 1;
+}
+
+void positions_insert(positions_t& positions, size_t count, size_t index, uint32_t position) {
+    uint32_t *data;
+    if (count < POSITIONS_INLINE) {
+        data = positions.local;
+    } else if (count == POSITIONS_INLINE) {
+        data = (uint32_t *)malloc((count + 1) * sizeof(uint32_t));
+        DIE(data == nullptr, "malloc");
+        memcpy(data, positions.local, count * sizeof(uint32_t));
+        positions.spill = data;
+    } else {
+        data = (uint32_t *)realloc(positions.spill, (count + 1) * sizeof(uint32_t));
+        DIE(data == nullptr, "realloc");
+        positions.spill = data;
+    }
+    memmove(data + index + 1, data + index, (count - index) * sizeof(uint32_t));
+    data[index] = position;
+}
+
+void positions_erase(positions_t& positions, size_t count, size_t index) {
+    uint32_t *data = positions_at(positions, count);
+    memmove(data + index, data + index + 1, (count - index - 1) * sizeof(uint32_t));
+    if (count == POSITIONS_INLINE + 1) {
+        memcpy(positions.local, data, POSITIONS_INLINE * sizeof(uint32_t));
+        free(data);
+    }
+}
+
+void positions_clear(positions_t& positions, size_t count) {
+    if (count > POSITIONS_INLINE) {
+        free(positions.spill);
+    }
+}
+
+void subscription_detach(ServerState& state, subscription_t* subscription, tcp_client_t* client,
+                         uint32_t position) {
+    // The last subscriber moves into the hole, and learns where it is now
+    auto& subs = subscription->subscribers;
+    tcp_client_t* moved = subs.back();
+    subs[position] = moved;
+    subs.pop_back();
+    if (moved != client) {
+        positions_at(moved->positions, topic_set_size(moved->topics))[topic_set_find(moved->topics, subscription)] =
+            position;
+    }
+    if (!(client->flags & CONNECT_PEER) && --subscription->local_subscribers == 0) {
+        federation_export(state, subscription->pattern, false);
+    }
+}
+
+// Subscribe a client to a pattern, or only change its SF flag if it already is
+static void client_subscribe(ServerState& state, tcp_client_t* client, subscription_t* subscription, bool sf) {
+    bool subscribed = topic_set_find(client->topics, subscription) >= 0;
+    uint32_t position = subscribed ? 0 : subscription_attach(state, subscription, client);
+    size_t count = topic_set_size(client->topics);
+    client->topics = topic_set_add(state, client->topics, subscription, sf);
+    if (!subscribed) {
+        positions_insert(client->positions, count, topic_set_find(client->topics, subscription), position);
+    }
+}
+
+static void client_unsubscribe(ServerState& state, tcp_client_t* client, subscription_t* subscription) {
+    int index = topic_set_find(client->topics, subscription);
+    if (index < 0) {
+        return;
+    }
+    size_t count = topic_set_size(client->topics);
+    subscription_detach(state, subscription, client, positions_at(client->positions, count)[index]);
+    positions_erase(client->positions, count, index);
+    client->topics = topic_set_remove(state, client->topics, subscription);
+}
+
+// Route a datagram received after the headroom of a message block
+static void handle_datagram(stored_message_t* message, int bytes_received, const sockaddr_in& udp_cli_addr,
+                            ServerState& state, metrics_t& metrics, const trace_stamps_t* trace) {
+    char* datagram = message->buff + SOURCE_HEADER_SIZE;
+
+    // Keep every datagram, malformed ones included, for replay
+    if (state.capture) {
+        uint64_t rx_ns = trace ? (trace->kernel_rx_ns ? trace->kernel_rx_ns : trace->read_ns) : realtime_ns();
+        capture_write(state.capture, rx_ns, udp_cli_addr, datagram, bytes_received);
+    }
+
+    bool batch = bytes_received >= UDP_BATCH_HEADER_SIZE &&
+                 memcmp(datagram, UDP_BATCH_MAGIC, 4) == 0;
+
+    // A plain datagram needs at least the topic field and the type byte
+    if (!batch && bytes_received < UDP_RECORD_MIN) {
+        metrics.udp_dropped.add(1);
+        return;
     }
     
-    // Cleanup if no references to the message
-    if (message->c == 0) {
-        delete message;
+    // Fill the source header in the headroom: IP (4 bytes) + port (2 bytes)
+    memcpy(message->buff, &udp_cli_addr.sin_addr.s_addr, sizeof(in_addr_t));
+    memcpy(message->buff + sizeof(in_addr_t), &udp_cli_addr.sin_port, sizeof(uint16_t));
+
+    if (batch) {
+        route_batch(message, datagram, bytes_received, state, metrics, trace);
+    } else {
+        message->len = SOURCE_HEADER_SIZE + bytes_received;
+        message->c = 0;
+        route_message(message, state, metrics, trace, false);
     }
 }
 
+void process_udp_message(int udp_fd, ServerState& state) {
+    metrics_t& metrics = local_metrics();
+    uint64_t start_ns = monotonic_ns();
+
+    // Receive straight into the reusable message block, leaving headroom
+    // for the source header so the frame is complete without any copy
+    if (!state.rx_message) {
+        state.rx_message = message_alloc(SOURCE_HEADER_SIZE + UDP_DATAGRAM_MAX);
+    }
+    stored_message_t* message = state.rx_message;
+    char* datagram = message->buff + SOURCE_HEADER_SIZE;
+
+    struct sockaddr_in udp_cli_addr;
+    
+    // The drop count comes with every datagram; tracing also reads the
+    // kernel receive timestamp
+    trace_stamps_t stamps;
+    trace_stamps_t* trace = config.trace_latency ? &stamps : nullptr;
+    uint32_t kernel_drops = state.overload->kernel_drops;
+    int bytes_received = recv_control(udp_fd, datagram, &udp_cli_addr, stamps, kernel_drops);
+    DIE(bytes_received < 0, "recvmsg() failed");
+    metrics.udp_received.add(1);
+    overload_update(*state.overload, udp_fd, kernel_drops, start_ns, metrics);
+
+    handle_datagram(message, bytes_received, udp_cli_addr, state, metrics, trace);
+    metrics.udp_ns.record(monotonic_ns() - start_ns);
+}
+
+int process_udp_burst(int udp_fd, ServerState& state) {
+    udp_burst_t& burst = *state.rx_burst;
+    for (int i = 0; i < UDP_RECV_BURST; ++i) {
+        burst.headers[i].msg_hdr.msg_namelen = sizeof(burst.from[i]);
+        burst.headers[i].msg_hdr.msg_controllen = sizeof(burst.control[i]);
+    }
+
+    int count = recvmmsg(udp_fd, burst.headers, UDP_RECV_BURST, MSG_DONTWAIT, nullptr);
+    if (count < 0) {
+        DIE(errno != EAGAIN && errno != EWOULDBLOCK, "recvmmsg() failed");
+        return 0;
+    }
+
+    metrics_t& metrics = local_metrics();
+    uint64_t read_ns = config.trace_latency ? realtime_ns() : 0;
+    for (int i = 0; i < count; ++i) {
+        uint64_t start_ns = monotonic_ns();
+        trace_stamps_t stamps = {};
+        stamps.read_ns = read_ns;
+        uint32_t kernel_drops = state.overload->kernel_drops;
+        read_control(burst.headers[i].msg_hdr, stamps, kernel_drops);
+        metrics.udp_received.add(1);
+        overload_update(*state.overload, udp_fd, kernel_drops, start_ns, metrics);
+
+        handle_datagram(burst.blocks[i], burst.headers[i].msg_len, burst.from[i], state, metrics,
+                        config.trace_latency ? &stamps : nullptr);
+        metrics.udp_ns.record(monotonic_ns() - start_ns);
+    }
+    return count;
+}
+
 bool handle_server_command(ServerState& state, std::vector<struct pollfd>& poll_fds) {
     char buff[MESSAGES_SIZE];
     char* argv[MESSAGES_SIZE];
     
     fgets(buff, MESSAGES_SIZE, stdin);
-    int argc = string_to_argv(buff, argv);
+    int argc = string_to_argv(buff, argv, MESSAGES_SIZE);
     
     if (argc == 1 && strcmp(argv[0], "exit") == 0) {
-        // Send shutdown notice to all connected clients
+        // Send shutdown notice to all connected clients, after what is pending for them
+        compress_flush(state);
         for (const auto& [id, client] : state.clients) {
             if (client->connected) {
-                tcp_request_t notice = {};
-                strcpy(notice.id, "SERVER");
-                notice.type = MESSAGE;
-                notice.message = SHUTDOWN;
-                send_all(client->fd, &notice, sizeof(notice));
+                struct {
+                    int header;
+                    tcp_request_t notice;
+                } frame = {};
+                frame.header = sizeof(tcp_request_t) | FRAME_CONTROL;
+                strcpy(frame.notice.id, "SERVER");
+                frame.notice.type = MESSAGE;
+                frame.notice.message = SHUTDOWN;
+                send_all(client->fd, &frame, sizeof(frame));
             }
         }
         
@@ -192,18 +712,67 @@ bool handle_server_command(ServerState& state, std::vector<struct pollfd>& poll_
             }
         }
         
+        // Persist clients and SF backlogs for the next start
+        if (config.snapshot) {
+            snapshot_save(config.snapshot, state);
+        }
+        
         // Free allocated memory
-        for (const auto& [id, client] : state.clients) {
-            for (auto* msg : client->lost_messages) {
+        for (auto& client : state.client_list) {
+            for (auto* msg : client.lost_messages) {
                 if (--msg->c == 0) {
-                    delete msg;
+                    free(msg);
                 }
             }
-            delete client;
+            shm_writer_detach(client.ring);
+            positions_clear(client.positions, topic_set_size(client.topics));
+        }
+        for (const auto& [token, offer] : state.ring_offers) {
+            close(offer.first);
+        }
+        free(state.rx_message);
+        free(state.record_message);
+        capture_close(state.capture);
+        delete state.overload;
+        delete state.aggregates;
+        compress_free(state);
+        multicast_free(state);
+        if (state.topic_sets) {
+            for (auto* set : state.topic_sets->sets) {
+                delete set;
+            }
+            delete state.topic_sets;
+        }
+        if (state.rx_burst) {
+            for (auto* block : state.rx_burst->blocks) {
+                free(block);
+            }
+            delete state.rx_burst;
+        }
+        for (const auto& [fd, conn] : state.admin_conns) {
+            delete conn;
+        }
+        for (auto* link : state.peer_links) {
+            delete link;
         }
         
         return true; // Signal to exit server loop
     }
+
+    if ((argc == 1 || argc == 2) && strcmp(argv[0], "snapshot") == 0) {
+        const char *path = (argc == 2) ? argv[1] : config.snapshot;
+        if (!path) {
+            std::cerr << "Usage: snapshot <PATH> (no --snapshot path configured)\n";
+        } else if (snapshot_save(path, state)) {
+            std::cout << "Snapshot written to " << path << ".\n";
+        }
+    }
+
+    if (argc == 1 && strcmp(argv[0], "stats") == 0) {
+        metrics_snapshot_t snap;
+        metrics_collect(snap);
+        metrics_print(snap, std::cout);
+    }
     
     return false;
 }
@@ -211,14 +780,21 @@ bool handle_server_command(ServerState& state, std::vector<struct pollfd>& poll_
 void handle_client_request(int fd, tcp_request_t& request, ServerState& state, 
                            std::vector<struct pollfd>& poll_fds, uint64_t index) {
     request.id[10] = '\0'; // Ensure client ID is null-terminated
-    std::string client_id(request.id);
+    std::string_view client_id(request.id);
     
     switch (request.type) {
         case MESSAGE: {
-            if (state.clients.count(client_id)) {
-                tcp_client_t* client = state.clients[client_id];
+            auto known = state.clients.find(client_id);
+            if (known != state.clients.end()) {
+                tcp_client_t* client = known->second;
                 
-                if (client->connected) {
+                if ((request.connect.flags & CONNECT_PEER) && !(client->flags & CONNECT_PEER)) {
+                    // A broker must not take over a subscriber's subscriptions and backlog
+                    std::cout << "Peer " << client_id << " refused: the ID belongs to a client.\n";
+                    close(fd);
+                    state.client_addresses.erase(fd);
+                    poll_fds.erase(poll_fds.begin() + index);
+                } else if (client->connected) {
                     // Client already connected - reject duplicate connection
                     std::cout << "Client " << client_id << " already connected.\n";
                     close(fd);
@@ -226,36 +802,64 @@ void handle_client_request(int fd, tcp_request_t& request, ServerState& state,
                     poll_fds.erase(poll_fds.begin() + index);
                 } else {
                     // Client reconnecting - update state and send missed messages
+                    bool peer = request.connect.flags & CONNECT_PEER;
                     auto& [ip, port] = state.client_addresses[fd];
-                    std::cout << "New client " << client_id << " connected from " 
+                    std::cout << (peer ? "New peer " : "New client ") << client_id << " connected from " 
                               << inet_ntoa(ip) << ":" << ntohs(port) << ".\n";
                     
+                    // A peer broker sends its current pattern set again on every link
+                    if ((client->flags | request.connect.flags) & CONNECT_PEER) {
+                        size_t count = topic_set_size(client->topics);
+                        for (size_t i = 0; i < count; ++i) {
+                            subscription_detach(state, client->topics->patterns[i], client,
+                                                positions_at(client->positions, count)[i]);
+                        }
+                        positions_clear(client->positions, count);
+                        topic_set_release(state, client->topics);
+                        client->topics = nullptr;
+                    }
+                    
                     client->fd = fd;
                     client->connected = true;
+                    client_configure(state, client, request.connect);
+                    state.fd_clients[fd] = client;
                     
-                    // Send stored messages accumulated during disconnect
+                    // A sequenced client already processed everything up to
+                    // resume_seq; the rest is replayed and kept until acked
+                    metrics_t& metrics = local_metrics();
+                    bool sequenced = client->flags & CONNECT_SEQ;
+                    if (sequenced) {
+                        client_release(client, request.connect.resume_seq, metrics);
+                    }
+                    
+                    // Send stored messages accumulated during disconnect;
+                    // nobody else gets them, so a shared stream is left first
+                    if (!client->lost_messages.empty()) {
+                        compress_isolate(state, client);
+                    }
                     for (auto* msg : client->lost_messages) {
-                        send_all(fd, &msg->len, sizeof(int));
-                        send_all(fd, (void*)msg->buff.c_str(), msg->len);
-                        
-                        if (--msg->c == 0) {
-                            delete msg;
-                        }
+                        metrics.bytes_sent.add(client_send(client, msg, nullptr, 0));
+                        metrics.sends.add(1);
+                    }
+                    if (!sequenced) {
+                        client_release(client, UINT64_MAX, metrics);
                     }
-                    client->lost_messages.clear();
                 }
             } else {
                 // New client connecting for the first time
+                bool peer = request.connect.flags & CONNECT_PEER;
                 auto& [ip, port] = state.client_addresses[fd];
-                std::cout << "New client " << client_id << " connected from " 
+                std::cout << (peer ? "New peer " : "New client ") << client_id << " connected from " 
                           << inet_ntoa(ip) << ":" << ntohs(port) << ".\n";
                 
-                tcp_client_t* new_client = new tcp_client_t;
+                tcp_client_t* new_client = &state.client_list.emplace_back();
                 new_client->fd = fd;
-                new_client->id = client_id;
+                memcpy(new_client->id, request.id, sizeof(new_client->id));
                 new_client->connected = true;
+                client_configure(state, new_client, request.connect);
                 
-                state.clients[client_id] = new_client;
+                state.clients.emplace(new_client->id, new_client);
+                state.fd_clients[fd] = new_client;
             }
             break;
         }
@@ -264,26 +868,13 @@ void handle_client_request(int fd, tcp_request_t& request, ServerState& state,
             request.subscribe.topic[50] = '\0';  // Ensure topic is null-terminated
             std::string topic(request.subscribe.topic);
             
-            if (state.clients.count(client_id)) {
-                tcp_client_t* client = state.clients[client_id];
-                
-                // Add client to subscribers list if not already subscribed
-                bool found = false;
-                if (state.subscriptions.count(topic)) {
-                    for (auto* sub : state.subscriptions[topic]) {
-                        if (sub == client) {
-                            found = true;
-                            break;
-                        }
-                    }
-                }
+            auto known = state.clients.find(client_id);
+            if (known != state.clients.end()) {
+                tcp_client_t* client = known->second;
                 
-                if (!found) {
-                    state.subscriptions[topic].push_back(client);
-                }
-                
-                // Update client's topics map with store-and-forward flag
-                client->topics[topic] = request.subscribe.sf;
+                // Join the subscribers unless already there, and set the store-and-forward flag
+                client_subscribe(state, client, subscription_get(state, topic), request.subscribe.sf);
+                compress_rekey(state, client);
             }
             break;
         }
@@ -292,31 +883,75 @@ void handle_client_request(int fd, tcp_request_t& request, ServerState& state,
             request.unsubscribe.topic[50] = '\0';  // Ensure topic is null-terminated
             std::string topic(request.unsubscribe.topic);
             
-            if (state.clients.count(client_id)) {
-                tcp_client_t* client = state.clients[client_id];
+            auto known = state.clients.find(client_id);
+            if (known != state.clients.end()) {
+                tcp_client_t* client = known->second;
                 
-                // Remove client from subscribers list
-                if (state.subscriptions.count(topic)) {
-                    auto& subs = state.subscriptions[topic];
-                    subs.erase(
-                        std::remove(subs.begin(), subs.end(), client),
-                        subs.end()
-                    );
+                // Remove client from subscribers list and the pattern from its set
+                auto subscription = state.subscriptions.find(topic);
+                if (subscription != state.subscriptions.end()) {
+                    client_unsubscribe(state, client, &subscription->second);
+                    compress_rekey(state, client);
                 }
-                
-                // Remove topic from client's subscription list
-                client->topics.erase(topic);
+                aggregate_unsubscribe(state, client, topic);
+            }
+            break;
+        }
+
+        case AGGREGATE: {
+            request.aggregate.topic[sizeof(request.aggregate.topic) - 1] = '\0';
+            uint32_t window_ms = ntohl(request.aggregate.window_ms);
+            if (window_ms < AGGREGATE_WINDOW_MIN_MS || window_ms > AGGREGATE_WINDOW_MAX_MS) {
+                break;
+            }
+
+            auto known = state.clients.find(client_id);
+            if (known != state.clients.end()) {
+                aggregate_subscribe(state, known->second, request.aggregate.topic, window_ms);
+                // Aggregates are the client's own frames
+                compress_isolate(state, known->second);
+            }
+            break;
+        }
+        
+        case ACK: {
+            // Release the messages the client has processed
+            auto known = state.clients.find(client_id);
+            if (known != state.clients.end()) {
+                client_release(known->second, request.ack.seq, local_metrics());
+            }
+            break;
+        }
+        
+        case JOINED: {
+            auto known = state.clients.find(client_id);
+            if (known != state.clients.end()) {
+                multicast_joined(state, known->second);
+            }
+            break;
+        }
+        
+        case NACK: {
+            // Datagrams the client missed come back over its connection
+            auto known = state.clients.find(client_id);
+            if (known != state.clients.end()) {
+                multicast_repair(state, known->second, request.nack, local_metrics());
             }
             break;
         }
         
         case EXIT: {
-            if (state.clients.count(client_id)) {
+            auto known = state.clients.find(client_id);
+            if (known != state.clients.end()) {
                 std::cout << "Client " << client_id << " disconnected.\n";
-                state.clients[client_id]->connected = false;
+                known->second->connected = false;
+                shm_writer_detach(known->second->ring);
+                known->second->ring = nullptr;
+                compress_leave(state, known->second);
             }
             
             close(fd);
+            state.fd_clients.erase(fd);
             state.client_addresses.erase(fd);
             poll_fds.erase(poll_fds.begin() + index);
             break;
@@ -325,18 +960,17 @@ void handle_client_request(int fd, tcp_request_t& request, ServerState& state,
 }
 
 void handle_client_disconnect(int fd, ServerState& state, std::vector<struct pollfd>& poll_fds, uint64_t index) {
-    std::string client_id_to_mark;
-    
-    // Find client ID by socket descriptor
-    for (const auto& [id, client] : state.clients) {
-        if (client->fd == fd) {
-            client_id_to_mark = id;
-            break;
-        }
+    // Find client by socket descriptor; a client kicked from the admin
+    // socket was already taken off it, and may be on a new fd by now
+    auto owner = state.fd_clients.find(fd);
+    if (owner != state.fd_clients.end() && owner->second->fd == fd) {
+        owner->second->connected = false;
+        shm_writer_detach(owner->second->ring);
+        owner->second->ring = nullptr;
+        compress_leave(state, owner->second);
     }
-    
-    if (!client_id_to_mark.empty()) {
-        state.clients[client_id_to_mark]->connected = false;
+    if (owner != state.fd_clients.end()) {
+        state.fd_clients.erase(owner);
     }
     
     close(fd);
@@ -344,27 +978,174 @@ void handle_client_disconnect(int fd, ServerState& state, std::vector<struct pol
     poll_fds.erase(poll_fds.begin() + index);
 }
 
+// Pin the loop, ask the kernel to busy-poll the socket and fault in
+// every buffer the spinning loop touches, so it never sleeps or faults
+static void busy_poll_init(ServerState& state, int udp_fd, std::vector<struct pollfd>& poll_set) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(config.busy_poll_cpu, &cpus);
+    DIE(sched_setaffinity(0, sizeof(cpus), &cpus) < 0, "sched_setaffinity() failed");
+
+    // Raising the budget above net.core.busy_read needs CAP_NET_ADMIN
+    int budget = BUSY_POLL_US;
+    if (setsockopt(udp_fd, SOL_SOCKET, SO_BUSY_POLL, &budget, sizeof(budget)) < 0) {
+        perror("setsockopt(SO_BUSY_POLL)");
+    }
+
+    state.rx_burst = new udp_burst_t{};
+    udp_burst_t& burst = *state.rx_burst;
+    for (int i = 0; i < UDP_RECV_BURST; ++i) {
+        burst.blocks[i] = message_alloc(SOURCE_HEADER_SIZE + UDP_DATAGRAM_MAX);
+        memset(burst.blocks[i]->buff, 0, SOURCE_HEADER_SIZE + UDP_DATAGRAM_MAX);
+        burst.iov[i] = {burst.blocks[i]->buff + SOURCE_HEADER_SIZE, UDP_DATAGRAM_MAX};
+
+        struct msghdr& msg = burst.headers[i].msg_hdr;
+        msg.msg_name = &burst.from[i];
+        msg.msg_iov = &burst.iov[i];
+        msg.msg_iovlen = 1;
+        msg.msg_control = burst.control[i];
+    }
+    state.record_message = message_alloc(SOURCE_HEADER_SIZE + UDP_DATAGRAM_MAX);
+    memset(state.record_message->buff, 0, SOURCE_HEADER_SIZE + UDP_DATAGRAM_MAX);
+    poll_set.reserve(BUSY_POLL_FDS);
+    state.fd_clients.reserve(BUSY_POLL_FDS);
+    state.client_addresses.reserve(BUSY_POLL_FDS);
+
+    // Keep all of it resident. Later allocations are not locked, so a
+    // growing SF backlog cannot run into RLIMIT_MEMLOCK; without the
+    // privilege the buffers are still faulted in, just not locked
+    if (mlockall(MCL_CURRENT) < 0) {
+        perror("mlockall");
+    }
+
+    // Nothing waits for the socket to become readable: it is drained on every turn
+    poll_set[0].events = 0;
+}
+
 void server(int tcp_listen_fd, int udp_fd) {
     ServerState state;
     std::vector<struct pollfd> poll_set;
 
     // Setup file descriptors to monitor for activity
-    poll_set.reserve(3);
+    poll_set.reserve(4);
     poll_set.push_back({.fd = udp_fd, .events = POLLIN, .revents = 0});      // UDP messages
     poll_set.push_back({.fd = tcp_listen_fd, .events = POLLIN, .revents = 0}); // TCP connections
     poll_set.push_back({.fd = STDIN_FILENO, .events = POLLIN, .revents = 0});  // Console input
 
+    // Warm restart: bring back the clients of the previous run
+    if (config.snapshot) {
+        snapshot_load(config.snapshot, state);
+    }
+
+    // Numbering continues from the wall clock, so sequence numbers keep
+    // growing across restarts even without a snapshot
+    state.last_seq = std::max(state.last_seq, realtime_ns());
+
+    int admin_fd = -1;
+    if (config.admin_socket) {
+        admin_fd = admin_listen(config.admin_socket);
+        poll_set.push_back({.fd = admin_fd, .events = POLLIN, .revents = 0});  // Admin connections
+    }
+
+    // Socket subscribers on this host hand their rings over on
+    ring_listen(state);
+    if (state.ring_fd >= 0) {
+        poll_set.push_back({.fd = state.ring_fd, .events = POLLIN, .revents = 0});  // Ring offers
+    }
+
+    // Record incoming datagrams for replay
+    if (config.record) {
+        state.capture = capture_open(config.record);
+        DIE(!state.capture, "cannot create the capture file");
+    }
+
+    // Links to the other brokers are connected (and reconnected) from the loop
+    federation_init(state);
+
+    // Receive buffer size, drop counting and the shedding rules
+    overload_init(state, udp_fd);
+
+    // Socket of the --multicast group
+    multicast_init(state);
+
+    if (config.busy_poll) {
+        busy_poll_init(state, udp_fd, poll_set);
+    }
+
+    // Deadline of the next periodic stats line
+    uint64_t next_stats_ns = monotonic_ns() + config.stats_interval * 1000000000ull;
+
     // Main event processing loop
     while (true) {
-        int active_fds = poll(poll_set.data(), poll_set.size(), -1);
+        int timeout_ms = -1;
+        if (config.stats_interval > 0) {
+            uint64_t now = monotonic_ns();
+            if (now >= next_stats_ns) {
+                metrics_snapshot_t snap;
+                metrics_collect(snap);
+                metrics_print_line(snap, std::cerr);
+                next_stats_ns = now + config.stats_interval * 1000000000ull;
+            }
+            timeout_ms = (next_stats_ns - now + 999999) / 1000000;
+        }
+
+        int retry_ms = federation_poll(state, poll_set);
+        if (retry_ms >= 0 && (timeout_ms < 0 || retry_ms < timeout_ms)) {
+            timeout_ms = retry_ms;
+        }
+
+        // While shedding, the load is rechecked even if the datagrams stop
+        int check_ms = overload_poll(*state.overload, udp_fd);
+        if (check_ms >= 0 && (timeout_ms < 0 || check_ms < timeout_ms)) {
+            timeout_ms = check_ms;
+        }
+
+        // Windows that closed are emitted, the next one to close sets the wakeup
+        int window_ms = aggregate_poll(state);
+        if (window_ms >= 0 && (timeout_ms < 0 || window_ms < timeout_ms)) {
+            timeout_ms = window_ms;
+        }
+
+        // A quiet group announces its last sequence number, so lost tails get repaired
+        int heartbeat_ms = multicast_poll(state);
+        if (heartbeat_ms >= 0 && (timeout_ms < 0 || heartbeat_ms < timeout_ms)) {
+            timeout_ms = heartbeat_ms;
+        }
+
+        // Busy polling drains the UDP socket, then only checks the other
+        // descriptors: the loop spins instead of sleeping until the next event
+        if (config.busy_poll) {
+            process_udp_burst(udp_fd, state);
+            timeout_ms = 0;
+        }
+
+        // Frames batched for compressed clients during the last turn go out before waiting
+        compress_flush(state);
+
+        int active_fds = poll(poll_set.data(), poll_set.size(), timeout_ms);
         DIE(active_fds < 0, "poll() error");
 
         for (size_t idx = 0; idx < poll_set.size(); ++idx) {
             struct pollfd& pfd = poll_set[idx];
+
+            // Admin sessions also wait for POLLOUT, so they are served first
+            if (pfd.revents && state.admin_conns.count(pfd.fd)) {
+                if (admin_handle(pfd.fd, state, poll_set, idx))
+                    idx--;
+                continue;
+            }
+
+            // Links to peers wait for POLLOUT while connecting
+            if (pfd.revents && state.peer_fds.count(pfd.fd)) {
+                if (federation_handle(pfd.fd, state, poll_set, idx))
+                    idx--;
+                continue;
+            }
             
             // Check for errors/hangups first
             if (pfd.revents & (POLLERR | POLLHUP)) {
-                if (pfd.fd != tcp_listen_fd && pfd.fd != udp_fd && pfd.fd != STDIN_FILENO) {
+                if (pfd.fd != tcp_listen_fd && pfd.fd != udp_fd && pfd.fd != STDIN_FILENO &&
+                    pfd.fd != admin_fd && pfd.fd != state.ring_fd) {
                     handle_client_disconnect(pfd.fd, state, poll_set, idx);
                     idx--; // Adjust index after removing descriptor from array
                 }
@@ -381,9 +1162,18 @@ void server(int tcp_listen_fd, int udp_fd) {
             else if (pfd.fd == tcp_listen_fd) {
                 handle_new_connection(tcp_listen_fd, state, poll_set); // Accept new TCP connection
             } 
+            else if (pfd.fd == admin_fd) {
+                admin_accept(admin_fd, state, poll_set); // Accept admin connections
+            }
+            else if (pfd.fd == state.ring_fd) {
+                ring_receive(state); // Rings offered by subscribers
+            }
             else if (pfd.fd == STDIN_FILENO) {
-                if (handle_server_command(state, poll_set)) // Process server console command
+                if (handle_server_command(state, poll_set)) { // Process server console command
+                    if (config.admin_socket)
+                        unlink(config.admin_socket);
                     return;
+                }
             } 
             else {
                 // Handle TCP client request
@@ -397,7 +1187,9 @@ void server(int tcp_listen_fd, int udp_fd) {
                 } 
                 else if (bytes > 0) {
                     // Process client request
+                    uint64_t start_ns = monotonic_ns();
                     handle_client_request(pfd.fd, req, state, poll_set, idx);
+                    local_metrics().request_ns.record(monotonic_ns() - start_ns);
                 } 
                 else {
                     DIE(true, "recv_all() failure");
@@ -422,6 +1214,17 @@ void configure_socket(int& sock, int type, uint16_t port) {
         exit(EXIT_FAILURE);
     }
 
+    // Accepted sockets inherit these, which keeps the accept path to one syscall
+    if (type == SOCK_STREAM) {
+        int enable = 1;
+        if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)) < 0 ||
+            fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) < 0) {
+            perror("Listening socket setup failed");
+            close(sock);
+            exit(EXIT_FAILURE);
+        }
+    }
+
     // Prepare and bind to server address
     sockaddr_in addr{};
     addr.sin_family = AF_INET;
@@ -442,29 +1245,173 @@ void configure_socket(int& sock, int type, uint16_t port) {
     }
 }
 
+bool parse_config(int argc, char* argv[]) {
+    static const struct option long_options[] = {
+        {"stats-interval", required_argument, nullptr, 's'},
+        {"admin-socket", required_argument, nullptr, 'a'},
+        {"snapshot", required_argument, nullptr, 'S'},
+        {"trace-latency", no_argument, nullptr, 't'},
+        {"peer", required_argument, nullptr, 'p'},
+        {"node-id", required_argument, nullptr, 'n'},
+        {"record", required_argument, nullptr, 'r'},
+        {"rcvbuf", required_argument, nullptr, 'b'},
+        {"topic-priority", required_argument, nullptr, 'P'},
+        {"busy-poll", required_argument, nullptr, 'B'},
+        {"multicast", required_argument, nullptr, 'M'},
+        {"multicast-fanout", required_argument, nullptr, 'F'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1) {
+        switch (opt) {
+            case 's':
+                config.stats_interval = atoi(optarg);
+                if (config.stats_interval < 0) {
+                    std::cerr << "Invalid stats interval\n";
+                    return false;
+                }
+                break;
+            case 'a':
+                config.admin_socket = optarg;
+                break;
+            case 'S':
+                config.snapshot = optarg;
+                break;
+            case 't':
+                config.trace_latency = true;
+                break;
+            case 'p': {
+                sockaddr_in addr;
+                if (!peer_parse(optarg, addr)) {
+                    std::cerr << "Invalid peer " << optarg << " (expected HOST:PORT)\n";
+                    return false;
+                }
+                config.peers.push_back(optarg);
+                config.peer_addrs.push_back(addr);
+                break;
+            }
+            case 'n':
+                if (strlen(optarg) == 0 || strlen(optarg) > 10) {
+                    std::cerr << "Invalid node ID (1 to 10 characters)\n";
+                    return false;
+                }
+                config.node_id = optarg;
+                break;
+            case 'r':
+                config.record = optarg;
+                break;
+            case 'b':
+                config.rcvbuf = atoi(optarg);
+                if (config.rcvbuf <= 0) {
+                    std::cerr << "Invalid receive buffer size\n";
+                    return false;
+                }
+                break;
+            case 'P': {
+                std::string pattern;
+                int priority;
+                if (!priority_parse(optarg, pattern, priority)) {
+                    std::cerr << "Invalid topic priority " << optarg << " (expected PATTERN:0-"
+                              << TOPIC_PRIORITY_MAX << ")\n";
+                    return false;
+                }
+                config.topic_priorities.emplace_back(pattern, priority);
+                break;
+            }
+            case 'B': {
+                char* end;
+                long cpu = strtol(optarg, &end, 10);
+                if (*end != '\0' || end == optarg || cpu < 0 || cpu >= CPU_SETSIZE) {
+                    std::cerr << "Invalid CPU " << optarg << "\n";
+                    return false;
+                }
+                config.busy_poll = true;
+                config.busy_poll_cpu = cpu;
+                break;
+            }
+            case 'M':
+                if (!peer_parse(optarg, config.multicast_group) ||
+                    !IN_MULTICAST(ntohl(config.multicast_group.sin_addr.s_addr))) {
+                    std::cerr << "Invalid multicast group " << optarg << " (expected GROUP:PORT)\n";
+                    return false;
+                }
+                config.multicast = true;
+                break;
+            case 'F':
+                config.multicast_fanout = atoi(optarg);
+                if (config.multicast_fanout <= 0) {
+                    std::cerr << "Invalid multicast fan-out\n";
+                    return false;
+                }
+                break;
+            default:
+                return false;
+        }
+    }
+
+    // Exactly one positional argument remains: the port
+    if (optind != argc - 1)
+        return false;
+
+    char* end_ptr;
+    const long port_num = strtol(argv[optind], &end_ptr, 10);
+    if (*end_ptr != '\0' || port_num < 1024 || port_num > 65535) {
+        std::cerr << "Invalid port number\n";
+        return false;
+    }
+    config.port = port_num;
+
+    // Subscribers bind the group port; sharing it with the server's would mix the two
+    if (config.multicast && ntohs(config.multicast_group.sin_port) == config.port) {
+        std::cerr << "The multicast port must differ from the server port\n";
+        return false;
+    }
+    if (!config.multicast_fanout) {
+        config.multicast_fanout = MULTICAST_FANOUT_DEFAULT;
+    }
+
+    // Peers know this broker by its node ID. Nothing local makes one unique
+    // across hosts (brokers usually share the port), so it must be given.
+    if (!config.peers.empty() && !config.node_id) {
+        std::cerr << "--peer needs --node-id, unique among the linked brokers\n";
+        return false;
+    }
+
+    return true;
+}
+
 int main(int param_count, char* param_values[]) {
     // Check command-line arguments
-    if (param_count != 2) {
-        std::cerr << "Usage: " << param_values[0] << " <PORT>\n";
+    if (!parse_config(param_count, param_values)) {
+        std::cerr << "Usage: " << param_values[0] << " <PORT> [--stats-interval SEC] [--admin-socket PATH]"
+                  << " [--snapshot PATH] [--trace-latency] [--peer HOST:PORT]... [--node-id ID]"
+                  << " [--record PATH] [--rcvbuf BYTES] [--topic-priority PATTERN:CLASS]..."
+                  << " [--busy-poll CPU] [--multicast GROUP:PORT] [--multicast-fanout N]\n";
         return EXIT_FAILURE;
     }
 
     // Disable output buffering for immediate console output
     setvbuf(stdout, nullptr, _IONBF, 0);
 
-    // Parse and validate port number
-    char* end_ptr;
-    const long port_num = strtol(param_values[1], &end_ptr, 10);
-    if (*end_ptr != '\0' || port_num < 1024 || port_num > 65535) {
-        std::cerr << "Invalid port number\n";
-        return EXIT_FAILURE;
+    // Every subscriber costs a descriptor: allow as many as the hard limit
+    struct rlimit fd_limit;
+    if (getrlimit(RLIMIT_NOFILE, &fd_limit) == 0) {
+        fd_limit.rlim_cur = fd_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &fd_limit);
     }
 
     int tcp_sock, udp_sock;
     try {
         // Set up TCP and UDP sockets
-        configure_socket(tcp_sock, SOCK_STREAM, port_num);
-        configure_socket(udp_sock, SOCK_DGRAM, port_num);
+        configure_socket(tcp_sock, SOCK_STREAM, config.port);
+        configure_socket(udp_sock, SOCK_DGRAM, config.port);
+        
+        // Have the kernel timestamp every datagram it queues
+        int enable = 1;
+        DIE(config.trace_latency &&
+            setsockopt(udp_sock, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable)) < 0,
+            "setsockopt(SO_TIMESTAMPNS) failed");
         
         // Run the server
         server(tcp_sock, udp_sock);
@@ -478,4 +1425,4 @@ int main(int param_count, char* param_values[]) {
     }
 
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
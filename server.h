@@ -2,49 +2,329 @@
 #define SERVER_H
 
 #include "common.h"
+#include "metrics.h"
+#include "topic.h"
+#include "shm_ring.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 
 #include <algorithm>
+#include <deque>
+#include <map>
 #include <set>
+#include <string_view>
 #include <unordered_map>
 
+/**
+ * @brief Size of the UDP source header (IP + port) in front of each datagram
+ */
+#define SOURCE_HEADER_SIZE 6
+
+/**
+ * @brief Largest UDP datagram accepted (a full jumbo frame)
+ */
+#define UDP_DATAGRAM_MAX 9000
+
+/**
+ * @brief Pause between attempts to write into a full shared-memory ring
+ */
+#define SHM_FULL_WAIT_US 100
+
+/**
+ * @brief Rings offered and not claimed yet, past which expired offers are dropped
+ */
+#define SHM_OFFERS_MAX 64
+
+/**
+ * @brief Time a subscriber has to claim the ring it offered, with its CONNECT
+ */
+#define SHM_OFFER_TTL_MS 1000
+
+/**
+ * @brief Smallest record: the 50 byte topic field and the type byte
+ */
+#define UDP_RECORD_MIN 51
+
+/**
+ * @brief Magic bytes that open a batched datagram
+ *
+ * A plain datagram starts with its topic, and no topic starts with 0xFF
+ * followed by a NUL byte, so the two formats cannot be confused.
+ */
+#define UDP_BATCH_MAGIC "\xff\0B1"
+
+/**
+ * @brief Batch header: the 4 magic bytes and a 16 bit record count
+ *
+ * Each record follows as a 16 bit length and the record itself (topic
+ * field, type byte, payload), all integers in network byte order.
+ */
+#define UDP_BATCH_HEADER_SIZE 6
+
+/**
+ * @brief Room for the control messages of one datagram: receive timestamp and drop count
+ */
+#define UDP_CONTROL_SIZE (CMSG_SPACE(sizeof(struct timespec)) + CMSG_SPACE(sizeof(uint32_t)))
+
+/**
+ * @brief Datagrams taken by one recvmmsg call in busy-poll mode
+ */
+#define UDP_RECV_BURST 32
+
+/**
+ * @brief SO_BUSY_POLL budget of the UDP socket in busy-poll mode (microseconds)
+ */
+#define BUSY_POLL_US 50
+
+/**
+ * @brief Descriptors the poll set has room for before it first grows, in busy-poll mode
+ */
+#define BUSY_POLL_FDS 4096
+
+/**
+ * @brief Reference counted message, laid out exactly as it goes on the wire
+ *
+ * The length prefix is directly followed by the buffer, so one send of
+ * sizeof(int) + len bytes starting at &len transmits the whole frame.
+ */
 struct stored_message_t {
-    int c;
-    int len;
-    std::string buff;
+    uint64_t seq;       ///< Sequence number assigned when the message was routed
+    int c;              ///< Number of SF queues holding the message
+    int len;            ///< Length of buff: source header + datagram
+    char buff[];        ///< Source IP (4 bytes), source port (2 bytes), datagram
 };
 
+static_assert(offsetof(stored_message_t, buff) == offsetof(stored_message_t, len) + sizeof(int),
+              "the frame length must directly precede the frame bytes");
+
+/**
+ * @brief Buffers of one recvmmsg call, set up once in busy-poll mode
+ *
+ * Each header points at its own message block, so every datagram of a
+ * burst lands after the source header headroom, as in the one-datagram path.
+ */
+struct udp_burst_t {
+    struct mmsghdr headers[UDP_RECV_BURST];
+    struct iovec iov[UDP_RECV_BURST];
+    sockaddr_in from[UDP_RECV_BURST];
+    char control[UDP_RECV_BURST][UDP_CONTROL_SIZE];
+    stored_message_t* blocks[UDP_RECV_BURST];
+};
+
+struct topic_set_t;
+struct topic_set_table_t;
+struct compress_stream_t;
+struct compressor_t;
+struct multicaster_t;
+
+/**
+ * @brief Positions kept inside the client; larger pattern sets spill to the heap
+ */
+#define POSITIONS_INLINE 4
+
+// Index of a client in the subscribers of each of its patterns, in the set's
+// order. The count is the size of the client's topic set, so it is not stored.
+union positions_t {
+    uint32_t local[POSITIONS_INLINE];
+    uint32_t *spill;
+};
+
+// Kept small: a server holds one per client ever seen, most of them offline
 struct tcp_client_t {
-    int fd;
-    std::string id;
+    char id[11];            // Client ID, NUL-terminated; the clients map keys point into it
     bool connected;
-    std::map<std::string, bool> topics;
-    std::vector<stored_message_t *> lost_messages;
+    bool multicast = false; // Joined the multicast group: hot messages reach it there
+    bool routed = false;    // Already a recipient of the message being routed
+    int fd;
+    uint32_t flags = 0;     // CONNECT_* options of the current connection
+    shm_writer_t* ring = nullptr;  // Shared-memory ring of a CONNECT_SHM client
+    const topic_set_t* topics = nullptr;  // Subscriptions and SF flags, shared with identical clients (nullptr = none)
+    positions_t positions;  // Index in the subscribers of each pattern of topics (see positions_at)
+    compress_stream_t* stream = nullptr;  // Compressed output of a CONNECT_COMPRESS client while connected
+    std::vector<stored_message_t *> lost_messages;  // SF backlog; CONNECT_SEQ clients keep messages until acknowledged
 };
 
+/**
+ * @brief A subscription pattern, its compiled matcher and its subscribers
+ */
+struct subscription_t {
+    std::string pattern;                    ///< Pattern as sent by the clients
+    topic_matcher_t matcher;                ///< Matcher specialized for the pattern shape
+    std::vector<tcp_client_t*> subscribers; ///< Clients subscribed to the pattern, in no particular order
+    uint32_t local_subscribers = 0;         ///< Subscribers that are not peer brokers
+};
+
+struct admin_conn_t;
+struct peer_link_t;
+struct capture_writer_t;
+struct overload_t;
+struct aggregator_t;
+
 // Define a struct to hold all server state
 struct ServerState {
-    std::map<std::string, tcp_client_t*> clients;  // Maps client IDs to client info
-    std::map<std::string, std::vector<tcp_client_t*>> subscriptions;  // Maps topics to subscribers
-    std::map<int, std::pair<in_addr, uint16_t>> client_addresses;  // Maps socket FDs to client network info
+    std::unordered_map<std::string_view, tcp_client_t*> clients;  // Maps client IDs (viewing tcp_client_t::id) to client info
+    std::deque<tcp_client_t> client_list;  // Every client, in registration order (never shrinks, so addresses are stable)
+    std::unordered_map<int, tcp_client_t*> fd_clients;  // Maps connected socket FDs to their client
+    std::map<std::string, subscription_t> subscriptions;  // Maps patterns to their subscription
+    std::unordered_map<std::string_view, subscription_t*> exact_subscriptions;  // Wildcard-free patterns, looked up by topic
+    std::vector<subscription_t*> wildcard_subscriptions;  // Patterns that have to be evaluated per topic
+    std::unordered_map<int, std::pair<in_addr, uint16_t>> client_addresses;  // Maps socket FDs to client network info
+    std::unordered_map<int, admin_conn_t*> admin_conns;  // Maps admin socket FDs to their sessions
+    std::vector<peer_link_t*> peer_links;  // Outgoing links to the other brokers
+    std::unordered_map<int, peer_link_t*> peer_fds;  // Maps link socket FDs to their link
+    stored_message_t* rx_message = nullptr;  // Block the next UDP datagram is received into
+    stored_message_t* record_message = nullptr;  // Block the records of a batch are framed in
+    udp_burst_t* rx_burst = nullptr;  // Blocks a burst of datagrams is received into (busy-poll mode)
+    aggregator_t* aggregates = nullptr;  // Aggregate subscriptions and open windows (nullptr until the first one)
+    uint64_t last_seq = 0;  // Sequence number of the last routed message
+    std::vector<tcp_client_t*> recipients;  // Connected recipients of the message or aggregate being sent (reused)
+    capture_writer_t* capture = nullptr;  // Writer of the --record capture file
+    overload_t* overload = nullptr;  // Overload detection and shedding of the UDP socket
+    topic_set_table_t* topic_sets = nullptr;  // Interned client subscription sets
+    compressor_t* compression = nullptr;  // Streams of CONNECT_COMPRESS clients (nullptr until the first one)
+    multicaster_t* multicast = nullptr;  // Multicast group and repair history (nullptr without --multicast)
+    int ring_fd = -1;  // Socket rings are offered on (-1 if its name was taken)
+    std::unordered_map<std::string, std::pair<int, uint64_t>> ring_offers;  // Offered ring fds and their expiry, by token
 };
 
 /**
- * @brief Append binary data to a string
- * 
- * @param str String to append to
- * @param data Data to append
- * @param len Length of data
+ * @brief Options given on the server command line
  */
-void append_binary_data(std::string& str, const void* data, size_t len);
+struct server_config_t {
+    uint16_t port;              ///< TCP and UDP port
+    int stats_interval;         ///< Seconds between JSON stats lines on stderr (0 = never)
+    const char *admin_socket;   ///< Path of the UNIX admin socket (nullptr = disabled)
+    const char *snapshot;       ///< Snapshot loaded at startup and written on exit (nullptr = none)
+    bool trace_latency;         ///< Stamp messages for clients that connect with CONNECT_TRACE
+    const char *node_id;        ///< Client ID this broker registers with on its peers
+    std::vector<const char*> peers;         ///< Peer brokers (HOST:PORT)
+    std::vector<sockaddr_in> peer_addrs;    ///< Resolved addresses of the peers
+    const char *record;         ///< Capture file for incoming datagrams (nullptr = none)
+    int rcvbuf;                 ///< UDP receive buffer size in bytes (0 = system default)
+    std::vector<std::pair<std::string, int>> topic_priorities;  ///< PATTERN:CLASS shedding rules
+    bool busy_poll;             ///< Spin instead of sleeping in poll()
+    int busy_poll_cpu;          ///< CPU the spinning loop is pinned to
+    bool multicast;             ///< Multicast messages of wide fan-out
+    sockaddr_in multicast_group;  ///< Group and port they are sent to
+    int multicast_fanout;       ///< Joined recipients from which a message is multicast
+};
+
+extern server_config_t config;
 
 /**
- * @brief Check if a topic matches a pattern with wildcards
+ * @brief Allocate a message with room for len frame bytes
  * 
- * @param topic The actual topic string
- * @param pattern The pattern with possible wildcards
- * @return true if the topic matches the pattern
+ * @param len Length of the frame (source header + datagram)
+ * @return stored_message_t* Message with a zero reference count (release with free())
+ */
+stored_message_t* message_alloc(int len);
+
+/**
+ * @brief Find the subscription for a pattern, creating and indexing it if needed
+ *
+ * The pattern is compiled once here. Exact patterns go into the hash index;
+ * all others join the list evaluated for every message.
+ *
+ * @param state Server state
+ * @param pattern Subscription pattern
+ * @return subscription_t* The subscription (lives as long as the server state)
+ */
+subscription_t* subscription_get(ServerState& state, const std::string& pattern);
+
+/**
+ * @brief Add a subscriber to a subscription
+ *
+ * The first local (non-peer) subscriber of a pattern subscribes the peer
+ * brokers to it.
+ *
+ * @param state Server state
+ * @param subscription Subscription to join
+ * @param client New subscriber (not yet in the list)
+ * @return uint32_t Index of the client in subscription->subscribers, for tcp_client_t::positions
+ */
+uint32_t subscription_attach(ServerState& state, subscription_t* subscription, tcp_client_t* client);
+
+/**
+ * @brief The positions of a client with count patterns
+ */
+inline uint32_t* positions_at(positions_t& positions, size_t count) {
+    return count <= POSITIONS_INLINE ? positions.local : positions.spill;
+}
+
+/**
+ * @brief Insert a position, spilling to the heap past POSITIONS_INLINE
+ *
+ * @param positions Positions of the client
+ * @param count Number of positions before the insertion
+ * @param index Where the new one goes
+ * @param position Value to insert
+ */
+void positions_insert(positions_t& positions, size_t count, size_t index, uint32_t position);
+
+/**
+ * @brief Remove a position, moving back inline at POSITIONS_INLINE
+ *
+ * @param positions Positions of the client
+ * @param count Number of positions before the removal
+ * @param index Position to remove
  */
-bool topic_matches_pattern(const std::string& topic, const std::string& pattern);
+void positions_erase(positions_t& positions, size_t count, size_t index);
+
+/**
+ * @brief Release the positions of a client, leaving none
+ */
+void positions_clear(positions_t& positions, size_t count);
+
+/**
+ * @brief Remove a subscriber from a subscription, in constant time
+ *
+ * The last subscriber of the list takes the place of the removed one, and
+ * its own entry in tcp_client_t::positions is updated. The last local
+ * subscriber of a pattern unsubscribes the peer brokers.
+ *
+ * @param state Server state
+ * @param subscription Subscription to leave
+ * @param client Subscriber to remove
+ * @param position Index of the client in subscription->subscribers
+ */
+void subscription_detach(ServerState& state, subscription_t* subscription, tcp_client_t* client,
+                         uint32_t position);
+
+/**
+ * @brief Whether a TCP connection comes from this host
+ *
+ * A peer on this host connects from the address it was accepted on
+ * (loopback, or the host's own address).
+ */
+bool same_host(int fd);
+
+/**
+ * @brief Hand a message to a connected client, over TCP or its ring
+ *
+ * @param client Recipient
+ * @param message Frame to send
+ * @param trace Stamps taken so far, or nullptr when tracing is off
+ * @param matched_ns Time matching finished (traced clients only)
+ * @return size_t Bytes of the frame, header included
+ */
+size_t client_send(tcp_client_t* client, stored_message_t* message,
+                   const trace_stamps_t* trace, uint64_t matched_ns);
+
+/**
+ * @brief Deliver one framed message to every matching subscriber
+ *
+ * @param message Frame to deliver (source header + datagram); may be reused afterwards
+ * @param state Server state
+ * @param metrics Metrics of the calling thread
+ * @param trace Stamps taken so far, or nullptr when tracing is off
+ * @param from_peer The message came over a peer link: deliver it to local clients only
+ */
+void route_message(stored_message_t* message, ServerState& state, metrics_t& metrics,
+                   const trace_stamps_t* trace, bool from_peer);
 
 /**
  * @brief Handle a new TCP connection
@@ -57,12 +337,27 @@ void handle_new_connection(int listenfd, ServerState& state, std::vector<struct
 
 /**
  * @brief Process a UDP message
+ *
+ * Plain datagrams are routed as they are; batched datagrams are split
+ * and each of their records is routed as if it had arrived on its own.
  * 
  * @param udp_fd UDP socket file descriptor
  * @param state Server state
  */
 void process_udp_message(int udp_fd, ServerState& state);
 
+/**
+ * @brief Route every datagram already queued on the UDP socket, up to a burst
+ *
+ * Used in busy-poll mode: a single non-blocking recvmmsg takes up to
+ * UDP_RECV_BURST datagrams into the preallocated burst buffers.
+ *
+ * @param udp_fd UDP socket file descriptor
+ * @param state Server state (rx_burst set up)
+ * @return int Number of datagrams received (0 if none was queued)
+ */
+int process_udp_burst(int udp_fd, ServerState& state);
+
 /**
  * @brief Handle a server command
  * 
@@ -111,4 +406,13 @@ void server(int listenfd, int udp_cli_fd);
  */
 void configure_socket(int& sock, int type, uint16_t port);
 
+/**
+ * @brief Parse the command line into the global config
+ * 
+ * @param argc Argument count
+ * @param argv Argument values
+ * @return true if the arguments are valid
+ */
+bool parse_config(int argc, char* argv[]);
+
 #endif // SERVER_H
\ No newline at end of file
@@ -0,0 +1,158 @@
+#include "shm_ring.h"
+
+#include <sys/stat.h>
+#include <algorithm>
+
+shm_ring_t *shm_ring_create(uint32_t size, int &fd) {
+    fd = memfd_create("pcom-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0)
+        return nullptr;
+
+    size_t total = sizeof(shm_ring_t) + size;
+    void *map = MAP_FAILED;
+    if (ftruncate(fd, total) == 0 && fcntl(fd, F_ADD_SEALS, SHM_RING_SEALS | F_SEAL_SEAL) == 0)
+        map = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        fd = -1;
+        return nullptr;
+    }
+
+    // The new mapping is zero filled: counters start at 0, idle is clear
+    shm_ring_t *ring = (shm_ring_t*)map;
+    ring->size = size;
+    std::atomic_thread_fence(std::memory_order_release);
+    ring->magic = SHM_RING_MAGIC;
+    return ring;
+}
+
+socklen_t shm_ring_address(sockaddr_un &addr, uint16_t port) {
+    addr = {};
+    addr.sun_family = AF_UNIX;
+    int len = snprintf(addr.sun_path + 1, sizeof(addr.sun_path) - 1, "pcom-ring-%u", port);
+    return offsetof(sockaddr_un, sun_path) + 1 + len;
+}
+
+bool shm_ring_offer(int fd, uint16_t port, const uint8_t *token) {
+    int sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return false;
+
+    sockaddr_un addr;
+    socklen_t addr_len = shm_ring_address(addr, port);
+    struct iovec iov = {(void*)token, SHM_TOKEN_SIZE};
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } control = {};
+    struct msghdr msg = {};
+    msg.msg_name = &addr;
+    msg.msg_namelen = addr_len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    bool sent = sendmsg(sock, &msg, 0) == (ssize_t)SHM_TOKEN_SIZE;
+    close(sock);
+    return sent;
+}
+
+shm_writer_t *shm_ring_attach(int fd) {
+    // Without the seals, the subscriber could shrink the object under the
+    // mapping, and the next write would fault
+    int seals = fcntl(fd, F_GET_SEALS);
+    if (seals < 0 || (seals & SHM_RING_SEALS) != SHM_RING_SEALS)
+        return nullptr;
+
+    struct stat st;
+    shm_ring_t *ring = nullptr;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(shm_ring_t) &&
+        (size_t)st.st_size <= sizeof(shm_ring_t) + UINT32_MAX) {
+        void *map = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED)
+            ring = (shm_ring_t*)map;
+    }
+    if (!ring)
+        return nullptr;
+
+    // Only trust a size that matches the mapping, and only this once
+    uint32_t size = ring->size;
+    if (ring->magic != SHM_RING_MAGIC || size == 0 || (size & (size - 1)) != 0 ||
+        sizeof(shm_ring_t) + size != (size_t)st.st_size) {
+        munmap(ring, st.st_size);
+        return nullptr;
+    }
+
+    shm_writer_t *writer = new shm_writer_t{ring, (size_t)st.st_size, size, 0};
+    ring->head.store(0, std::memory_order_release);
+    return writer;
+}
+
+void shm_writer_detach(shm_writer_t *writer) {
+    if (writer) {
+        munmap(writer->shared, writer->map_len);
+        delete writer;
+    }
+}
+
+void shm_ring_detach(shm_ring_t *ring) {
+    if (ring)
+        munmap(ring, sizeof(shm_ring_t) + ring->size);
+}
+
+// Copy into the ring at a position, wrapping around the end
+static void ring_copy_in(char *data, uint32_t size, uint64_t pos, const void *src, size_t len) {
+    size_t offset = pos & (size - 1);
+    size_t first = std::min(len, (size_t)size - offset);
+    memcpy(data + offset, src, first);
+    memcpy(data, (const char*)src + first, len - first);
+}
+
+static void ring_copy_out(const shm_ring_t *ring, uint64_t pos, void *dst, size_t len) {
+    size_t offset = pos & (ring->size - 1);
+    size_t first = std::min(len, (size_t)ring->size - offset);
+    memcpy(dst, ring->data + offset, first);
+    memcpy((char*)dst + first, ring->data, len - first);
+}
+
+int shm_ring_write(shm_writer_t *writer, const struct iovec *parts, int count) {
+    // tail comes from the subscriber: anything outside [head - size, head] is corrupt
+    uint64_t head = writer->head;
+    uint64_t tail = writer->shared->tail.load(std::memory_order_acquire);
+    if (tail > head || head - tail > writer->size)
+        return -1;
+
+    size_t total = 0;
+    for (int i = 0; i < count; ++i)
+        total += parts[i].iov_len;
+    if (writer->size - (head - tail) < total)
+        return 0;
+
+    for (int i = 0; i < count; ++i) {
+        ring_copy_in(writer->shared->data, writer->size, head, parts[i].iov_base, parts[i].iov_len);
+        head += parts[i].iov_len;
+    }
+    writer->head = head;
+    writer->shared->head.store(head, std::memory_order_release);
+    return 1;
+}
+
+bool shm_ring_read(shm_ring_t *ring, int& header, std::string& body) {
+    uint64_t head = ring->head.load(std::memory_order_acquire);
+    uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+    if (head - tail < sizeof(header))
+        return false;
+
+    ring_copy_out(ring, tail, &header, sizeof(header));
+    size_t len = header & FRAME_LEN_MASK;
+    body.resize(len);
+    ring_copy_out(ring, tail + sizeof(header), &body[0], len);
+    ring->tail.store(tail + sizeof(header) + len, std::memory_order_release);
+    return true;
+}
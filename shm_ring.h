@@ -0,0 +1,144 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include "common.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <atomic>
+
+/**
+ * @brief "PCSH": marks an initialized ring
+ */
+#define SHM_RING_MAGIC 0x48534350
+
+/**
+ * @brief Data capacity of the rings created by subscribers (a power of two)
+ */
+#define SHM_RING_SIZE (4 << 20)
+
+/**
+ * @brief Size of the random token a ring is offered under
+ */
+#define SHM_TOKEN_SIZE sizeof(connect_t::ring_token)
+
+/**
+ * @brief Seals a ring must carry: its size is fixed for good
+ */
+#define SHM_RING_SEALS (F_SEAL_SHRINK | F_SEAL_GROW)
+
+/**
+ * @brief Single-producer single-consumer byte ring in a shared mapping
+ *
+ * The server appends whole frames, laid out exactly as on the TCP stream,
+ * and publishes them by advancing head; the subscriber consumes them and
+ * advances tail. Both counters only grow; positions are taken modulo size.
+ */
+struct shm_ring_t {
+    uint32_t magic;                             ///< SHM_RING_MAGIC
+    uint32_t size;                              ///< Capacity of data, a power of two
+    alignas(64) std::atomic<uint64_t> head;     ///< Bytes written (server)
+    alignas(64) std::atomic<uint64_t> tail;     ///< Bytes consumed (subscriber)
+    alignas(64) std::atomic<uint32_t> idle;     ///< Reader is about to sleep and wants a doorbell
+    alignas(64) char data[];                    ///< Frame bytes
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "ring counters must be lock-free");
+
+/**
+ * @brief Create, size, seal and map a new ring (subscriber side)
+ *
+ * The ring is an anonymous memfd sealed with SHM_RING_SEALS, so the server
+ * can map it without fearing that it shrinks under the mapping.
+ *
+ * @param size Data capacity, a power of two
+ * @param fd Set to the descriptor of the ring, to be offered to the server
+ * @return shm_ring_t* Mapped ring, or nullptr on failure
+ */
+shm_ring_t *shm_ring_create(uint32_t size, int &fd);
+
+/**
+ * @brief Address of the datagram socket a server takes rings on
+ *
+ * An abstract Unix socket named after the server's TCP port, so it is
+ * only reachable from the server's host.
+ *
+ * @param addr Filled with the address
+ * @param port TCP port of the server
+ * @return socklen_t Length of the address
+ */
+socklen_t shm_ring_address(sockaddr_un &addr, uint16_t port);
+
+/**
+ * @brief Hand a ring to the server, under a token its CONNECT will repeat
+ *
+ * @param fd Descriptor of the ring (the server gets its own copy)
+ * @param port TCP port of the server
+ * @param token Random token
+ * @return true if the server's socket took it
+ */
+bool shm_ring_offer(int fd, uint16_t port, const uint8_t *token);
+
+/**
+ * @brief Server-side handle of a ring mapped from a subscriber
+ *
+ * The subscriber can write anything into the shared header at any time,
+ * so the capacity, the mapping length and the write position are kept
+ * here, the size checked once at attach time. Only tail is read back from
+ * the mapping, and it is checked on every write.
+ */
+struct shm_writer_t {
+    shm_ring_t *shared;         ///< Mapping shared with the subscriber
+    size_t map_len;             ///< Length of the mapping
+    uint32_t size;              ///< Capacity of data
+    uint64_t head;              ///< Bytes written; shared->head is only a copy for the reader
+};
+
+/**
+ * @brief Map a ring handed over by a subscriber (server side)
+ *
+ * @param fd Descriptor received from the subscriber (left open)
+ * @return shm_writer_t* Handle of the mapped ring, or nullptr if unsealed or malformed
+ */
+shm_writer_t *shm_ring_attach(int fd);
+
+/**
+ * @brief Unmap a ring the server attached to and free its handle
+ */
+void shm_writer_detach(shm_writer_t *writer);
+
+/**
+ * @brief Unmap a ring (subscriber side)
+ */
+void shm_ring_detach(shm_ring_t *ring);
+
+/**
+ * @brief Append one frame gathered from several parts
+ *
+ * @param writer Ring to write to
+ * @param parts Frame parts, written back to back
+ * @param count Number of parts
+ * @return int 1 if written, 0 if the ring is too full, -1 if the ring is corrupt
+ */
+int shm_ring_write(shm_writer_t *writer, const struct iovec *parts, int count);
+
+/**
+ * @brief Take the next frame, if any
+ *
+ * @param ring Ring to read from
+ * @param header Length word of the frame (flags included)
+ * @param body Filled with the frame body
+ * @return true if a frame was taken
+ */
+bool shm_ring_read(shm_ring_t *ring, int& header, std::string& body);
+
+/**
+ * @brief Whether frames are waiting to be read
+ */
+inline bool shm_ring_pending(const shm_ring_t *ring) {
+    return ring->head.load(std::memory_order_acquire) != ring->tail.load(std::memory_order_relaxed);
+}
+
+#endif // SHM_RING_H
@@ -0,0 +1,252 @@
+#include "snapshot.h"
+#include "topic_set.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <string_view>
+
+// Buffered writer that remembers the first failure
+struct snapshot_writer_t {
+    FILE *file;
+    bool ok;
+    uint64_t size;
+
+    void put(const void *data, size_t len) {
+        if (ok && fwrite(data, 1, len, file) != len)
+            ok = false;
+        size += len;
+    }
+
+    template <typename T> void put_value(T value) {
+        put(&value, sizeof(value));
+    }
+};
+
+// Bounds-checked cursor over the mapped file
+struct snapshot_reader_t {
+    const char *pos;
+    const char *end;
+    bool ok;
+
+    const char *take(size_t len) {
+        if (!ok || (size_t)(end - pos) < len) {
+            ok = false;
+            return nullptr;
+        }
+        const char *p = pos;
+        pos += len;
+        return p;
+    }
+
+    template <typename T> T take_value() {
+        T value{};
+        const char *p = take(sizeof(T));
+        if (p)
+            memcpy(&value, p, sizeof(T));
+        return value;
+    }
+};
+
+bool snapshot_save(const char *path, const ServerState& state) {
+    std::string tmp_path = std::string(path) + ".tmp";
+    FILE *file = fopen(tmp_path.c_str(), "wb");
+    if (!file) {
+        perror("snapshot fopen");
+        return false;
+    }
+    setvbuf(file, nullptr, _IOFBF, 1 << 20);
+
+    // Peer brokers register again when they relink, so they are not saved
+    std::vector<const tcp_client_t*> clients;
+    clients.reserve(state.client_list.size());
+    for (const auto& client : state.client_list) {
+        if (!(client.flags & CONNECT_PEER))
+            clients.push_back(&client);
+    }
+
+    // Number the distinct stored messages, in the order they are first seen
+    std::unordered_map<const stored_message_t*, uint32_t> message_index;
+    std::vector<const stored_message_t*> messages;
+    for (const auto* client : clients) {
+        for (const auto* msg : client->lost_messages) {
+            if (message_index.emplace(msg, messages.size()).second)
+                messages.push_back(msg);
+        }
+    }
+
+    snapshot_header_t header = {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.messages = messages.size();
+    header.clients = clients.size();
+    header.last_seq = state.last_seq;
+
+    snapshot_writer_t out = {file, true, 0};
+    out.put(&header, sizeof(header));
+
+    for (const auto* msg : messages) {
+        out.put_value<uint64_t>(msg->seq);
+        out.put_value<uint32_t>(msg->len);
+        out.put(msg->buff, msg->len);
+    }
+
+    for (const auto* client : clients) {
+        char id_field[11] = {};
+        strncpy(id_field, client->id, sizeof(id_field) - 1);
+        out.put(id_field, sizeof(id_field));
+        out.put_value<uint32_t>(topic_set_size(client->topics));
+        out.put_value<uint32_t>(client->lost_messages.size());
+
+        for (size_t t = 0; t < topic_set_size(client->topics); ++t) {
+            const std::string& pattern = client->topics->patterns[t]->pattern;
+            out.put_value<uint8_t>(pattern.size());
+            out.put(pattern.data(), pattern.size());
+            out.put_value<uint8_t>(topic_set_sf(client->topics, t));
+        }
+        for (const auto* msg : client->lost_messages)
+            out.put_value<uint32_t>(message_index[msg]);
+    }
+
+    // Patch the final size into the header
+    header.size = out.size;
+    if (out.ok && (fseek(file, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, file) != 1))
+        out.ok = false;
+    if (fclose(file) != 0)
+        out.ok = false;
+
+    if (!out.ok || rename(tmp_path.c_str(), path) < 0) {
+        perror("snapshot write");
+        unlink(tmp_path.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+bool snapshot_load(const char *path, ServerState& state) {
+    uint64_t start_ns = monotonic_ns();
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        DIE(errno != ENOENT, "snapshot open() failed");
+        return false;
+    }
+
+    struct stat st;
+    DIE(fstat(fd, &st) < 0, "snapshot fstat() failed");
+    if ((size_t)st.st_size < sizeof(snapshot_header_t)) {
+        std::cerr << "Ignoring truncated snapshot " << path << "\n";
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    DIE(map == MAP_FAILED, "snapshot mmap() failed");
+    close(fd);
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    snapshot_reader_t in = {(const char*)map, (const char*)map + st.st_size, true};
+    snapshot_header_t header = in.take_value<snapshot_header_t>();
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SNAPSHOT_VERSION || header.size != (uint64_t)st.st_size) {
+        std::cerr << "Ignoring incompatible snapshot " << path << "\n";
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    state.last_seq = header.last_seq;
+    std::vector<stored_message_t*> messages;
+    messages.reserve(header.messages);
+    for (uint32_t i = 0; i < header.messages && in.ok; ++i) {
+        uint64_t seq = in.take_value<uint64_t>();
+        uint32_t len = in.take_value<uint32_t>();
+        const char *data = in.take(len);
+        if (!data)
+            break;
+
+        stored_message_t *msg = message_alloc(len);
+        msg->seq = seq;
+        memcpy(msg->buff, data, len);
+        messages.push_back(msg);
+    }
+
+    // Patterns repeat across clients: resolve each distinct one only once.
+    // The views point into the mapping, which outlives this function's use.
+    std::unordered_map<std::string_view, subscription_t*> pattern_lists;
+    uint64_t subscription_count = 0;
+    state.clients.reserve(header.clients);
+
+    for (uint32_t i = 0; i < header.clients && in.ok; ++i) {
+        const char *id_field = in.take(11);
+        uint32_t topic_count = in.take_value<uint32_t>();
+        uint32_t lost_count = in.take_value<uint32_t>();
+        if (!in.ok)
+            break;
+
+        tcp_client_t *client = &state.client_list.emplace_back();
+        client->fd = -1;
+        memcpy(client->id, id_field, 10);
+        client->id[10] = '\0';
+        client->connected = false;
+        state.clients.emplace(client->id, client);
+
+        // Clients with the same patterns and flags end up sharing one set
+        topic_set_t topics;
+        topics.patterns.reserve(topic_count);
+        topics.sf.assign((topic_count + 63) / 64, 0);
+
+        for (uint32_t t = 0; t < topic_count && in.ok; ++t) {
+            uint8_t len = in.take_value<uint8_t>();
+            const char *pattern = in.take(len);
+            bool sf = in.take_value<uint8_t>();
+            if (!in.ok)
+                break;
+
+            // Positions are stored in set order, which interning would change
+            // for patterns out of order or repeated: such a file is damaged
+            std::string_view key(pattern, len);
+            if (t > 0 && std::string_view(topics.patterns.back()->pattern) >= key) {
+                in.ok = false;
+                break;
+            }
+            auto it = pattern_lists.find(key);
+            if (it == pattern_lists.end())
+                it = pattern_lists.emplace(key, subscription_get(state, std::string(key))).first;
+            positions_insert(client->positions, t, t, subscription_attach(state, it->second, client));
+
+            // Appending in strict pattern order keeps the set sorted
+            topics.sf[t / 64] |= (uint64_t)sf << (t % 64);
+            topics.patterns.push_back(it->second);
+            subscription_count++;
+        }
+        client->topics = topic_set_intern(state, std::move(topics));
+
+        client->lost_messages.reserve(lost_count);
+        for (uint32_t m = 0; m < lost_count && in.ok; ++m) {
+            uint32_t idx = in.take_value<uint32_t>();
+            if (!in.ok || idx >= messages.size()) {
+                in.ok = false;
+                break;
+            }
+            messages[idx]->c++;
+            client->lost_messages.push_back(messages[idx]);
+        }
+        local_metrics().sf_stored.add(client->lost_messages.size());
+    }
+
+    // Messages no client refers to (only possible in a damaged file)
+    for (auto *msg : messages) {
+        if (msg->c == 0)
+            free(msg);
+    }
+
+    munmap(map, st.st_size);
+
+    if (!in.ok)
+        std::cerr << "Snapshot " << path << " is damaged, restored what could be read\n";
+
+    std::cout << "Restored " << state.clients.size() << " clients, " << subscription_count
+              << " subscriptions and " << messages.size() << " stored messages in "
+              << (monotonic_ns() - start_ns) / 1000000 << " ms.\n";
+    return true;
+}
@@ -0,0 +1,58 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "server.h"
+
+/**
+ * @brief Magic bytes at the start of a snapshot file
+ */
+#define SNAPSHOT_MAGIC "PCSNAP\r\n"
+
+/**
+ * @brief Version of the snapshot layout written by this build
+ */
+#define SNAPSHOT_VERSION 2
+
+/**
+ * @brief Fixed header of a snapshot file
+ *
+ * Followed by `messages` records (u64 sequence number, u32 length + bytes) and `clients`
+ * records: the 11 byte ID, u32 topic count, u32 backlog length, then each
+ * topic as u8 length + bytes + u8 SF flag and the backlog as u32 indices
+ * into the message records. All integers are in host byte order, the file
+ * is only meant to be read back on the same machine.
+ */
+struct snapshot_header_t {
+    char magic[8];
+    uint32_t version;
+    uint32_t messages;          ///< Distinct stored messages
+    uint32_t clients;           ///< Registered client IDs
+    uint32_t reserved;
+    uint64_t size;              ///< Total file size, to detect truncation
+    uint64_t last_seq;          ///< Sequence number of the last routed message
+};
+
+/**
+ * @brief Write clients, subscriptions and SF backlogs to a file
+ *
+ * The snapshot is written to PATH.tmp and renamed over PATH, so a crash
+ * never leaves a half written snapshot behind.
+ *
+ * @param path Snapshot file path
+ * @param state Server state
+ * @return true if the snapshot was written
+ */
+bool snapshot_save(const char *path, const ServerState& state);
+
+/**
+ * @brief Restore clients, subscriptions and SF backlogs from a file
+ *
+ * All restored clients start offline. A missing file is not an error.
+ *
+ * @param path Snapshot file path
+ * @param state Server state (expected to be empty)
+ * @return true if a snapshot was loaded
+ */
+bool snapshot_load(const char *path, ServerState& state);
+
+#endif // SNAPSHOT_H
@@ -1,5 +1,81 @@
 #include "subscriber.h"
 
+latency_trace_t *latency_trace = nullptr;
+shm_ring_t *delivery_ring = nullptr;
+lz_decoder_t *stream_decoder = nullptr;
+multicast_receiver_t *multicast_receiver = nullptr;
+uint8_t delivery_ring_token[SHM_TOKEN_SIZE];
+int seq_fd = -1;
+uint64_t last_seq = 0;
+
+// Sequence number the server was last told about
+static uint64_t acked_seq = 0;
+
+int seq_open(const char* path) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+
+    char text[32] = {};
+    if (pread(fd, text, sizeof(text) - 1, 0) > 0) {
+        last_seq = strtoull(text, nullptr, 10);
+    }
+    acked_seq = last_seq;
+    return fd;
+}
+
+void seq_checkpoint(int sockfd, const char* id) {
+    if (seq_fd < 0 || last_seq == acked_seq) {
+        return;
+    }
+
+    // Fixed width, so the file is overwritten in place
+    char text[32];
+    int len = snprintf(text, sizeof(text), "%020llu\n", (unsigned long long)last_seq);
+    if (pwrite(seq_fd, text, len, 0) != len) {
+        perror("Sequence file write");
+        return;  // Not acknowledged: the messages are replayed after a restart
+    }
+
+    tcp_request_t ack_req = {};
+    strcpy(ack_req.id, id);
+    ack_req.type = ACK;
+    ack_req.ack.seq = last_seq;
+    send_all(sockfd, &ack_req, sizeof(ack_req));
+    acked_seq = last_seq;
+}
+
+// Time between two stamps (clamped, clocks may step)
+static uint64_t stage(uint64_t from, uint64_t to) {
+    return to > from ? to - from : 0;
+}
+
+void latency_record(latency_trace_t& trace, const trace_stamps_t& stamps, uint64_t received_ns) {
+    uint64_t kernel_rx = be64toh(stamps.kernel_rx_ns);
+    uint64_t read = be64toh(stamps.read_ns);
+    uint64_t matched = be64toh(stamps.matched_ns);
+    uint64_t sent = be64toh(stamps.sent_ns);
+
+    // Without a kernel stamp the UDP queue time is unknown
+    if (kernel_rx) {
+        trace.udp_queue.record(stage(kernel_rx, read));
+    }
+    trace.matching.record(stage(read, matched));
+    trace.fanout.record(stage(matched, sent));
+    trace.delivery.record(stage(sent, received_ns));
+    trace.total.record(stage(kernel_rx ? kernel_rx : read, received_ns));
+}
+
+void latency_report(const latency_trace_t& trace, std::ostream& out) {
+    out << "Latency over " << trace.total.count.value.load() << " traced messages (ns):\n";
+    histogram_print(out, "udp_queue", histogram_summary(trace.udp_queue));
+    histogram_print(out, "matching", histogram_summary(trace.matching));
+    histogram_print(out, "fanout", histogram_summary(trace.fanout));
+    histogram_print(out, "delivery", histogram_summary(trace.delivery));
+    histogram_print(out, "total", histogram_summary(trace.total));
+}
+
 std::string recv_string(int sockfd, int len) {
     std::string result(len, '\0'); // Pre-allocate string with the right size
     int bytes_received = recv_all(sockfd, &result[0], len);
@@ -11,56 +87,334 @@ std::string recv_string(int sockfd, int len) {
     return result;
 }
 
-void send_connect_message(int sockfd, const char* id) {
+void send_connect_message(int sockfd, const char* id, uint32_t flags) {
     tcp_request_t connect_packet = {};
     strcpy(connect_packet.id, id);
     connect_packet.type = MESSAGE;
-    connect_packet.message = CONNECT;
+    connect_packet.connect.message = CONNECT;
+    connect_packet.connect.flags = flags;
+    if (flags & CONNECT_SHM) {
+        memcpy(connect_packet.connect.ring_token, delivery_ring_token, SHM_TOKEN_SIZE);
+    }
+    if (flags & CONNECT_SEQ) {
+        connect_packet.connect.resume_seq = last_seq;
+    }
     send_all(sockfd, &connect_packet, sizeof(connect_packet));
 }
 
-void handle_server_message(int sockfd, const char* id, bool& running) {
-    // First check message type with peek (without removing from socket buffer)
-    int msg_len = 0;
-    if (recv(sockfd, &msg_len, sizeof(msg_len), MSG_PEEK) <= 0) {
-        running = false;  // Server disconnected or error
-        return;
-    }
-    
-    // Determine message type by size - control messages have sizeof(tcp_request_t)
-    if (msg_len == sizeof(tcp_request_t)) {
-        tcp_request_t control_msg;
-        if (recv_all(sockfd, &control_msg, sizeof(control_msg)) <= 0) {
-            running = false;  // Error reading full message
+void handle_frame(int header, std::string& data, bool& running) {
+    // Control messages from the server carry a tcp_request_t
+    if (header & FRAME_CONTROL) {
+        tcp_request_t control_msg = {};
+        if (data.size() != sizeof(control_msg)) {
+            running = false;  // Malformed control message
             return;
         }
+        memcpy(&control_msg, data.data(), sizeof(control_msg));
         
         // Special handling for server shutdown notification
         if (control_msg.message == SHUTDOWN) {
             running = false;
+        }
+        return;
+    }
+    
+    // A doorbell only wakes the reader, the ring was drained before it
+    if (header & FRAME_DOORBELL) {
+        return;
+    }
+    
+    // Sequenced messages start with their number
+    uint64_t seq = 0;
+    if (header & FRAME_SEQ) {
+        if (data.size() < sizeof(seq)) {
             return;
         }
-        
-        // Process as data message (non-shutdown control message)
-        std::string data((char*)&control_msg, sizeof(control_msg));
-        parse_input(data);
-    } 
-    else {
-        // Regular length-prefixed data message
-        if (recv_all(sockfd, &msg_len, sizeof(msg_len)) <= 0) {
-            running = false;  // Error reading length prefix
+        memcpy(&seq, data.data(), sizeof(seq));
+        seq = be64toh(seq);
+        data.erase(0, sizeof(seq));
+    }
+    
+    // Traced messages start with the server's stamps
+    if (header & FRAME_TRACE) {
+        uint64_t received_ns = realtime_ns();
+        if (data.size() < sizeof(trace_stamps_t)) {
             return;
         }
-        
-        // Receive the actual message content based on length
-        std::string data = recv_string(sockfd, msg_len);
+        if (latency_trace) {
+            trace_stamps_t stamps;
+            memcpy(&stamps, data.data(), sizeof(stamps));
+            latency_record(*latency_trace, stamps, received_ns);
+        }
+        data.erase(0, sizeof(trace_stamps_t));
+    }
+    
+    // Process data (extract topic, data type, payload, etc.)
+    parse_input(data);
+    if (seq) {
+        last_seq = seq;
+    }
+}
+
+void handle_compressed(const std::string& data, bool& running) {
+    uint32_t raw_len;
+    if (!stream_decoder || data.size() < sizeof(raw_len)) {
+        running = false;
+        return;
+    }
+    memcpy(&raw_len, data.data(), sizeof(raw_len));
+    raw_len = ntohl(raw_len);
+    const char* block = lz_decompress(*stream_decoder, data.data() + sizeof(raw_len),
+                                      data.size() - sizeof(raw_len), raw_len);
+    if (!block) {
+        running = false;  // The stream cannot be followed past a corrupt block
+        return;
+    }
+
+    // The block holds whole frames, as they would have come over TCP
+    size_t pos = 0;
+    while (running && pos < raw_len) {
+        int header;
+        if (raw_len - pos < sizeof(header)) {
+            running = false;
+            return;
+        }
+        memcpy(&header, block + pos, sizeof(header));
+        size_t len = header & FRAME_LEN_MASK;
+        pos += sizeof(header);
+        if (len > raw_len - pos || (header & FRAME_COMPRESSED)) {
+            running = false;
+            return;
+        }
+        std::string frame(block + pos, len);
+        pos += len;
+        handle_frame(header, frame, running);
+    }
+}
+
+// Ask for the datagrams from..from+count again; older ones than the server keeps are given up
+static void send_nack(int sockfd, const char* id, uint64_t from, uint64_t count) {
+    multicast_receiver_t& receiver = *multicast_receiver;
+    if (count > MULTICAST_HISTORY) {
+        from += count - MULTICAST_HISTORY;
+        count = MULTICAST_HISTORY;
+    }
+    if (receiver.next_mseq > MULTICAST_HISTORY) {
+        receiver.missing.erase(receiver.missing.begin(),
+                               receiver.missing.lower_bound(receiver.next_mseq - MULTICAST_HISTORY));
+    }
+    for (uint64_t mseq = from; mseq < from + count; ++mseq) {
+        receiver.missing.insert(receiver.missing.end(), mseq);
+    }
+
+    tcp_request_t nack_req = {};
+    strcpy(nack_req.id, id);
+    nack_req.type = NACK;
+    nack_req.nack.from = from;
+    nack_req.nack.count = count;
+    send_all(sockfd, &nack_req, sizeof(nack_req));
+}
+
+// The group carries the hot topics of every member: keep what this client subscribed to
+static void multicast_deliver(const char* body, size_t len, bool& running) {
+    decoded_message_t message;
+    if (!message_decode(body, len, message)) {
+        return;
+    }
+    topic_view_t topic;
+    topic_view_init(topic, message.topic.data(), message.topic.size());
+    for (const auto& [pattern, matcher] : multicast_receiver->patterns) {
+        if (topic_matches(matcher, topic)) {
+            std::string data(body, len);
+            handle_frame(0, data, running);
+            return;
+        }
+    }
+}
+
+// Add a pattern to the multicast filter, or remove it
+static void filter_update(std::vector<std::pair<std::string, topic_matcher_t>>& patterns,
+                          const std::string& pattern, bool subscribed) {
+    auto it = std::find_if(patterns.begin(), patterns.end(),
+                           [&](const auto& entry) { return entry.first == pattern; });
+    if (subscribed && it == patterns.end()) {
+        patterns.emplace_back(pattern, topic_compile(pattern));
+    } else if (!subscribed && it != patterns.end()) {
+        patterns.erase(it);
+    }
+}
+
+// Datagrams are filtered by the same patterns as the server's
+static void multicast_subscription(const char* topic, bool subscribed) {
+    if (!multicast_receiver) {
+        return;
+    }
+    std::string pattern(topic, strnlen(topic, 50));
+    if (multicast_receiver->listing) {
+        multicast_receiver->changes.emplace_back(pattern, subscribed);
+    }
+    filter_update(multicast_receiver->patterns, pattern, subscribed);
+}
+
+void multicast_listed(const subscribe_t& subscription) {
+    if (multicast_receiver->listing) {
+        multicast_receiver->listed.emplace_back(subscription.topic, strnlen(subscription.topic, 50));
+    }
+}
+
+void multicast_notice(int sockfd, const char* id, const multicast_notice_t& notice) {
+    multicast_receiver_t& receiver = *multicast_receiver;
+    if (notice.message == MULTICAST_START) {
+        // The server listed its patterns when it read JOINED; what was sent after that comes on top
+        if (receiver.listing) {
+            receiver.patterns.clear();
+            for (const auto& pattern : receiver.listed) {
+                filter_update(receiver.patterns, pattern, true);
+            }
+            for (const auto& [pattern, subscribed] : receiver.changes) {
+                filter_update(receiver.patterns, pattern, subscribed);
+            }
+            receiver.listing = false;
+            receiver.listed.clear();
+            receiver.changes.clear();
+        }
+        receiver.started = true;
+        receiver.next_mseq = notice.mseq;
+        receiver.missing.clear();
+        return;
+    }
+    if (receiver.fd >= 0) {
+        return;
+    }
+
+    // The server sends through loopback, so the group is joined there
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return;
+    }
+    int reuse = 1, rcvbuf = 4 << 20;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    sockaddr_in group = {};
+    group.sin_family = AF_INET;
+    group.sin_addr.s_addr = notice.group;
+    group.sin_port = notice.port;
+    struct ip_mreq membership = {};
+    membership.imr_multiaddr.s_addr = notice.group;
+    membership.imr_interface.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (sockaddr*)&group, sizeof(group)) < 0 ||
+        setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0) {
+        std::cerr << "Cannot join the multicast group, staying on TCP\n";
+        close(fd);
+        return;
+    }
+    receiver.fd = fd;
+    receiver.buffer.resize(1 << 16);
+    receiver.listing = true;
+
+    tcp_request_t joined_req = {};
+    strcpy(joined_req.id, id);
+    joined_req.type = JOINED;
+    send_all(sockfd, &joined_req, sizeof(joined_req));
+}
+
+void multicast_receive(int sockfd, const char* id, bool& running) {
+    multicast_receiver_t& receiver = *multicast_receiver;
+    while (running) {
+        ssize_t len = recv(receiver.fd, receiver.buffer.data(), receiver.buffer.size(), MSG_DONTWAIT);
+        if (len < 0) {
+            return;  // Drained
+        }
+        uint64_t mseq;
+        if (!receiver.started || len < (ssize_t)sizeof(mseq)) {
+            continue;  // Before the start, everything came over TCP
+        }
+        memcpy(&mseq, receiver.buffer.data(), sizeof(mseq));
+        mseq = be64toh(mseq);
+        const char* body = receiver.buffer.data() + sizeof(mseq);
+        size_t body_len = len - sizeof(mseq);
+
+        // A bare number announces the last datagram sent
+        if (body_len == 0) {
+            if (mseq >= receiver.next_mseq) {
+                send_nack(sockfd, id, receiver.next_mseq, mseq - receiver.next_mseq + 1);
+                receiver.next_mseq = mseq + 1;
+            }
+            continue;
+        }
+
+        if (mseq >= receiver.next_mseq) {
+            if (mseq > receiver.next_mseq) {
+                send_nack(sockfd, id, receiver.next_mseq, mseq - receiver.next_mseq);
+            }
+            receiver.next_mseq = mseq + 1;
+        } else if (!receiver.missing.erase(mseq)) {
+            continue;  // Already taken, or sent before the start
+        }
+        multicast_deliver(body, body_len, running);
+    }
+}
+
+void multicast_repaired(const std::string& data, bool& running) {
+    uint64_t mseq;
+    if (!multicast_receiver || data.size() <= sizeof(mseq)) {
+        return;
+    }
+    memcpy(&mseq, data.data(), sizeof(mseq));
+    if (multicast_receiver->missing.erase(be64toh(mseq))) {
+        multicast_deliver(data.data() + sizeof(mseq), data.size() - sizeof(mseq), running);
+    }
+}
+
+void handle_server_message(int sockfd, const char* id, bool& running) {
+    // Every frame starts with its length, flags in the high byte
+    int header = 0;
+    if (recv_all(sockfd, &header, sizeof(header)) <= 0) {
+        running = false;  // Server disconnected or error
+        return;
+    }
+    int msg_len = header & FRAME_LEN_MASK;
+    
+    // Receive the actual message content based on length
+    std::string data;
+    if (msg_len > 0) {
+        data = recv_string(sockfd, msg_len);
         if (data.empty()) {
             running = false;  // Connection closed during receive
             return;
         }
-        
-        // Process data (extract topic, data type, payload, etc.)
-        parse_input(data);
+    }
+    
+    if (header & FRAME_COMPRESSED) {
+        handle_compressed(data, running);
+        return;
+    }
+    if (header & FRAME_REPAIR) {
+        multicast_repaired(data, running);
+        return;
+    }
+
+    // Multicast notices need the socket to answer on
+    tcp_request_t notice;
+    if ((header & FRAME_CONTROL) && multicast_receiver && data.size() == sizeof(notice)) {
+        memcpy(&notice, data.data(), sizeof(notice));
+        if (notice.type == SUBSCRIBE) {
+            multicast_listed(notice.subscribe);
+            return;
+        }
+        if (notice.message == MULTICAST_JOIN || notice.message == MULTICAST_START) {
+            multicast_notice(sockfd, id, notice.multicast);
+            return;
+        }
+    }
+    handle_frame(header, data, running);
+}
+
+void drain_ring(shm_ring_t* ring, bool& running) {
+    int header;
+    std::string data;
+    while (running && shm_ring_read(ring, header, data)) {
+        handle_frame(header, data, running);
     }
 }
 
@@ -94,6 +448,7 @@ bool process_user_command(const char* cmd, int argc, char** argv, int sockfd, co
         
         send_all(sockfd, &sub_req, sizeof(sub_req));
         std::cout << "Subscribed to topic" << argv[1] << "\n";
+        multicast_subscription(sub_req.subscribe.topic, true);
         return false;
     }
     
@@ -111,6 +466,24 @@ bool process_user_command(const char* cmd, int argc, char** argv, int sockfd, co
         
         send_all(sockfd, &unsub_req, sizeof(unsub_req));
         std::cout << "Unsubscribed from topic" << argv[1] << "\n";
+        multicast_subscription(unsub_req.subscribe.topic, false);
+        return false;
+    }
+
+    // Handle aggregate command - one min/max/avg message per window instead of every value
+    if (strcmp(cmd, "aggregate") == 0) {
+        if (argc != 3 || strlen(argv[1]) >= sizeof(aggregate_t::topic)) {
+            return false;
+        }
+
+        tcp_request_t agg_req = {};
+        strcpy(agg_req.id, id);
+        agg_req.type = AGGREGATE;
+        strcpy(agg_req.aggregate.topic, argv[1]);
+        agg_req.aggregate.window_ms = htonl(atoi(argv[2]));
+
+        send_all(sockfd, &agg_req, sizeof(agg_req));
+        std::cout << "Aggregating " << argv[1] << " every " << atoi(argv[2]) << " ms\n";
         return false;
     }
     return false;
@@ -126,7 +499,7 @@ void handle_user_input(int sockfd, const char* id, bool& running) {
     
     // Split input into command and arguments
     char* args[MESSAGES_SIZE];
-    int arg_count = string_to_argv(input_buffer, args);
+    int arg_count = string_to_argv(input_buffer, args, MESSAGES_SIZE);
     
     if (arg_count <= 0) {
         return;  // Empty input or parsing error
@@ -140,7 +513,11 @@ void handle_user_input(int sockfd, const char* id, bool& running) {
 
 void subscriber(int sockfd, char* id) {
     // Register with the server first
-    send_connect_message(sockfd, id);
+    send_connect_message(sockfd, id, (latency_trace ? CONNECT_TRACE : 0) |
+                                     (delivery_ring ? CONNECT_SHM : 0) |
+                                     (seq_fd >= 0 ? CONNECT_SEQ : 0) |
+                                     (stream_decoder ? CONNECT_COMPRESS : 0) |
+                                     (multicast_receiver ? CONNECT_MULTICAST : 0));
     
     // Set up I/O multiplexing with poll instead of select
     std::vector<struct pollfd> poll_set;
@@ -152,16 +529,41 @@ void subscriber(int sockfd, char* id) {
     // Main event loop
     bool running = true;
     while (running) {
+        // Everything handled so far is persisted and acknowledged at once
+        seq_checkpoint(sockfd, id);
+        
+        if (delivery_ring) {
+            // Ask for a doorbell before sleeping, then recheck the ring so a
+            // message written in between is not left waiting
+            delivery_ring->idle.store(1);
+            if (shm_ring_pending(delivery_ring)) {
+                delivery_ring->idle.store(0);
+                drain_ring(delivery_ring, running);
+                continue;
+            }
+        }
+        
+        // The group socket is watched once the server had the client join
+        if (multicast_receiver && multicast_receiver->fd >= 0 && poll_set.size() == 2) {
+            poll_set.push_back({.fd = multicast_receiver->fd, .events = POLLIN, .revents = 0});
+        }
+        
         // Wait for activity on any monitored file descriptor
         int active_fds = poll(poll_set.data(), poll_set.size(), -1);
         if (active_fds < 0) {
             break;  // Error in poll
         }
         
+        // Ring messages were written before anything that follows on TCP
+        if (delivery_ring) {
+            delivery_ring->idle.store(0);
+            drain_ring(delivery_ring, running);
+        }
+        
         // Process events on monitored descriptors
         for (const auto& pfd : poll_set) {
             // Skip if no relevant events
-            if (!(pfd.revents & POLLIN)) {
+            if (!running || !(pfd.revents & POLLIN)) {
                 continue;
             }
             
@@ -170,6 +572,10 @@ void subscriber(int sockfd, char* id) {
                 // Server sent a message
                 handle_server_message(sockfd, id, running);
             } 
+            else if (multicast_receiver && pfd.fd == multicast_receiver->fd) {
+                // Datagrams from the multicast group
+                multicast_receive(sockfd, id, running);
+            } 
             else if (pfd.fd == STDIN_FILENO) {
                 // User typed a command
                 handle_user_input(sockfd, id, running);
@@ -213,28 +619,453 @@ int establish_connection(const char* ip_address, uint16_t port) {
     return connection_socket;
 }
 
+// Append one request with the client's ID to the output queue
+static void queue_request(subscriber_client_t *client, tcp_request_t& request) {
+    strcpy(request.id, client->id);
+    client->out.append((const char*)&request, sizeof(request));
+}
+
+subscriber_client_t *subscriber_connect(const char *ip_address, uint16_t port, const char *id, uint32_t flags,
+                                        uint64_t resume_seq) {
+    if (strlen(id) > 10 || (flags & ~(CONNECT_TRACE | CONNECT_SEQ | CONNECT_COMPRESS))) {
+        errno = EINVAL;
+        return nullptr;
+    }
+
+    sockaddr_in server_info{};
+    server_info.sin_family = AF_INET;
+    server_info.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip_address, &server_info.sin_addr) <= 0) {
+        errno = EINVAL;
+        return nullptr;
+    }
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return nullptr;
+    }
+    int option_value = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &option_value, sizeof(int));
+
+    // Completion is reported as writability
+    if (connect(fd, (sockaddr*)&server_info, sizeof(server_info)) < 0 && errno != EINPROGRESS) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return nullptr;
+    }
+
+    subscriber_client_t *client = new subscriber_client_t;
+    client->fd = fd;
+    strcpy(client->id, id);
+    client->connecting = true;
+    client->closed = false;
+    client->out_sent = 0;
+    client->in.resize(SUBSCRIBER_BUFFER_SIZE);
+    client->in_start = client->in_end = 0;
+    client->decoder = (flags & CONNECT_COMPRESS) ? new lz_decoder_t : nullptr;
+    client->blocks_used = 0;
+    client->plain = nullptr;
+    client->plain_len = 0;
+
+    tcp_request_t connect_packet = {};
+    connect_packet.type = MESSAGE;
+    connect_packet.connect.message = CONNECT;
+    connect_packet.connect.flags = flags;
+    connect_packet.connect.resume_seq = resume_seq;
+    queue_request(client, connect_packet);
+    return client;
+}
+
+int subscriber_subscribe(subscriber_client_t *client, const char *const *patterns, int count, bool sf) {
+    for (int i = 0; i < count; ++i) {
+        if (strlen(patterns[i]) >= sizeof(subscribe_t::topic)) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < count; ++i) {
+        tcp_request_t sub_req = {};
+        sub_req.type = SUBSCRIBE;
+        strcpy(sub_req.subscribe.topic, patterns[i]);
+        sub_req.subscribe.sf = sf;
+        queue_request(client, sub_req);
+    }
+    return 0;
+}
+
+int subscriber_unsubscribe(subscriber_client_t *client, const char *const *patterns, int count) {
+    for (int i = 0; i < count; ++i) {
+        if (strlen(patterns[i]) >= sizeof(unsubscribe_t::topic)) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < count; ++i) {
+        tcp_request_t unsub_req = {};
+        unsub_req.type = UNSUBSCRIBE;
+        strcpy(unsub_req.unsubscribe.topic, patterns[i]);
+        queue_request(client, unsub_req);
+    }
+    return 0;
+}
+
+int subscriber_aggregate(subscriber_client_t *client, const char *pattern, uint32_t window_ms) {
+    if (strlen(pattern) >= sizeof(aggregate_t::topic)) {
+        return -1;
+    }
+    tcp_request_t agg_req = {};
+    agg_req.type = AGGREGATE;
+    strcpy(agg_req.aggregate.topic, pattern);
+    agg_req.aggregate.window_ms = htonl(window_ms);
+    queue_request(client, agg_req);
+    return 0;
+}
+
+void subscriber_ack(subscriber_client_t *client, uint64_t seq) {
+    tcp_request_t ack_req = {};
+    ack_req.type = ACK;
+    ack_req.ack.seq = seq;
+    queue_request(client, ack_req);
+}
+
+// Write as much of the output queue as the socket takes
+static bool flush_requests(subscriber_client_t *client) {
+    while (client->out_sent < client->out.size()) {
+        ssize_t rc = send(client->fd, client->out.data() + client->out_sent,
+                          client->out.size() - client->out_sent, MSG_NOSIGNAL);
+        if (rc < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+        client->out_sent += rc;
+    }
+    client->out.clear();
+    client->out_sent = 0;
+    return true;
+}
+
+int subscriber_poll(subscriber_client_t *client) {
+    if (client->closed) {
+        return -1;
+    }
+
+    if (client->connecting) {
+        struct pollfd pfd = {client->fd, POLLOUT, 0};
+        if (poll(&pfd, 1, 0) <= 0) {
+            return 0;
+        }
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(client->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            client->closed = true;
+            return -1;
+        }
+        client->connecting = false;
+    }
+
+    if (!flush_requests(client)) {
+        client->closed = true;
+        return -1;
+    }
+
+    // Views into decompressed blocks end here too; the frames not yet taken move first
+    if (client->blocks_used > 0) {
+        if (client->plain_len > 0) {
+            memmove(client->blocks[0], client->plain, client->plain_len);
+            client->plain = client->blocks[0];
+            client->blocks_used = 1;
+        } else {
+            client->blocks_used = 0;
+        }
+    }
+
+    // Move the partial frame at the end to the front, then fill the rest
+    if (client->in_start > 0) {
+        memmove(client->in.data(), client->in.data() + client->in_start, client->in_end - client->in_start);
+        client->in_end -= client->in_start;
+        client->in_start = 0;
+    }
+    while (client->in_end < client->in.size()) {
+        ssize_t rc = recv(client->fd, client->in.data() + client->in_end, client->in.size() - client->in_end, 0);
+        if (rc > 0) {
+            client->in_end += rc;
+            continue;
+        }
+        if (rc < 0 && errno == EINTR) {
+            continue;
+        }
+        if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        client->closed = true;  // Server disconnected or error
+        return -1;
+    }
+    return 0;
+}
+
+// Decode one frame; false for frames that carry no message
+static bool take_frame(subscriber_client_t *client, int header, const char *body, size_t len,
+                       decoded_message_t& message) {
+    if (header & FRAME_CONTROL) {
+        tcp_request_t control_msg;
+        if (len != sizeof(control_msg)) {
+            client->closed = true;
+            client->in_start = client->in_end;
+            client->plain_len = 0;
+            return false;
+        }
+        memcpy(&control_msg, body, sizeof(control_msg));
+        if (control_msg.message == SHUTDOWN) {
+            client->closed = true;
+        }
+        return false;
+    }
+    if (header & FRAME_DOORBELL) {
+        return false;
+    }
+
+    // The sequence number and the stamps stay in the buffer; the message follows them
+    uint64_t seq = 0;
+    if (header & FRAME_SEQ) {
+        if (len < sizeof(seq)) {
+            return false;
+        }
+        memcpy(&seq, body, sizeof(seq));
+        seq = be64toh(seq);
+        body += sizeof(seq);
+        len -= sizeof(seq);
+    }
+    const trace_stamps_t *trace = nullptr;
+    if (header & FRAME_TRACE) {
+        if (len < sizeof(trace_stamps_t)) {
+            return false;
+        }
+        trace = (const trace_stamps_t*)body;
+        body += sizeof(trace_stamps_t);
+        len -= sizeof(trace_stamps_t);
+    }
+
+    if (!message_decode(body, len, message)) {
+        return false;
+    }
+    message.trace = trace;
+    message.seq = seq;
+    return true;
+}
+
+// Decompress a FRAME_COMPRESSED body into the next free block and start taking frames from it
+static bool open_block(subscriber_client_t *client, const char *body, size_t len) {
+    uint32_t raw_len;
+    if (!client->decoder || len < sizeof(raw_len)) {
+        return false;
+    }
+    memcpy(&raw_len, body, sizeof(raw_len));
+    raw_len = ntohl(raw_len);
+    const char *block = lz_decompress(*client->decoder, body + sizeof(raw_len), len - sizeof(raw_len), raw_len);
+    if (!block) {
+        return false;
+    }
+
+    // The decoder reuses its history, so the frames are kept where views can point at them
+    if (client->blocks_used == client->blocks.size()) {
+        client->blocks.push_back(new char[LZ_BLOCK_MAX]);
+    }
+    char *copy = client->blocks[client->blocks_used++];
+    memcpy(copy, block, raw_len);
+    client->plain = copy;
+    client->plain_len = raw_len;
+    return true;
+}
+
+bool subscriber_next(subscriber_client_t *client, decoded_message_t& message) {
+    while (true) {
+        int header;
+        size_t len;
+        const char *body;
+
+        if (client->plain_len > 0) {
+            // Frames of a decompressed block come before anything received after it
+            if (client->plain_len < sizeof(header)) {
+                client->closed = true;
+                client->plain_len = 0;
+                return false;
+            }
+            memcpy(&header, client->plain, sizeof(header));
+            len = header & FRAME_LEN_MASK;
+            if (len > client->plain_len - sizeof(header) || (header & FRAME_COMPRESSED)) {
+                client->closed = true;
+                client->plain_len = 0;
+                return false;
+            }
+            body = client->plain + sizeof(header);
+            client->plain += sizeof(header) + len;
+            client->plain_len -= sizeof(header) + len;
+        } else {
+            if (client->in_end - client->in_start < sizeof(header)) {
+                return false;
+            }
+            char *frame = client->in.data() + client->in_start;
+            memcpy(&header, frame, sizeof(header));
+            len = header & FRAME_LEN_MASK;
+
+            // A frame that can never fit the buffer is not from a broker
+            if (sizeof(header) + len > client->in.size()) {
+                client->closed = true;
+                client->in_start = client->in_end;
+                return false;
+            }
+            if (client->in_end - client->in_start < sizeof(header) + len) {
+                return false;
+            }
+            client->in_start += sizeof(header) + len;
+            body = frame + sizeof(header);
+
+            if (header & FRAME_COMPRESSED) {
+                if (!open_block(client, body, len)) {
+                    client->closed = true;  // The stream cannot be followed past a corrupt block
+                    client->in_start = client->in_end;
+                    return false;
+                }
+                continue;
+            }
+        }
+
+        if (take_frame(client, header, body, len, message)) {
+            return true;
+        }
+    }
+}
+
+int subscriber_dispatch(subscriber_client_t *client, subscriber_callback_t callback, void *context) {
+    decoded_message_t message;
+    int count = 0;
+    while (subscriber_next(client, message)) {
+        callback(message, context);
+        count++;
+    }
+    return count;
+}
+
+void subscriber_close(subscriber_client_t *client) {
+    if (!client->closed && !client->connecting) {
+        tcp_request_t exit_req = {};
+        exit_req.type = EXIT;
+        queue_request(client, exit_req);
+        flush_requests(client);
+    }
+    close(client->fd);
+    for (char *block : client->blocks) {
+        delete[] block;
+    }
+    delete client->decoder;
+    delete client;
+}
+
+#ifndef SUBSCRIBER_NO_MAIN
 int main(int arg_count, char* arg_values[]) {
-    // Validate command line arguments
-    if (arg_count != 4) {
-        std::cerr << "Usage: " << arg_values[0] << " CLIENT_ID SERVER_IP SERVER_PORT\n";
+    static const struct option long_options[] = {
+        {"trace-latency", no_argument, nullptr, 't'},
+        {"shm", no_argument, nullptr, 'm'},
+        {"seq-file", required_argument, nullptr, 's'},
+        {"compress", no_argument, nullptr, 'z'},
+        {"multicast", no_argument, nullptr, 'g'},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    bool trace = false, shm = false, compress = false, multicast = false, valid = true;
+    const char* seq_path = nullptr;
+    int opt;
+    while ((opt = getopt_long(arg_count, arg_values, "", long_options, nullptr)) != -1) {
+        if (opt == 't') {
+            trace = true;
+        } else if (opt == 'm') {
+            shm = true;
+        } else if (opt == 's') {
+            seq_path = optarg;
+        } else if (opt == 'z') {
+            compress = true;
+        } else if (opt == 'g') {
+            multicast = true;
+        } else {
+            valid = false;
+        }
+    }
+
+    // Validate command line arguments; compression applies to TCP delivery only,
+    // and the multicast group carries plain frames only
+    if (!valid || arg_count - optind != 3 || (shm && compress) ||
+        (multicast && (trace || shm || compress || seq_path))) {
+        std::cerr << "Usage: " << arg_values[0] << " CLIENT_ID SERVER_IP SERVER_PORT [--trace-latency] [--shm | --compress] [--seq-file PATH]\n"
+                  << "       " << arg_values[0] << " CLIENT_ID SERVER_IP SERVER_PORT --multicast\n";
         return EXIT_FAILURE;
     }
+    char** args = arg_values + optind - 1;
 
     // Disable output buffering for immediate feedback
     setvbuf(stdout, nullptr, _IONBF, 0);
 
     // Parse and validate port number
     char* validation_end;
-    long numeric_port = strtol(arg_values[3], &validation_end, 10);
+    long numeric_port = strtol(args[3], &validation_end, 10);
     if (*validation_end != '\0' || numeric_port < 1 || numeric_port > 65535) {
         std::cerr << "Invalid port number\n";
         return EXIT_FAILURE;
     }
 
     // Connect to server and run client
-    int client_socket = establish_connection(arg_values[2], numeric_port);
-    subscriber(client_socket, arg_values[1]);
+    if (trace) {
+        latency_trace = new latency_trace_t;
+    }
+    
+    // The ring goes to the server before the CONNECT that claims it with the token
+    if (shm) {
+        int ring_fd;
+        delivery_ring = shm_ring_create(SHM_RING_SIZE, ring_fd);
+        exit_on_failure(delivery_ring == nullptr, "Shared-memory ring creation failed");
+        bool offered = getrandom(delivery_ring_token, SHM_TOKEN_SIZE, 0) == (ssize_t)SHM_TOKEN_SIZE &&
+                       shm_ring_offer(ring_fd, numeric_port, delivery_ring_token);
+        close(ring_fd);
+        if (!offered) {
+            std::cerr << "No server takes rings on this host, using TCP\n";
+            shm_ring_detach(delivery_ring);
+            delivery_ring = nullptr;
+        }
+    }
+
+    if (compress) {
+        stream_decoder = new lz_decoder_t;
+    }
+
+    // Plain TCP delivery can be replaced by the server's multicast group for hot topics
+    if (multicast) {
+        multicast_receiver = new multicast_receiver_t;
+    }
+
+    // Resume after the last message a previous run processed
+    if (seq_path) {
+        seq_fd = seq_open(seq_path);
+        exit_on_failure(seq_fd < 0, "Sequence file open failed");
+    }
+
+    int client_socket = establish_connection(args[2], numeric_port);
+    subscriber(client_socket, args[1]);
     close(client_socket);
 
+    if (latency_trace) {
+        latency_report(*latency_trace, std::cerr);
+        delete latency_trace;
+    }
+    if (seq_fd >= 0) {
+        close(seq_fd);
+    }
+    delete stream_decoder;
+    if (multicast_receiver) {
+        if (multicast_receiver->fd >= 0) {
+            close(multicast_receiver->fd);
+        }
+        delete multicast_receiver;
+    }
+    shm_ring_detach(delivery_ring);
+
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
+#endif // SUBSCRIBER_NO_MAIN
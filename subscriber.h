@@ -2,6 +2,258 @@
 #define SUBSCRIBER_H
 
 #include "common.h"
+#include "metrics.h"
+#include "shm_ring.h"
+#include "lz.h"
+#include "topic.h"
+
+#include <algorithm>
+#include <set>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/random.h>
+
+/**
+ * @brief Per-stage latency of traced messages, in nanoseconds
+ */
+struct latency_trace_t {
+    histogram_t udp_queue;      ///< Kernel receive to server read
+    histogram_t matching;       ///< Server read to matching complete
+    histogram_t fanout;         ///< Matching complete to send for this subscriber
+    histogram_t delivery;       ///< Send to receive by the subscriber
+    histogram_t total;          ///< Kernel receive to receive by the subscriber
+};
+
+/**
+ * @brief Latency histograms, or nullptr when tracing was not requested
+ */
+extern latency_trace_t *latency_trace;
+
+/**
+ * @brief Ring the server delivers into, or nullptr when using TCP only
+ */
+extern shm_ring_t *delivery_ring;
+
+/**
+ * @brief Random token the delivery ring was offered to the server under
+ */
+extern uint8_t delivery_ring_token[SHM_TOKEN_SIZE];
+
+/**
+ * @brief Decoder of the compressed stream, or nullptr when not compressing
+ */
+extern lz_decoder_t *stream_decoder;
+
+/**
+ * @brief Membership of the server's multicast group
+ *
+ * The group carries every message of wide fan-out, so the client keeps the
+ * ones its own patterns match. Numbers missing from the datagrams are asked
+ * for again over TCP, and each of them is taken once, from whichever copy
+ * arrives first.
+ */
+struct multicast_receiver_t {
+    int fd = -1;                            ///< Socket joined to the group (-1 until told to join)
+    bool started = false;                   ///< MULTICAST_START received: datagrams are taken
+    bool listing = false;                   ///< JOINED sent: the server is listing the client's patterns
+    uint64_t next_mseq = 0;                 ///< Number after the highest one seen
+    std::set<uint64_t> missing;             ///< NACKed numbers not received yet
+    std::vector<std::pair<std::string, topic_matcher_t>> patterns;  ///< Subscriptions, compiled
+    std::vector<std::string> listed;        ///< Patterns the server listed since JOINED
+    std::vector<std::pair<std::string, bool>> changes;  ///< (Un)subscriptions sent since JOINED, in order
+    std::vector<char> buffer;               ///< Datagram being read
+};
+
+/**
+ * @brief Multicast state, or nullptr when the client does not offer to join
+ */
+extern multicast_receiver_t *multicast_receiver;
+
+/**
+ * @brief File holding the last processed sequence number (-1 when not resuming)
+ */
+extern int seq_fd;
+
+/**
+ * @brief Sequence number of the last message processed
+ */
+extern uint64_t last_seq;
+
+/**
+ * @brief Read the last processed sequence number from a file, creating it if needed
+ *
+ * @param path Sequence file
+ * @return int File descriptor kept open for seq_checkpoint(), -1 on failure
+ */
+int seq_open(const char* path);
+
+/**
+ * @brief Persist the last processed sequence number, then acknowledge it
+ *
+ * Called before the client waits for more input, so a whole burst of
+ * messages costs one write and one ACK.
+ *
+ * @param sockfd Socket connected to the server
+ * @param id Client ID
+ */
+void seq_checkpoint(int sockfd, const char* id);
+
+/**
+ * @brief Record the stages of one traced message
+ *
+ * @param trace Histograms to update
+ * @param stamps Stamps from the frame, in network byte order
+ * @param received_ns CLOCK_REALTIME time the frame was read
+ */
+void latency_record(latency_trace_t& trace, const trace_stamps_t& stamps, uint64_t received_ns);
+
+/**
+ * @brief Print the percentiles of every stage
+ */
+void latency_report(const latency_trace_t& trace, std::ostream& out);
+
+/**
+ * @brief Receive buffer of an embedded client; holds many frames of the largest size
+ */
+#define SUBSCRIBER_BUFFER_SIZE (256 << 10)
+
+/**
+ * @brief Embedded subscriber connection, driven by the caller's event loop
+ *
+ * The socket is non-blocking. The caller waits for subscriber_events() on
+ * subscriber_fd() (poll or level-triggered epoll), then calls
+ * subscriber_poll() to move bytes and subscriber_next() or
+ * subscriber_dispatch() to take the messages. Messages are decoded in place
+ * in a buffer allocated once, so receiving allocates nothing. Compressed
+ * blocks are decompressed into chunks that are reused from one
+ * subscriber_poll() to the next.
+ */
+struct subscriber_client_t {
+    int fd;                     ///< Socket connected (or connecting) to the server
+    char id[11];                ///< Client ID
+    bool connecting;            ///< Non-blocking connect still in progress
+    bool closed;                ///< Server hung up, shut down or sent garbage
+    std::string out;            ///< Requests not yet written to the socket
+    size_t out_sent;            ///< Bytes of out already written
+    std::vector<char> in;       ///< Frames received, SUBSCRIBER_BUFFER_SIZE bytes
+    size_t in_start;            ///< First byte not yet decoded
+    size_t in_end;              ///< End of the received bytes
+    lz_decoder_t *decoder;      ///< With CONNECT_COMPRESS, decoder of the stream
+    std::vector<char*> blocks;  ///< Decompressed blocks, LZ_BLOCK_MAX bytes each
+    size_t blocks_used;         ///< Blocks holding frames since the last poll
+    const char *plain;          ///< Frames of the current block not yet taken
+    size_t plain_len;           ///< Bytes left at plain
+};
+
+/**
+ * @brief Called for every message taken by subscriber_dispatch()
+ */
+typedef void (*subscriber_callback_t)(const decoded_message_t& message, void *context);
+
+/**
+ * @brief Start connecting to a server and queue the CONNECT request
+ *
+ * @param ip_address Server IPv4 address
+ * @param port Server port
+ * @param id Client ID (at most 10 characters)
+ * @param flags CONNECT_* options (CONNECT_TRACE, CONNECT_SEQ and CONNECT_COMPRESS apply to embedded clients)
+ * @param resume_seq With CONNECT_SEQ, last sequence number already processed
+ * @return subscriber_client_t* New client, or nullptr with errno set
+ */
+subscriber_client_t *subscriber_connect(const char *ip_address, uint16_t port, const char *id, uint32_t flags,
+                                        uint64_t resume_seq = 0);
+
+/**
+ * @brief Socket to register in the caller's event loop
+ */
+inline int subscriber_fd(const subscriber_client_t *client) {
+    return client->fd;
+}
+
+/**
+ * @brief Events to wait for: POLLIN, plus POLLOUT while requests are pending
+ *
+ * The values are the same for epoll (EPOLLIN, EPOLLOUT).
+ */
+inline short subscriber_events(const subscriber_client_t *client) {
+    return POLLIN | ((client->connecting || client->out_sent < client->out.size()) ? POLLOUT : 0);
+}
+
+/**
+ * @brief Queue subscriptions to several patterns, written together
+ *
+ * @param client Client
+ * @param patterns Topic patterns
+ * @param count Number of patterns
+ * @param sf Store-and-forward flag for all of them
+ * @return int 0, or -1 if a pattern is too long
+ */
+int subscriber_subscribe(subscriber_client_t *client, const char *const *patterns, int count, bool sf);
+
+/**
+ * @brief Queue unsubscriptions from several patterns, written together
+ *
+ * @return int 0, or -1 if a pattern is too long
+ */
+int subscriber_unsubscribe(subscriber_client_t *client, const char *const *patterns, int count);
+
+/**
+ * @brief Queue a subscription to the window aggregates of a pattern
+ *
+ * For every matching topic with INT, SHORT_REAL or FLOAT values, the server
+ * sends one AGGREGATE_VALUE message per window instead of every value.
+ * Unsubscribing from the pattern ends it for every window length.
+ *
+ * @param client Client
+ * @param pattern Topic pattern (at most 47 characters)
+ * @param window_ms Window length in milliseconds (10 ms to 1 hour)
+ * @return int 0, or -1 if the pattern is too long
+ */
+int subscriber_aggregate(subscriber_client_t *client, const char *pattern, uint32_t window_ms);
+
+/**
+ * @brief Queue an acknowledgement of every message up to a sequence number
+ *
+ * A CONNECT_SEQ client should acknowledge what it has processed, so the
+ * server can drop the SF messages it keeps for a resume.
+ */
+void subscriber_ack(subscriber_client_t *client, uint64_t seq);
+
+/**
+ * @brief Write pending requests and read what the socket has, without blocking
+ *
+ * Views returned by earlier subscriber_next() calls become invalid.
+ *
+ * @param client Client
+ * @return int 0, or -1 once the connection is closed; frames already
+ *         received can still be taken afterwards
+ */
+int subscriber_poll(subscriber_client_t *client);
+
+/**
+ * @brief Take the next received message (pull interface)
+ *
+ * Control and doorbell frames are consumed on the way; a SHUTDOWN notice
+ * marks the client closed.
+ *
+ * @param client Client
+ * @param message Filled with the message, decoded in place
+ * @return true if a message was taken
+ */
+bool subscriber_next(subscriber_client_t *client, decoded_message_t& message);
+
+/**
+ * @brief Hand every received message to a callback (push interface)
+ *
+ * @return int Number of messages delivered
+ */
+int subscriber_dispatch(subscriber_client_t *client, subscriber_callback_t callback, void *context);
+
+/**
+ * @brief Tell the server the client leaves, close the socket and free the client
+ */
+void subscriber_close(subscriber_client_t *client);
 
 /**
  * @brief Receive a string from the socket
@@ -17,17 +269,83 @@ std::string recv_string(int sockfd, int len);
  * 
  * @param sockfd Socket file descriptor
  * @param id Client ID
+ * @param flags CONNECT_* options
  */
-void send_connect_message(int sockfd, const char* id);
+void send_connect_message(int sockfd, const char* id, uint32_t flags);
 
 /**
- * @brief Send a connection message to the server
+ * @brief Handle one frame from the server, received over TCP or the ring
+ *
+ * @param header Length word of the frame (flags included)
+ * @param data Frame body
+ * @param running Cleared when the server shuts down
+ */
+void handle_frame(int header, std::string& data, bool& running);
+
+/**
+ * @brief Decompress a FRAME_COMPRESSED frame and handle the frames inside
+ *
+ * @param data Frame body: uncompressed length, then the compressed block
+ * @param running Cleared when the block is corrupt or the server shuts down
+ */
+void handle_compressed(const std::string& data, bool& running);
+
+/**
+ * @brief Handle a MULTICAST_JOIN or MULTICAST_START notice
+ *
+ * On MULTICAST_JOIN the client joins the group and answers JOINED; if it
+ * cannot, it says nothing and keeps receiving everything over TCP. On
+ * MULTICAST_START the filter becomes the patterns the server listed, with
+ * the subscriptions sent after JOINED (which the list cannot include)
+ * applied on top.
+ *
+ * @param sockfd Socket connected to the server
+ * @param id Client ID
+ * @param notice The notice
+ */
+void multicast_notice(int sockfd, const char* id, const multicast_notice_t& notice);
+
+/**
+ * @brief Take one of the patterns the server lists before MULTICAST_START
+ *
+ * @param subscription The pattern, as a SUBSCRIBE control frame carries it
+ */
+void multicast_listed(const subscribe_t& subscription);
+
+/**
+ * @brief Read every datagram waiting on the group socket and handle those for this client
+ *
+ * @param sockfd Socket connected to the server, for NACKs
+ * @param id Client ID
+ * @param running Cleared when the server shuts down
+ */
+void multicast_receive(int sockfd, const char* id, bool& running);
+
+/**
+ * @brief Handle a FRAME_REPAIR frame: a datagram NACKed earlier
+ *
+ * @param data Frame body
+ * @param running Cleared when the server shuts down
+ */
+void multicast_repaired(const std::string& data, bool& running);
+
+/**
+ * @brief Read one frame from the server socket and handle it
  * 
  * @param sockfd Socket file descriptor
  * @param id Client ID
+ * @param running Cleared when the server disconnects or shuts down
  */
 void handle_server_message(int sockfd, const char* id, bool& running);
 
+/**
+ * @brief Handle every frame waiting in the delivery ring
+ *
+ * @param ring Delivery ring
+ * @param running Cleared when the server shuts down
+ */
+void drain_ring(shm_ring_t* ring, bool& running);
+
 /**
  * @brief Send a connection message to the server
  * 
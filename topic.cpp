@@ -0,0 +1,220 @@
+#include "topic.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TOPIC_X86 1
+#endif
+
+// Turn a separator bitmask into level offsets and lengths
+static inline void fill_levels(topic_view_t& view, uint64_t mask) {
+    mask &= (1ull << view.len) - 1;  // len <= 50, padding holds no '/'
+
+    unsigned levels = 0, start = 0;
+    while (mask) {
+        unsigned pos = __builtin_ctzll(mask);
+        view.start[levels] = start;
+        view.length[levels] = pos - start;
+        levels++;
+        start = pos + 1;
+        mask &= mask - 1;
+    }
+    view.start[levels] = start;
+    view.length[levels] = view.len - start;
+    view.levels = levels + 1;
+}
+
+void topic_split_scalar(topic_view_t& view) {
+    unsigned levels = 0, start = 0;
+    for (unsigned i = 0; i < view.len; ++i) {
+        if (view.text[i] == '/') {
+            view.start[levels] = start;
+            view.length[levels] = i - start;
+            levels++;
+            start = i + 1;
+        }
+    }
+    view.start[levels] = start;
+    view.length[levels] = view.len - start;
+    view.levels = levels + 1;
+}
+
+#ifdef TOPIC_X86
+static void topic_split_sse2(topic_view_t& view) {
+    const __m128i sep = _mm_set1_epi8('/');
+    uint64_t mask = 0;
+    for (int i = 0; i < 4; ++i) {
+        __m128i chunk = _mm_load_si128((const __m128i*)(view.text + 16 * i));
+        mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, sep)) << (16 * i);
+    }
+    fill_levels(view, mask);
+}
+
+__attribute__((target("avx2")))
+static void topic_split_avx2(topic_view_t& view) {
+    const __m256i sep = _mm256_set1_epi8('/');
+    __m256i lo = _mm256_load_si256((const __m256i*)view.text);
+    __m256i hi = _mm256_load_si256((const __m256i*)(view.text + 32));
+    uint64_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, sep)) |
+                    (uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, sep)) << 32;
+    fill_levels(view, mask);
+}
+#endif
+
+static topic_split_fn resolve_split(const char **name) {
+#ifdef TOPIC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        *name = "avx2";
+        return topic_split_avx2;
+    }
+    *name = "sse2";
+    return topic_split_sse2;
+#else
+    *name = "scalar";
+    return topic_split_scalar;
+#endif
+}
+
+static const char *split_kernel_name;
+static const topic_split_fn split_kernel = resolve_split(&split_kernel_name);
+
+void topic_split(topic_view_t& view) {
+    split_kernel(view);
+}
+
+const char *topic_split_kernel() {
+    return split_kernel_name;
+}
+
+void topic_view_init(topic_view_t& view, const char *text, size_t len, topic_split_fn split) {
+    if (len > TOPIC_MAX_LEN)
+        len = TOPIC_MAX_LEN;
+    memset(view.text, 0, sizeof(view.text));
+    memcpy(view.text, text, len);
+    view.len = len;
+    split(view);
+}
+
+bool topic_level_equals(const topic_view_t& x, unsigned a, const topic_view_t& y, unsigned b) {
+    int n = x.length[a];
+    if (n != y.length[b])
+        return false;
+
+    const char *p = x.text + x.start[a];
+    const char *q = y.text + y.start[b];
+#ifdef TOPIC_X86
+    // Levels start at offset <= 50 and the buffers are 80 bytes long,
+    // so every 16 byte load stays inside them
+    for (; n > 0; n -= 16, p += 16, q += 16) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p),
+                                    _mm_loadu_si128((const __m128i*)q));
+        unsigned need = n >= 16 ? 0xffff : (1u << n) - 1;
+        if (((unsigned)_mm_movemask_epi8(eq) & need) != need)
+            return false;
+    }
+    return true;
+#else
+    return memcmp(p, q, n) == 0;
+#endif
+}
+
+static inline bool is_wildcard(const topic_view_t& view, unsigned level, char wildcard) {
+    return view.length[level] == 1 && view.text[view.start[level]] == wildcard;
+}
+
+bool topic_matches_pattern(const topic_view_t& topic, const topic_view_t& pattern) {
+    // Indices for traversing the levels
+    unsigned t_idx = 0, p_idx = 0;
+    // Backtracking positions for '*' wildcard
+    unsigned t_back = 0, p_back = 0;
+    bool backtrack = false;
+
+    while (t_idx < topic.levels) {
+        if (p_idx < pattern.levels) {
+            // Case 1: Exact match or '+' wildcard (matches exactly one level)
+            if (is_wildcard(pattern, p_idx, '+') || topic_level_equals(pattern, p_idx, topic, t_idx)) {
+                t_idx++;
+                p_idx++;
+                continue;
+            }
+            // Case 2: '*' wildcard (matches any number of levels)
+            if (is_wildcard(pattern, p_idx, '*')) {
+                // Save position for backtracking
+                t_back = t_idx;
+                p_back = p_idx;
+                p_idx++;
+                backtrack = true;
+                continue;
+            }
+        }
+
+        // Case 3: Backtrack for '*' when match fails
+        if (backtrack && p_back < pattern.levels) {
+            t_back++;
+            t_idx = t_back;
+            p_idx = p_back + 1;
+            continue;
+        }
+
+        // No case matches, pattern doesn't match topic
+        return false;
+    }
+
+    // Check if remaining pattern levels are only '*' wildcards
+    while (p_idx < pattern.levels && is_wildcard(pattern, p_idx, '*')) {
+        p_idx++;
+    }
+
+    // All levels must be processed for a complete match
+    return (t_idx == topic.levels && p_idx == pattern.levels);
+}
+
+bool topic_matches_pattern(const std::string& topic, const std::string& pattern) {
+    topic_view_t topic_view, pattern_view;
+    topic_view_init(topic_view, topic.data(), topic.size());
+    topic_view_init(pattern_view, pattern.data(), pattern.size());
+    return topic_matches_pattern(topic_view, pattern_view);
+}
+
+topic_matcher_t topic_compile(const std::string& pattern) {
+    topic_view_t view;
+    topic_view_init(view, pattern.data(), pattern.size());
+
+    unsigned stars = 0, pluses = 0;
+    for (unsigned i = 0; i < view.levels; ++i) {
+        stars += is_wildcard(view, i, '*');
+        pluses += is_wildcard(view, i, '+');
+    }
+
+    if (stars == 0 && pluses == 0) {
+        topic_matcher<TOPIC_EXACT> exact;
+        memcpy(exact.text, view.text, sizeof(exact.text));
+        exact.len = view.len;
+        return exact;
+    }
+
+    if (stars == 0) {
+        topic_matcher<TOPIC_LEVELS> levels;
+        levels.pattern = view;
+        levels.literals = 0;
+        for (unsigned i = 0; i < view.levels; ++i) {
+            if (!is_wildcard(view, i, '+'))
+                levels.literal[levels.literals++] = i;
+        }
+        return levels;
+    }
+
+    if (stars == 1 && pluses == 0 && is_wildcard(view, view.levels - 1, '*')) {
+        topic_matcher<TOPIC_PREFIX> prefix;
+        memset(prefix.prefix, 0, sizeof(prefix.prefix));
+        prefix.len = view.start[view.levels - 1];
+        memcpy(prefix.prefix, view.text, prefix.len);
+        return prefix;
+    }
+
+    topic_matcher<TOPIC_GENERAL> general;
+    general.pattern = view;
+    return general;
+}
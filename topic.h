@@ -0,0 +1,192 @@
+#ifndef TOPIC_H
+#define TOPIC_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <variant>
+
+/**
+ * @brief Longest topic (and pattern) carried by the protocol
+ */
+#define TOPIC_MAX_LEN 50
+
+/**
+ * @brief Most levels a topic can have ("/" repeated 50 times has 51)
+ */
+#define TOPIC_MAX_LEVELS (TOPIC_MAX_LEN + 1)
+
+/**
+ * @brief Size of the zero padded text buffer of a topic_view_t
+ *
+ * The first 64 bytes are scanned for separators with full-width vector
+ * loads; the rest lets a 16 byte load start at any level of the topic.
+ */
+#define TOPIC_BUFFER_SIZE 80
+
+/**
+ * @brief A topic or pattern split into its '/' separated levels
+ */
+struct topic_view_t {
+    alignas(32) char text[TOPIC_BUFFER_SIZE];   ///< Topic text, zero padded
+    uint8_t len;                                ///< Length of the text
+    uint8_t levels;                             ///< Number of levels
+    uint8_t start[TOPIC_MAX_LEVELS];            ///< Offset of each level
+    uint8_t length[TOPIC_MAX_LEVELS];           ///< Length of each level
+};
+
+/**
+ * @brief Separator kernel signature: fills the levels of a loaded view
+ */
+typedef void (*topic_split_fn)(topic_view_t& view);
+
+/**
+ * @brief Split a view with the portable byte-by-byte loop
+ */
+void topic_split_scalar(topic_view_t& view);
+
+/**
+ * @brief Split a view with the fastest kernel the CPU supports
+ *
+ * AVX2 (two 32 byte compares) or SSE2 (four 16 byte compares) produce a
+ * 64 bit separator mask whose set bits are then walked; other targets use
+ * the scalar loop.
+ */
+void topic_split(topic_view_t& view);
+
+/**
+ * @brief Name of the kernel topic_split dispatches to ("avx2", "sse2", "scalar")
+ */
+const char *topic_split_kernel();
+
+/**
+ * @brief Load a topic into a view and split it
+ *
+ * @param view View to fill
+ * @param text Topic text (need not be null-terminated)
+ * @param len Length of the text, truncated to TOPIC_MAX_LEN
+ * @param split Kernel used to find the separators
+ */
+void topic_view_init(topic_view_t& view, const char *text, size_t len, topic_split_fn split = topic_split);
+
+/**
+ * @brief Compare level a of one view with level b of another
+ *
+ * Levels are compared 16 bytes at a time with vector loads when available.
+ */
+bool topic_level_equals(const topic_view_t& x, unsigned a, const topic_view_t& y, unsigned b);
+
+/**
+ * @brief Check if a split topic matches a split pattern with wildcards
+ *
+ * `+` matches exactly one level, `*` matches zero or more levels.
+ *
+ * @param topic The actual topic
+ * @param pattern The pattern with possible wildcards
+ * @return true if the topic matches the pattern
+ */
+bool topic_matches_pattern(const topic_view_t& topic, const topic_view_t& pattern);
+
+/**
+ * @brief Check if a topic matches a pattern with wildcards
+ *
+ * @param topic The actual topic string
+ * @param pattern The pattern with possible wildcards
+ * @return true if the topic matches the pattern
+ */
+bool topic_matches_pattern(const std::string& topic, const std::string& pattern);
+
+/**
+ * @brief Shapes a subscription pattern is classified into
+ */
+enum topic_shape_t {
+    TOPIC_EXACT,        ///< No wildcards: equal to the topic byte for byte
+    TOPIC_PREFIX,       ///< Literal levels followed by a single trailing `*` (or just `*`)
+    TOPIC_LEVELS,       ///< `+` wildcards only: fixed depth, literal levels compared
+    TOPIC_GENERAL       ///< Any other use of `*`, needs the backtracking matcher
+};
+
+/**
+ * @brief Matcher specialized for one pattern shape
+ */
+template <topic_shape_t Shape>
+struct topic_matcher;
+
+template <>
+struct topic_matcher<TOPIC_EXACT> {
+    char text[TOPIC_BUFFER_SIZE];   ///< Pattern text, zero padded
+    uint8_t len;                    ///< Length of the pattern
+
+    bool matches(const topic_view_t& topic) const {
+        return topic.len == len && memcmp(topic.text, text, len) == 0;
+    }
+};
+
+template <>
+struct topic_matcher<TOPIC_PREFIX> {
+    char prefix[TOPIC_BUFFER_SIZE]; ///< Literal levels including the final '/' ("" for `*`)
+    uint8_t len;                    ///< Length of the prefix
+
+    // `a/b/*` matches `a/b` itself and anything starting with `a/b/`
+    bool matches(const topic_view_t& topic) const {
+        if (topic.len >= len)
+            return memcmp(topic.text, prefix, len) == 0;
+        return topic.len + 1 == len && memcmp(topic.text, prefix, topic.len) == 0;
+    }
+};
+
+template <>
+struct topic_matcher<TOPIC_LEVELS> {
+    topic_view_t pattern;               ///< The split pattern
+    uint8_t literals;                   ///< Number of levels that are not `+`
+    uint8_t literal[TOPIC_MAX_LEVELS];  ///< Indices of those levels
+
+    bool matches(const topic_view_t& topic) const {
+        if (topic.levels != pattern.levels)
+            return false;
+        for (unsigned i = 0; i < literals; ++i) {
+            if (!topic_level_equals(pattern, literal[i], topic, literal[i]))
+                return false;
+        }
+        return true;
+    }
+};
+
+template <>
+struct topic_matcher<TOPIC_GENERAL> {
+    topic_view_t pattern;       ///< The split pattern
+
+    bool matches(const topic_view_t& topic) const {
+        return topic_matches_pattern(topic, pattern);
+    }
+};
+
+/**
+ * @brief A compiled pattern: one of the specialized matchers
+ */
+typedef std::variant<topic_matcher<TOPIC_EXACT>, topic_matcher<TOPIC_PREFIX>,
+                     topic_matcher<TOPIC_LEVELS>, topic_matcher<TOPIC_GENERAL>> topic_matcher_t;
+
+/**
+ * @brief Classify a pattern and build the matcher for its shape
+ *
+ * @param pattern Pattern text, truncated to TOPIC_MAX_LEN
+ * @return topic_matcher_t Matcher equivalent to topic_matches_pattern with that pattern
+ */
+topic_matcher_t topic_compile(const std::string& pattern);
+
+/**
+ * @brief Shape of a compiled pattern
+ */
+inline topic_shape_t topic_shape(const topic_matcher_t& matcher) {
+    return (topic_shape_t)matcher.index();
+}
+
+/**
+ * @brief Check a split topic against a compiled pattern
+ */
+inline bool topic_matches(const topic_matcher_t& matcher, const topic_view_t& topic) {
+    return std::visit([&topic](const auto& kind) { return kind.matches(topic); }, matcher);
+}
+
+#endif // TOPIC_H
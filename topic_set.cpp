@@ -0,0 +1,127 @@
+#include "topic_set.h"
+
+static bool pattern_less(const subscription_t* a, const subscription_t* b) {
+    return a->pattern < b->pattern;
+}
+
+int topic_set_find(const topic_set_t* set, const subscription_t* subscription) {
+    if (!set)
+        return -1;
+
+    const auto& patterns = set->patterns;
+    if (patterns.size() <= TOPIC_SET_SCAN_MAX) {
+        for (size_t i = 0; i < patterns.size(); ++i) {
+            if (patterns[i] == subscription)
+                return i;
+        }
+        return -1;
+    }
+
+    auto it = std::lower_bound(patterns.begin(), patterns.end(), subscription, pattern_less);
+    return it != patterns.end() && *it == subscription ? it - patterns.begin() : -1;
+}
+
+const topic_set_t* topic_set_intern(ServerState& state, topic_set_t&& candidate) {
+    size_t count = candidate.patterns.size();
+    if (count == 0)
+        return nullptr;
+    candidate.sf.resize((count + 63) / 64);
+
+    if (!std::is_sorted(candidate.patterns.begin(), candidate.patterns.end(), pattern_less)) {
+        std::vector<std::pair<subscription_t*, bool>> entries;
+        entries.reserve(count);
+        for (size_t i = 0; i < count; ++i)
+            entries.emplace_back(candidate.patterns[i], topic_set_sf(&candidate, i));
+        std::stable_sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) {
+            return pattern_less(a.first, b.first);
+        });
+
+        std::fill(candidate.sf.begin(), candidate.sf.end(), 0);
+        for (size_t i = 0; i < count; ++i) {
+            candidate.patterns[i] = entries[i].first;
+            candidate.sf[i / 64] |= (uint64_t)entries[i].second << (i % 64);
+        }
+    }
+
+    size_t hash = count;
+    for (const auto* subscription : candidate.patterns)
+        hash = hash * 31 + std::hash<const void*>()(subscription);
+    for (uint64_t word : candidate.sf)
+        hash = hash * 31 + std::hash<uint64_t>()(word);
+    candidate.hash = hash;
+
+    if (!state.topic_sets)
+        state.topic_sets = new topic_set_table_t;
+
+    auto found = state.topic_sets->sets.find(&candidate);
+    if (found != state.topic_sets->sets.end()) {
+        (*found)->refs++;
+        return *found;
+    }
+
+    topic_set_t* set = new topic_set_t{std::move(candidate.patterns), std::move(candidate.sf), hash, 1};
+    set->patterns.shrink_to_fit();
+    state.topic_sets->sets.insert(set);
+    return set;
+}
+
+void topic_set_release(ServerState& state, const topic_set_t* set) {
+    if (!set || --const_cast<topic_set_t*>(set)->refs > 0)
+        return;
+
+    state.topic_sets->sets.erase(const_cast<topic_set_t*>(set));
+    delete set;
+}
+
+const topic_set_t* topic_set_add(ServerState& state, const topic_set_t* set, subscription_t* subscription,
+                                 bool sf) {
+    topic_set_t candidate;
+    if (set) {
+        candidate.patterns = set->patterns;
+        candidate.sf = set->sf;
+    }
+
+    int index = topic_set_find(set, subscription);
+    if (index < 0) {
+        // Insert in pattern order, shifting the flags that follow by one bit
+        auto& patterns = candidate.patterns;
+        index = std::lower_bound(patterns.begin(), patterns.end(), subscription, pattern_less) -
+                patterns.begin();
+        patterns.insert(patterns.begin() + index, subscription);
+        candidate.sf.resize((patterns.size() + 63) / 64);
+        for (size_t i = patterns.size() - 1; i > (size_t)index; --i) {
+            candidate.sf[i / 64] &= ~(1ull << (i % 64));
+            candidate.sf[i / 64] |= (uint64_t)topic_set_sf(&candidate, i - 1) << (i % 64);
+        }
+    }
+    candidate.sf[index / 64] &= ~(1ull << (index % 64));
+    candidate.sf[index / 64] |= (uint64_t)sf << (index % 64);
+
+    const topic_set_t* result = topic_set_intern(state, std::move(candidate));
+    topic_set_release(state, set);
+    return result;
+}
+
+const topic_set_t* topic_set_remove(ServerState& state, const topic_set_t* set,
+                                    const subscription_t* subscription) {
+    int index = topic_set_find(set, subscription);
+    if (index < 0)
+        return set;
+
+    // Copy around the removed pattern, shifting the flags that follow down one bit
+    topic_set_t candidate;
+    size_t count = set->patterns.size() - 1;
+    candidate.patterns.reserve(count);
+    candidate.sf.assign((count + 63) / 64, 0);
+    for (size_t i = 0, j = 0; i <= count; ++i) {
+        if (i == (size_t)index)
+            continue;
+        candidate.patterns.push_back(set->patterns[i]);
+        candidate.sf[j / 64] |= (uint64_t)topic_set_sf(set, i) << (j % 64);
+        ++j;
+    }
+
+    const topic_set_t* result = topic_set_intern(state, std::move(candidate));
+    topic_set_release(state, set);
+    return result;
+}
@@ -0,0 +1,106 @@
+#ifndef TOPIC_SET_H
+#define TOPIC_SET_H
+
+#include "server.h"
+
+#include <unordered_set>
+
+/**
+ * @brief Sets of at most this many patterns are searched linearly
+ */
+#define TOPIC_SET_SCAN_MAX 16
+
+/**
+ * @brief An interned, immutable set of subscriptions with their SF flags
+ *
+ * Clients that subscribed to the same patterns with the same flags share
+ * one set; a client that changes its subscriptions moves to another set.
+ * Patterns are kept in pattern order, so listings come out sorted.
+ */
+struct topic_set_t {
+    std::vector<subscription_t*> patterns;  ///< Subscriptions, sorted by pattern text
+    std::vector<uint64_t> sf;               ///< Bit i: store-and-forward for patterns[i]
+    size_t hash;                            ///< Hash of the patterns and flags
+    uint32_t refs;                          ///< Clients using the set
+};
+
+struct topic_set_hash_t {
+    size_t operator()(const topic_set_t* set) const { return set->hash; }
+};
+
+struct topic_set_equal_t {
+    bool operator()(const topic_set_t* a, const topic_set_t* b) const {
+        return a->patterns == b->patterns && a->sf == b->sf;
+    }
+};
+
+/**
+ * @brief Every set in use, each stored once
+ */
+struct topic_set_table_t {
+    std::unordered_set<topic_set_t*, topic_set_hash_t, topic_set_equal_t> sets;
+};
+
+/**
+ * @brief Whether the pattern at an index of a set is store-and-forward
+ */
+inline bool topic_set_sf(const topic_set_t* set, size_t index) {
+    return (set->sf[index / 64] >> (index % 64)) & 1;
+}
+
+/**
+ * @brief Number of patterns in a set (nullptr is the empty set)
+ */
+inline size_t topic_set_size(const topic_set_t* set) {
+    return set ? set->patterns.size() : 0;
+}
+
+/**
+ * @brief Find a subscription in a set
+ *
+ * @param set Set to search (nullptr is the empty set)
+ * @param subscription Subscription to look for
+ * @return int Its index in the set, -1 if it is not there
+ */
+int topic_set_find(const topic_set_t* set, const subscription_t* subscription);
+
+/**
+ * @brief Share an equal set if one exists, otherwise store this one
+ *
+ * The candidate's patterns may come in any order; they are sorted here.
+ *
+ * @param state Server state
+ * @param candidate Patterns and flags of the set (consumed)
+ * @return const topic_set_t* Interned set holding one more reference (nullptr if empty)
+ */
+const topic_set_t* topic_set_intern(ServerState& state, topic_set_t&& candidate);
+
+/**
+ * @brief Drop a reference to a set, freeing it with the last one
+ */
+void topic_set_release(ServerState& state, const topic_set_t* set);
+
+/**
+ * @brief The set with a subscription added, or its flag changed
+ *
+ * @param state Server state
+ * @param set Current set, whose reference is given up (nullptr is the empty set)
+ * @param subscription Subscription to add
+ * @param sf Store-and-forward flag
+ * @return const topic_set_t* Interned result
+ */
+const topic_set_t* topic_set_add(ServerState& state, const topic_set_t* set, subscription_t* subscription,
+                                 bool sf);
+
+/**
+ * @brief The set without a subscription
+ *
+ * @param state Server state
+ * @param set Current set, whose reference is given up (nullptr is the empty set)
+ * @param subscription Subscription to remove
+ * @return const topic_set_t* Interned result (nullptr if empty)
+ */
+const topic_set_t* topic_set_remove(ServerState& state, const topic_set_t* set,
+                                    const subscription_t* subscription);
+
+#endif // TOPIC_SET_H